@@ -16,6 +16,54 @@
 
 #include "aesd-circular-buffer.h"
 
+/**
+* @return the number of entries held by @param buffer
+*/
+static uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full)
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    return (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs) %
+           AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* @return the position in the entry array of the @param index th entry held, 0 being the oldest
+*/
+static uint32_t aesd_circular_buffer_pos(const struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    return (buffer->out_offs + index) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* @return the start of the entry at @param pos relative to the oldest entry held.  Unsigned
+* subtraction keeps this right after the cumulative offsets wrap around.
+*/
+static size_t aesd_circular_buffer_rel_start(const struct aesd_circular_buffer *buffer, uint32_t pos)
+{
+    return buffer->entry_start[pos] - buffer->entry_start[buffer->out_offs];
+}
+
+/**
+* Binary searches entries @param lo up to @param hi, counted from the oldest held, for the last
+* one starting at or before @param char_offset, which is below the end of the buffer.  Zero
+* sized entries share their start with the next one, so the last is the one holding the byte.
+* @return the index of the entry found
+*/
+static uint32_t aesd_circular_buffer_search(const struct aesd_circular_buffer *buffer,
+            uint32_t lo, uint32_t hi, size_t char_offset)
+{
+    while (hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (aesd_circular_buffer_rel_start(buffer, aesd_circular_buffer_pos(buffer, mid)) <= char_offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -25,26 +73,84 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ * Runs in O(log n), binary searching the start offsets kept by aesd_circular_buffer_add_entry().
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    if ((buffer->in_offs == buffer->out_offs) && !buffer->full)
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint32_t pos;
+
+    if (count == 0 || char_offset >= buffer->end - buffer->entry_start[buffer->out_offs])
         return NULL;
 
-    uint8_t pos = buffer->out_offs;
-    size_t offset = 0;
-    do {
-        if (char_offset < offset + buffer->entry[pos].size)
+    pos = aesd_circular_buffer_pos(buffer, aesd_circular_buffer_search(buffer, 0, count, char_offset));
+    *entry_offset_byte_rtn = char_offset - aesd_circular_buffer_rel_start(buffer, pos);
+    return &buffer->entry[pos];
+}
+
+/**
+* Like aesd_circular_buffer_find_entry_offset_for_fpos(), but starts from the entry @param cursor last
+* matched, so reading forward through the buffer costs O(1) per call.  Falls back to a binary search
+* when char_offset is behind the cursor or further ahead than the next entry, or when the cursor's
+* entry was removed since.  Any necessary locking must be performed by caller.
+* @param cursor set up by aesd_circular_buffer_cursor_init(), updated to the entry returned
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_cursor_find(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_cursor *cursor, size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint32_t index = 0;
+    uint32_t pos;
+
+    if (count == 0 || char_offset >= buffer->end - buffer->entry_start[buffer->out_offs])
+        return NULL;
+
+    if (cursor->valid)
+    {
+        index = (cursor->pos + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs) %
+                AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        if (index >= count || aesd_circular_buffer_rel_start(buffer, cursor->pos) > char_offset)
+            index = 0;
+    }
+    // the entry at index starts at or before char_offset, check it and the next before searching
+    while (index + 1 < count &&
+           aesd_circular_buffer_rel_start(buffer, aesd_circular_buffer_pos(buffer, index + 1)) <= char_offset)
+    {
+        if (index + 2 < count &&
+            aesd_circular_buffer_rel_start(buffer, aesd_circular_buffer_pos(buffer, index + 2)) <= char_offset)
         {
-            *entry_offset_byte_rtn = char_offset - offset;
-            return &buffer->entry[pos];
+            index = aesd_circular_buffer_search(buffer, index + 2, count, char_offset);
+            break;
         }
-        offset += buffer->entry[pos].size;
-        pos = (pos + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    } while(pos != buffer->in_offs);
+        index++;
+    }
+
+    pos = aesd_circular_buffer_pos(buffer, index);
+    cursor->pos = pos;
+    cursor->valid = true;
+    *entry_offset_byte_rtn = char_offset - aesd_circular_buffer_rel_start(buffer, pos);
+    return &buffer->entry[pos];
+}
+
+/**
+* Points @param cursor at the start of the buffer, for the first aesd_circular_buffer_cursor_find().
+*/
+void aesd_circular_buffer_cursor_init(struct aesd_circular_buffer_cursor *cursor)
+{
+    cursor->pos = 0;
+    cursor->valid = false;
+}
 
-    return NULL;
+/**
+* Points @param cursor at @param entry, held by @param buffer, for a reader that walked on past the
+* entry aesd_circular_buffer_cursor_find() returned.
+*/
+void aesd_circular_buffer_cursor_set(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_cursor *cursor, const struct aesd_buffer_entry *entry)
+{
+    cursor->pos = entry - buffer->entry;
+    cursor->valid = true;
 }
 
 /**
@@ -57,6 +163,8 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
     buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry_start[buffer->in_offs] = buffer->end;
+    buffer->end += add_entry->size;
     buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
     buffer->full = buffer->full || (buffer->in_offs == buffer->out_offs);
     if (buffer->full)
@@ -65,6 +173,25 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     }
 }
 
+/**
+* Removes the oldest entry from @param buffer, so the next add overwrites nothing.
+* Any necessary locking must be handled by the caller
+* @return the removed entry, valid until the next add, or NULL if the buffer is empty.  Any memory
+* it references is the caller's to free.
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *entry;
+
+    if ((buffer->in_offs == buffer->out_offs) && !buffer->full)
+        return NULL;
+
+    entry = &buffer->entry[buffer->out_offs];
+    buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->full = false;
+    return entry;
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
 */
@@ -16,7 +16,12 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Overridable for users keeping a deeper window, such as aesdsocket's bounded history
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
 
 struct aesd_buffer_entry
 {
@@ -36,26 +41,60 @@ struct aesd_circular_buffer
      * An array of pointers to memory allocated for the most recent write operations
      */
     struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    /**
+     * The cumulative offset each entry starts at, counting every byte ever added, so
+     * lookups can binary search.  Only differences are meaningful, they may wrap around.
+     */
+    size_t entry_start[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    /**
+     * The cumulative offset the next entry added starts at
+     */
+    size_t end;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
 };
 
+/**
+ * Remembers the entry a sequential reader last found, see aesd_circular_buffer_cursor_find()
+ */
+struct aesd_circular_buffer_cursor
+{
+    /**
+     * The location in the entry structure last matched
+     */
+    uint32_t pos;
+    /**
+     * set to true once pos was matched
+     */
+    bool valid;
+};
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_cursor_find(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_cursor *cursor, size_t char_offset, size_t *entry_offset_byte_rtn);
+
+extern void aesd_circular_buffer_cursor_init(struct aesd_circular_buffer_cursor *cursor);
+
+extern void aesd_circular_buffer_cursor_set(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_cursor *cursor, const struct aesd_buffer_entry *entry);
+
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 /**
@@ -63,7 +102,8 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a stack allocated value used by this macro for an index, a uint8_t unless
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED was raised past 255
  * Example usage:
  * uint8_t index;
  * struct aesd_circular_buffer buffer;
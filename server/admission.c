@@ -0,0 +1,130 @@
+/**
+ * @file admission.c
+ * @brief Connection slots and the receive memory budget
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "admission.h"
+#include "metrics.h"
+#include "wake-fd.h"
+
+struct admission_config_s admission = {
+    .max_connections = 0,
+    .max_packet = 0,
+    .policy = ADMIT_DEFER,
+};
+
+struct line_budget admission_rx_budget;
+
+static struct
+{
+    atomic_long connections;
+    /**
+     * Threads blocked in admission_conn_wait() and paused event loops, which
+     * admission_conn_leave() has to wake
+     */
+    atomic_int waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t slot_free;
+    int wake_fd;
+} slots = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .slot_free = PTHREAD_COND_INITIALIZER,
+    .wake_fd = -1,
+};
+
+int admission_init(void)
+{
+    slots.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    return slots.wake_fd == -1 ? -1 : 0;
+}
+
+int admission_conn_try_enter(void)
+{
+    long n = atomic_load(&slots.connections);
+    do
+    {
+        if (admission.max_connections > 0 && n >= admission.max_connections)
+        {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak(&slots.connections, &n, n + 1));
+    return 1;
+}
+
+static void stop_waiting(void *arg)
+{
+    atomic_fetch_sub(&slots.waiters, 1);
+    pthread_mutex_unlock(&slots.mutex);
+}
+
+void admission_conn_wait(void)
+{
+    if (admission_conn_try_enter())
+    {
+        return;
+    }
+    pthread_mutex_lock(&slots.mutex);
+    // accept threads are cancelled while waiting here on shutdown
+    pthread_cleanup_push(stop_waiting, NULL);
+    atomic_fetch_add(&slots.waiters, 1);
+    while (!admission_conn_try_enter())
+    {
+        pthread_cond_wait(&slots.slot_free, &slots.mutex);
+    }
+    pthread_cleanup_pop(1);
+}
+
+void admission_conn_leave(void)
+{
+    atomic_fetch_sub(&slots.connections, 1);
+    // both sequentially consistent, so either this sees the waiter or the waiter sees the slot
+    if (atomic_load(&slots.waiters) > 0)
+    {
+        pthread_mutex_lock(&slots.mutex);
+        pthread_cond_broadcast(&slots.slot_free);
+        pthread_mutex_unlock(&slots.mutex);
+        if (slots.wake_fd != -1)
+        {
+            wake_fd_signal(slots.wake_fd);
+        }
+    }
+}
+
+int admission_conn_full(void)
+{
+    return admission.max_connections > 0 && atomic_load(&slots.connections) >= admission.max_connections;
+}
+
+long admission_connections(void)
+{
+    return atomic_load(&slots.connections);
+}
+
+void admission_pause(void)
+{
+    atomic_fetch_add(&slots.waiters, 1);
+}
+
+void admission_resume(void)
+{
+    atomic_fetch_sub(&slots.waiters, 1);
+}
+
+int admission_wake_fd(void)
+{
+    return slots.wake_fd;
+}
+
+void admission_reject(int fd)
+{
+    struct linger reset = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    close(fd);
+    metrics_add(METRIC_REJECTS, 1);
+}
@@ -0,0 +1,110 @@
+/**
+ * @file admission.h
+ * @brief Limits on connections and receive memory, and what happens over them
+ *
+ * Connections are counted from accept to close.  At the connection limit new
+ * connections are left waiting in the listen backlog until one closes
+ * (ADMIT_DEFER, ADMIT_SPILL), or accepted and reset at once (ADMIT_REJECT).
+ *
+ * Receive buffers are charged to admission_rx_budget through their line
+ * assemblers.  A connection whose buffer can't grow within the budget is closed,
+ * unless the policy is ADMIT_SPILL, which moves the packet to a spill file
+ * instead.  A connection sending a packet longer than admission.max_packet is
+ * always closed, as no policy could serve it.
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+#include "line-assembler.h"
+
+typedef enum
+{
+    ADMIT_DEFER,
+    ADMIT_REJECT,
+    ADMIT_SPILL,
+} admission_policy_t;
+
+struct admission_config_s
+{
+    /**
+     * Connections served at once, 0 for no limit
+     */
+    long max_connections;
+    /**
+     * Bytes a single packet may hold, 0 for no limit
+     */
+    size_t max_packet;
+    admission_policy_t policy;
+};
+
+extern struct admission_config_s admission;
+
+/**
+ * Budget of every connection's receive buffer together, set through its limit
+ */
+extern struct line_budget admission_rx_budget;
+
+/**
+ * Creates the eventfd returned by admission_wake_fd().
+ * @return 0 on success, -1 on failure with errno set
+ */
+extern int admission_init(void);
+
+/**
+ * Takes a connection slot if one is free.
+ * @return 1 when the slot was taken, 0 at the connection limit
+ */
+extern int admission_conn_try_enter(void);
+
+/**
+ * Takes a connection slot, blocking until one is free.  A cancellation point.
+ */
+extern void admission_conn_wait(void);
+
+/**
+ * Gives back the slot of a closed connection, waking whoever waits for one.
+ */
+extern void admission_conn_leave(void);
+
+/**
+ * @return 1 when every connection slot is taken
+ */
+extern int admission_conn_full(void);
+
+/**
+ * @return the number of connection slots taken
+ */
+extern long admission_connections(void);
+
+/**
+ * Registers an event loop that stopped accepting at the connection limit, so that
+ * admission_conn_leave() signals admission_wake_fd().  The caller must check for a
+ * free slot again afterwards, as one may have been freed before it registered.
+ */
+extern void admission_pause(void);
+
+extern void admission_resume(void);
+
+/**
+ * @return an eventfd written to whenever a slot is freed while an event loop is
+ * paused.  It is never read, so register it edge-triggered.
+ */
+extern int admission_wake_fd(void);
+
+/**
+ * Closes the just accepted @param fd with a reset instead of a FIN, so the client
+ * learns at once that it was turned away.
+ */
+extern void admission_reject(int fd);
+
+/**
+ * @return 1 when a packet of which @param len bytes were received is over the limit
+ */
+static inline int admission_packet_too_large(size_t len)
+{
+    return admission.max_packet > 0 && len > admission.max_packet;
+}
+
+#endif /* ADMISSION_H */
@@ -0,0 +1,847 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include "queue.h"
+#include "aesdsocket.h"
+#include "append-log.h"
+#include "log-command.h"
+#include "metrics.h"
+#include "admission.h"
+#include "handoff.h"
+
+#define MAX_EVENTS 64
+/**
+ * Most packets and bytes, received and replied, one connection is served per event,
+ * so a client streaming pipelined packets can't keep the rest of its loop waiting
+ */
+#define EVENT_PACKETS 32
+#define EVENT_BYTES (256 * 1024)
+
+typedef enum
+{
+    CONN_RX,
+    CONN_TX,
+    /**
+     * Sending every append from tx_offset on, see log-command.h
+     */
+    CONN_SUBSCRIBED,
+} connstate_t;
+
+struct epoll_conn_s
+{
+    struct sockaddr_in client;
+    struct epoll_loop_s *loop;
+    int conn_fd;
+    connstate_t state;
+    struct line_assembler rx;
+    /**
+     * Spill file receiving the current packet while spilling is set, see splice-ingest.h
+     */
+    struct splice_ingest ingest;
+    int spilling;
+    const char *packet;
+    size_t packet_len;
+    off_t tx_start;
+    off_t tx_offset;
+    off_t tx_end;
+    /**
+     * Set by AESDCHAR_DELTA, after which replies start at delta_sent, the end of the
+     * previous reply
+     */
+    int delta;
+    off_t delta_sent;
+    uint64_t packet_start;
+    time_t last_active;
+    /**
+     * Link in the loop's idle list, or its subscribers once subscribed
+     */
+    TAILQ_ENTRY(epoll_conn_s)
+    idle_entry;
+    /**
+     * Set while on the loop's ready list, having used up its budget with packets left
+     */
+    int ready;
+    TAILQ_ENTRY(epoll_conn_s)
+    ready_entry;
+};
+
+struct epoll_loop_s
+{
+    pthread_t thread;
+    int epoll_fd;
+    int listen_fd;
+    /**
+     * Set while the listener is out of the epoll set at the connection limit
+     */
+    int accept_paused;
+    /**
+     * Set once the listener left the epoll set for good, handing over to a new process
+     */
+    int draining;
+    /**
+     * Persistent connections of this loop, least recently active first
+     */
+    TAILQ_HEAD(idlehead, epoll_conn_s)
+    idle;
+    TAILQ_HEAD(subscriberhead, epoll_conn_s)
+    subscribers;
+    /**
+     * Connections served again after the next epoll_wait(), which the edge triggered
+     * set would not report again since their sockets were never drained
+     */
+    TAILQ_HEAD(readyhead, epoll_conn_s)
+    ready;
+};
+
+static struct epoll_loop_s *loops = NULL;
+static int num_loops = 0;
+/**
+ * Event data of the admission wake fd, the listener's being NULL
+ */
+static char admission_wake;
+/**
+ * Event data of the log's watch fd
+ */
+static char log_appended;
+/**
+ * Event data of the hand over's drain fd
+ */
+static char drain_requested;
+/**
+ * Posted by each loop once it stopped accepting
+ */
+static sem_t loops_drained;
+
+static time_t now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void epoll_conn_close(struct epoll_conn_s *conn)
+{
+    if (conn->state == CONN_SUBSCRIBED)
+    {
+        TAILQ_REMOVE(&conn->loop->subscribers, conn, idle_entry);
+        append_log_unwatch();
+    }
+    else if (config.persistent)
+    {
+        TAILQ_REMOVE(&conn->loop->idle, conn, idle_entry);
+    }
+    if (conn->ready)
+    {
+        TAILQ_REMOVE(&conn->loop->ready, conn, ready_entry);
+    }
+    // closing the fd also removes it from the epoll set
+    close(conn->conn_fd);
+    line_assembler_free(&conn->rx);
+    splice_ingest_free(&conn->ingest);
+    free(conn);
+    metrics_add(METRIC_CLOSES, 1);
+    admission_conn_leave();
+}
+
+static void epoll_conn_error(struct epoll_conn_s *conn, const char *message)
+{
+    syslog(LOG_ERR, "(epoll %s) %s: %s", inet_ntoa(conn->client.sin_addr), message, strerror(errno));
+    epoll_conn_close(conn);
+}
+
+/**
+ * Continues the packet being received into the spill file until EAGAIN or its end.
+ * @return 1 when it is complete, 0 when more data is needed, -1 on error
+ */
+static int epoll_conn_spill(struct epoll_conn_s *conn)
+{
+    while (1)
+    {
+        off_t before = conn->ingest.len;
+        int rc = splice_ingest_recv(&conn->ingest, conn->conn_fd);
+        if (rc == -1)
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        metrics_add(METRIC_BYTES_IN, conn->ingest.len - before);
+        if (rc == 1)
+        {
+            return 1;
+        }
+        if (admission_packet_too_large(conn->ingest.len))
+        {
+            metrics_add(METRIC_LIMIT_CLOSES, 1);
+            errno = EMSGSIZE;
+            return -1;
+        }
+    }
+}
+
+/**
+ * Moves the partial packet in conn->rx to the spill file and receives the rest of it there,
+ * so the connection holds no more than the peek window however long the packet is.
+ * @return as epoll_conn_spill()
+ */
+static int epoll_conn_begin_spill(struct epoll_conn_s *conn)
+{
+    size_t head_len;
+    const char *head = line_assembler_drain(&conn->rx, &head_len);
+    if (splice_ingest_begin(&conn->ingest, DATA_DIR, head, head_len) != 0)
+    {
+        return -1;
+    }
+    conn->spilling = 1;
+    return epoll_conn_spill(conn);
+}
+
+/**
+ * Looks for the next packet, draining the socket until EAGAIN or until a newline is
+ * found.  On success conn->packet and conn->packet_len describe the packet, valid until
+ * the next call, or conn->spilling is set and the packet is in the spill file.
+ * @return 1 when a full packet is available, 0 when more data is needed, 2 when a
+ * persistent client closed between packets, -1 on error or when the peer closed
+ * before completing a packet.
+ */
+static int epoll_conn_rx(struct epoll_conn_s *conn)
+{
+    if (conn->spilling)
+    {
+        return epoll_conn_spill(conn);
+    }
+
+    while (1)
+    {
+        conn->packet = line_assembler_next(&conn->rx, &conn->packet_len);
+        if (conn->packet != NULL)
+        {
+            return 1;
+        }
+        if (admission_packet_too_large(line_assembler_pending(&conn->rx)))
+        {
+            metrics_add(METRIC_LIMIT_CLOSES, 1);
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (line_assembler_pending(&conn->rx) >= SPLICE_INGEST_THRESHOLD)
+        {
+            // a bulk upload, keep the rest of it out of userspace
+            return epoll_conn_begin_spill(conn);
+        }
+
+        size_t space;
+        char *rx_ptr = line_assembler_reserve(&conn->rx, BLOCK_SIZE, &space);
+        if (rx_ptr == NULL && errno == ENOBUFS && admission.policy == ADMIT_SPILL)
+        {
+            return epoll_conn_begin_spill(conn);
+        }
+        if (rx_ptr == NULL)
+        {
+            if (errno == ENOBUFS)
+            {
+                metrics_add(METRIC_LIMIT_CLOSES, 1);
+            }
+            return -1;
+        }
+
+        ssize_t num_rx = recv(conn->conn_fd, rx_ptr, space, 0);
+        if (num_rx == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (num_rx == 0)
+        {
+            if (config.persistent && line_assembler_pending(&conn->rx) == 0)
+            {
+                return 2;
+            }
+            errno = ECONNRESET;
+            return -1;
+        }
+        line_assembler_commit(&conn->rx, num_rx);
+        metrics_add(METRIC_BYTES_IN, num_rx);
+    }
+}
+
+/**
+ * Sends a subscriber whatever was committed since its last push, until its socket is full.
+ * @return 0 on success, -1 when the connection failed and was closed
+ */
+static int epoll_subscriber_push(struct epoll_conn_s *conn)
+{
+    off_t sent = conn->tx_offset;
+    int rc = append_log_send(conn->conn_fd, &conn->tx_offset, append_log_committed());
+    metrics_add(METRIC_PUSHED_BYTES, conn->tx_offset - sent);
+    if (rc == -1)
+    {
+        epoll_conn_error(conn, "sendfile fail");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Turns the connection into a subscriber starting at @param offset.  Subscribers never
+ * time out, and anything they send after subscribing is discarded.
+ */
+static void epoll_conn_subscribe(struct epoll_conn_s *conn, off_t offset)
+{
+    if (config.persistent)
+    {
+        TAILQ_REMOVE(&conn->loop->idle, conn, idle_entry);
+    }
+    TAILQ_INSERT_TAIL(&conn->loop->subscribers, conn, idle_entry);
+    conn->state = CONN_SUBSCRIBED;
+    conn->tx_offset = offset;
+    metrics_add(METRIC_SUBSCRIBES, 1);
+    append_log_watch();
+    epoll_subscriber_push(conn);
+}
+
+static void epoll_subscriber_event(struct epoll_conn_s *conn, uint32_t events)
+{
+    if (events & (EPOLLIN | EPOLLRDHUP))
+    {
+        char discard[BLOCK_SIZE];
+        ssize_t num_rx;
+        while ((num_rx = recv(conn->conn_fd, discard, sizeof(discard), 0)) > 0)
+        {
+        }
+        if (num_rx == 0)
+        {
+            syslog(LOG_INFO, "Closed subscription from %s", inet_ntoa(conn->client.sin_addr));
+            epoll_conn_close(conn);
+            return;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            epoll_conn_error(conn, "Client connection failed");
+            return;
+        }
+    }
+    if (events & EPOLLOUT)
+    {
+        epoll_subscriber_push(conn);
+    }
+}
+
+static void epoll_conn_event(struct epoll_conn_s *conn, uint32_t events)
+{
+    if (events & EPOLLERR)
+    {
+        errno = ECONNRESET;
+        epoll_conn_error(conn, "Client connection failed");
+        return;
+    }
+
+    if (conn->state == CONN_SUBSCRIBED)
+    {
+        epoll_subscriber_event(conn, events);
+        return;
+    }
+
+    if (config.persistent)
+    {
+        conn->last_active = now_seconds();
+        TAILQ_REMOVE(&conn->loop->idle, conn, idle_entry);
+        TAILQ_INSERT_TAIL(&conn->loop->idle, conn, idle_entry);
+    }
+
+    // handle packets in order until the socket runs dry, a reply has to wait for EPOLLOUT
+    // or the connection used up its budget
+    int packets = 0;
+    size_t bytes = 0;
+    while (1)
+    {
+        if (conn->state == CONN_RX)
+        {
+            if (packets >= EVENT_PACKETS || bytes >= EVENT_BYTES)
+            {
+                if (!conn->ready)
+                {
+                    conn->ready = 1;
+                    TAILQ_INSERT_TAIL(&conn->loop->ready, conn, ready_entry);
+                }
+                return;
+            }
+            int rc = epoll_conn_rx(conn);
+            if (rc == -1)
+            {
+                epoll_conn_error(conn, "Client connection failed");
+                return;
+            }
+            if (rc == 2)
+            {
+                syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(conn->client.sin_addr));
+                epoll_conn_close(conn);
+                return;
+            }
+            if (rc == 0)
+            {
+                return;
+            }
+
+            int command = LOG_COMMAND_NONE;
+            off_t from = conn->delta ? conn->delta_sent : 0;
+            off_t len;
+            if (conn->spilling)
+            {
+                bytes += conn->ingest.len;
+                conn->packet_start = metrics_packet_received(conn->ingest.len);
+                // see append_log_append(), a loop only stops between appends
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+                len = append_log_append_file(conn->ingest.spill_fd, conn->ingest.len);
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+                conn->spilling = 0;
+                if (len != -1 && splice_ingest_reset(&conn->ingest) != 0)
+                {
+                    epoll_conn_error(conn, "Could not reset spill file");
+                    return;
+                }
+            }
+            else
+            {
+                bytes += conn->packet_len;
+                conn->packet_start = metrics_packet_received(conn->packet_len);
+                command = log_command_range(conn->packet, conn->packet_len, &from, &len);
+                if (command == -1)
+                {
+                    epoll_conn_error(conn, "Command out of range");
+                    return;
+                }
+                if (command == LOG_COMMAND_SUBSCRIBE_TO)
+                {
+                    epoll_conn_subscribe(conn, from);
+                    return;
+                }
+                if (command == LOG_COMMAND_NONE)
+                {
+                    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+                    len = append_log_append(conn->packet, conn->packet_len);
+                    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+                }
+            }
+            if (len == -1)
+            {
+                epoll_conn_error(conn, "failed to write to file");
+                return;
+            }
+            if (command == LOG_COMMAND_DELTA_FROM)
+            {
+                conn->delta = 1;
+            }
+            if (command != LOG_COMMAND_RANGE)
+            {
+                conn->delta_sent = len;
+            }
+            conn->tx_start = from;
+            conn->tx_offset = from;
+            conn->tx_end = len;
+            conn->state = CONN_TX;
+            packets++;
+        }
+
+        int rc = append_log_send(conn->conn_fd, &conn->tx_offset, conn->tx_end);
+        if (rc == -1)
+        {
+            epoll_conn_error(conn, "sendfile fail");
+            return;
+        }
+        if (rc == 0)
+        {
+            // wait for EPOLLOUT to continue the reply
+            return;
+        }
+        metrics_reply_sent(conn->tx_end - conn->tx_start, conn->packet_start);
+        bytes += conn->tx_end - conn->tx_start;
+
+        if (!config.persistent || (handoff_draining() && line_assembler_pending(&conn->rx) == 0))
+        {
+            syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(conn->client.sin_addr));
+            epoll_conn_close(conn);
+            return;
+        }
+        conn->state = CONN_RX;
+    }
+}
+
+/**
+ * Closes persistent connections that have been quiet for longer than config.idle_timeout.
+ * @return the number of milliseconds until the next connection expires, or -1 when none can
+ */
+static int epoll_expire_idle(struct epoll_loop_s *loop)
+{
+    if (!config.persistent || config.idle_timeout == 0)
+    {
+        return -1;
+    }
+
+    time_t now = now_seconds();
+    struct epoll_conn_s *conn;
+    while ((conn = TAILQ_FIRST(&loop->idle)) != NULL)
+    {
+        time_t expires = conn->last_active + config.idle_timeout;
+        if (expires > now)
+        {
+            return (expires - now) * 1000;
+        }
+        syslog(LOG_INFO, "Idle timeout on connection from %s", inet_ntoa(conn->client.sin_addr));
+        epoll_conn_close(conn);
+    }
+    return -1;
+}
+
+/**
+ * Takes the listener out of the epoll set until a connection slot is freed.
+ */
+static void epoll_pause_accept(struct epoll_loop_s *loop)
+{
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_fd, NULL) == -1)
+    {
+        syslog(LOG_ERR, "Could not pause accepting: %s", strerror(errno));
+        return;
+    }
+    loop->accept_paused = 1;
+    admission_pause();
+}
+
+static void epoll_resume_accept(struct epoll_loop_s *loop)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) == -1)
+    {
+        exit_error("Could not add server socket to epoll");
+    }
+    loop->accept_paused = 0;
+    admission_resume();
+}
+
+static void epoll_accept(struct epoll_loop_s *loop)
+{
+    while (!loop->draining)
+    {
+        int admitted = admission_conn_try_enter();
+        if (!admitted && admission.policy != ADMIT_REJECT)
+        {
+            // at the limit, further connections wait in the listen backlog
+            epoll_pause_accept(loop);
+            if (loop->accept_paused && !admission_conn_full())
+            {
+                // a slot was freed before the pause was registered
+                epoll_resume_accept(loop);
+                continue;
+            }
+            return;
+        }
+
+        struct sockaddr_in client;
+        socklen_t socklen = sizeof(client);
+        int conn_fd = accept4(loop->listen_fd, (struct sockaddr *)&client, &socklen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn_fd == -1)
+        {
+            if (admitted)
+            {
+                admission_conn_leave();
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to accept: %s", strerror(errno));
+            return;
+        }
+        if (!admitted)
+        {
+            admission_reject(conn_fd);
+            continue;
+        }
+
+        struct epoll_conn_s *conn = malloc(sizeof(struct epoll_conn_s));
+        if (conn == NULL)
+        {
+            syslog(LOG_ERR, "No connection memory available");
+            close(conn_fd);
+            admission_conn_leave();
+            continue;
+        }
+        memset(conn, 0, sizeof(struct epoll_conn_s));
+        metrics_add(METRIC_ACCEPTS, 1);
+        conn->client = client;
+        conn->conn_fd = conn_fd;
+        conn->loop = loop;
+        conn->state = CONN_RX;
+        conn->rx.budget = &admission_rx_budget;
+        splice_ingest_init(&conn->ingest);
+        if (config.persistent)
+        {
+            conn->last_active = now_seconds();
+            TAILQ_INSERT_TAIL(&loop->idle, conn, idle_entry);
+        }
+
+        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(conn->client.sin_addr));
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) == -1)
+        {
+            epoll_conn_error(conn, "Could not add connection to epoll");
+        }
+    }
+}
+
+/**
+ * Stops accepting for good and closes the connections with no packet in progress,
+ * the others closing after their reply.
+ */
+static void epoll_drain(struct epoll_loop_s *loop)
+{
+    if (!loop->accept_paused && epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_fd, NULL) == -1)
+    {
+        syslog(LOG_ERR, "Could not stop accepting: %s", strerror(errno));
+    }
+    loop->draining = 1;
+
+    struct epoll_conn_s *conn, *next;
+    TAILQ_FOREACH_SAFE(conn, &loop->idle, idle_entry, next)
+    {
+        if (conn->state == CONN_RX && !conn->spilling && line_assembler_pending(&conn->rx) == 0)
+        {
+            syslog(LOG_INFO, "Closed idle connection from %s for hand over", inet_ntoa(conn->client.sin_addr));
+            epoll_conn_close(conn);
+        }
+    }
+    TAILQ_FOREACH_SAFE(conn, &loop->subscribers, idle_entry, next)
+    {
+        syslog(LOG_INFO, "Closed subscription from %s for hand over", inet_ntoa(conn->client.sin_addr));
+        epoll_conn_close(conn);
+    }
+    sem_post(&loops_drained);
+}
+
+/**
+ * Serves the connections left on the ready list another budget's worth each, those
+ * using it up again going back on the list for the next round.
+ */
+static void epoll_serve_ready(struct epoll_loop_s *loop)
+{
+    struct readyhead ready = TAILQ_HEAD_INITIALIZER(ready);
+    struct epoll_conn_s *conn;
+    while ((conn = TAILQ_FIRST(&loop->ready)) != NULL)
+    {
+        TAILQ_REMOVE(&loop->ready, conn, ready_entry);
+        TAILQ_INSERT_TAIL(&ready, conn, ready_entry);
+    }
+    while ((conn = TAILQ_FIRST(&ready)) != NULL)
+    {
+        TAILQ_REMOVE(&ready, conn, ready_entry);
+        conn->ready = 0;
+        epoll_conn_event(conn, EPOLLIN);
+    }
+}
+
+static void *epoll_loop(void *arg)
+{
+    struct epoll_loop_s *loop = (struct epoll_loop_s *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1)
+    {
+        int timeout = epoll_expire_idle(loop);
+        if (!TAILQ_EMPTY(&loop->ready))
+        {
+            timeout = 0;
+        }
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            exit_error("epoll_wait failed");
+        }
+
+        int appended = 0;
+        int drain = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                epoll_accept(loop);
+            }
+            else if (events[i].data.ptr == &admission_wake)
+            {
+                if (loop->accept_paused && !loop->draining)
+                {
+                    epoll_resume_accept(loop);
+                }
+            }
+            else if (events[i].data.ptr == &log_appended)
+            {
+                appended = 1;
+            }
+            else if (events[i].data.ptr == &drain_requested)
+            {
+                drain = 1;
+            }
+            else
+            {
+                epoll_conn_event(events[i].data.ptr, events[i].events);
+            }
+        }
+        epoll_serve_ready(loop);
+        if (appended)
+        {
+            // the appender only wrote the eventfd, the fan-out happens here after the
+            // connection events, so none of them refers to a subscriber closed by a push
+            struct epoll_conn_s *conn, *next;
+            TAILQ_FOREACH_SAFE(conn, &loop->subscribers, idle_entry, next)
+            {
+                epoll_subscriber_push(conn);
+            }
+        }
+        if (drain && !loop->draining)
+        {
+            // likewise after the connection events, since it frees the connections it closes
+            epoll_drain(loop);
+        }
+    }
+    return NULL;
+}
+
+void epoll_server_run(const int *listen_fds, int nlisteners, int nloops)
+{
+    for (int i = 0; i < nlisteners; i++)
+    {
+        int flags = fcntl(listen_fds[i], F_GETFL);
+        if (flags == -1 || fcntl(listen_fds[i], F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            exit_error("Could not make server socket non-blocking");
+        }
+    }
+
+    loops = calloc(nloops, sizeof(struct epoll_loop_s));
+    if (loops == NULL)
+    {
+        exit_error("No loop memory available");
+    }
+
+    for (int i = 0; i < nloops; i++)
+    {
+        loops[i].listen_fd = listen_fds[i % nlisteners];
+        TAILQ_INIT(&loops[i].idle);
+        TAILQ_INIT(&loops[i].subscribers);
+        TAILQ_INIT(&loops[i].ready);
+        loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loops[i].epoll_fd == -1)
+        {
+            exit_error("Could not create epoll instance");
+        }
+
+        // loops sharing a listener wait on it together, EPOLLEXCLUSIVE wakes only one of them per connection
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].listen_fd, &ev) == -1)
+        {
+            exit_error("Could not add server socket to epoll");
+        }
+
+        // every loop hears of every freed slot, the fd is never read so each write is an edge
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &admission_wake;
+        if (admission_wake_fd() != -1 && epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, admission_wake_fd(), &ev) == -1)
+        {
+            exit_error("Could not add admission wake fd to epoll");
+        }
+        ev.data.ptr = &log_appended;
+        if (epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, append_log_watch_fd(), &ev) == -1)
+        {
+            exit_error("Could not add log watch fd to epoll");
+        }
+        ev.data.ptr = &drain_requested;
+        if (handoff_drain_fd() != -1 && epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, handoff_drain_fd(), &ev) == -1)
+        {
+            exit_error("Could not add drain fd to epoll");
+        }
+    }
+    if (sem_init(&loops_drained, 0, 0) != 0)
+    {
+        exit_error("Could not create drain semaphore");
+    }
+
+    loops[0].thread = pthread_self();
+    num_loops = 1;
+
+    for (int i = 1; i < nloops; i++)
+    {
+        if (pthread_create(&loops[i].thread, NULL, epoll_loop, &loops[i]) != 0)
+        {
+            exit_error("Could not create loop thread");
+        }
+        num_loops = i + 1;
+        if (nlisteners > 1)
+        {
+            pin_to_core(loops[i].thread, i);
+        }
+    }
+    if (nlisteners > 1)
+    {
+        // pinned last, so no loop thread inherits this one's CPU
+        pin_to_core(loops[0].thread, 0);
+    }
+
+    server_started();
+    epoll_loop(&loops[0]);
+}
+
+void epoll_server_drain(void)
+{
+    for (int i = 0; i < num_loops; i++)
+    {
+        while (sem_wait(&loops_drained) == -1 && errno == EINTR)
+        {
+        }
+    }
+}
+
+void epoll_server_stop(void)
+{
+    for (int i = 0; i < num_loops; i++)
+    {
+        if (!pthread_equal(loops[i].thread, pthread_self()))
+        {
+            pthread_cancel(loops[i].thread);
+            pthread_join(loops[i].thread, NULL);
+        }
+    }
+    num_loops = 0;
+}
@@ -0,0 +1,787 @@
+/**
+ * @file aesdsocket-load.c
+ * @brief Load generator for aesdsocket reporting throughput and tail latency
+ *
+ * Drives N concurrent connections from one epoll loop.  Every packet starts
+ * with a tag unique to the run, connection and sequence number, so the end of
+ * its reply (the data file up to and including the packet) can be found in
+ * the reply stream without knowing the file size, and the echoed packet can be
+ * checked byte by byte.
+ *
+ * Closed loop (default) sends the next packet once the previous reply is
+ * complete.  Open loop (-r) sends on a fixed schedule whatever the replies do,
+ * and measures latency from the scheduled send time so a stalled server can't
+ * hide its queueing delay.
+ *
+ * With -d every connection starts with AESDCHAR_DELTA:0, right before its first
+ * packet, so the server only sends each connection what it has not seen yet.
+ * The reply to the command and the first packet then read as one reply.
+ *
+ * Usage: aesdsocket-load [-S small|huge|slow|storm] [-H host] [-p port]
+ *        [-c connections] [-n packets] [-s size|min-max] [-r rate]
+ *        [-L slow_readers] [-R read_bytes_per_sec] [-1] [-d]
+ * Multi-packet connections need the server running persistent (-k).  Unless
+ * -d is given every reply is the whole data file, so start the server afresh
+ * for each scenario.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/**
+ * "#run:conn:seq#", run being 8 hex digits, conn 6 and seq 10 decimal digits
+ */
+#define TAG_LEN 28
+#define DELTA_COMMAND "AESDCHAR_DELTA:0\n"
+#define RX_CHUNK (256 * 1024)
+#define MAX_EVENTS 64
+
+struct pending_s
+{
+    uint64_t seq;
+    size_t len;
+    uint64_t start_ns;
+};
+
+struct load_conn_s
+{
+    int id;
+    int fd;
+    int connected;
+    int slow;
+    /**
+     * Set until AESDCHAR_DELTA was queued on the current connection
+     */
+    int negotiate_delta;
+    /**
+     * Packets generated so far, and replies completed
+     */
+    uint64_t sent;
+    uint64_t completed;
+    uint64_t next_send_ns;
+    uint64_t read_resume_ns;
+    uint32_t events;
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+    /**
+     * Packets whose replies are outstanding, oldest first
+     */
+    struct pending_s *pending;
+    size_t pending_head;
+    size_t pending_count;
+    size_t pending_cap;
+    /**
+     * Reply parsing: bytes of the current reply so far, bytes of the packet at its
+     * end still expected once the tag was found, and the last bytes seen before the
+     * tag in case it straddles two receives
+     */
+    uint64_t reply_len;
+    int tag_found;
+    size_t packet_pos;
+    char tail[TAG_LEN];
+    size_t tail_len;
+    uint64_t last_reply_len;
+};
+
+struct load_config_s
+{
+    const char *host;
+    const char *port;
+    int connections;
+    long packets;
+    size_t min_size;
+    size_t max_size;
+    double rate;
+    int slow_readers;
+    double read_rate;
+    int one_per_connection;
+    int delta;
+};
+
+struct load_stats_s
+{
+    uint64_t *latencies;
+    size_t latency_count;
+    size_t latency_cap;
+    uint64_t packets;
+    uint64_t slow_packets;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t connects;
+    uint64_t errors;
+};
+
+static struct load_config_s cfg = {
+    .host = "127.0.0.1",
+    .port = "9000",
+    .connections = 16,
+    .packets = 100,
+    .min_size = 64,
+    .max_size = 64,
+};
+
+static struct load_stats_s stats;
+static struct addrinfo *server_addr;
+static uint32_t run_id;
+static int epoll_fd;
+static char rx_buf[RX_CHUNK];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size);
+    if (p == NULL)
+    {
+        perror("realloc");
+        exit(1);
+    }
+    return p;
+}
+
+static void format_tag(char *tag, int conn_id, uint64_t seq)
+{
+    char buf[TAG_LEN + 1];
+    snprintf(buf, sizeof(buf), "#%08x:%06d:%010llu#", run_id, conn_id, (unsigned long long)seq);
+    memcpy(tag, buf, TAG_LEN);
+}
+
+/**
+ * @return byte @param i of the packet @param seq of length @param len on @param conn_id
+ */
+static inline char packet_byte(int conn_id, uint64_t seq, size_t len, size_t i)
+{
+    if (i == len - 1)
+    {
+        return '\n';
+    }
+    return 'a' + (seq + i) % 26;
+}
+
+static void conn_error(struct load_conn_s *conn, const char *message)
+{
+    if (stats.errors++ < 10)
+    {
+        fprintf(stderr, "connection %d: %s\n", conn->id, message);
+    }
+}
+
+static void update_events(struct load_conn_s *conn, uint64_t now)
+{
+    if (conn->fd == -1)
+    {
+        return;
+    }
+    uint32_t events = 0;
+    if (!conn->connected || conn->out_off < conn->out_len)
+    {
+        events |= EPOLLOUT;
+    }
+    if (conn->connected && !(conn->slow && conn->read_resume_ns > now))
+    {
+        events |= EPOLLIN;
+    }
+    if (events != conn->events)
+    {
+        struct epoll_event ev = {.events = events, .data.ptr = conn};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = events;
+    }
+}
+
+static int conn_open(struct load_conn_s *conn)
+{
+    conn->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1)
+    {
+        perror("socket");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(conn->fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1 && errno != EINPROGRESS)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    conn->connected = 0;
+    conn->events = EPOLLOUT;
+    conn->last_reply_len = 0;
+    conn->reply_len = 0;
+    conn->tag_found = 0;
+    conn->tail_len = 0;
+    conn->negotiate_delta = cfg.delta;
+    struct epoll_event ev = {.events = conn->events, .data.ptr = conn};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
+    stats.connects++;
+    return 0;
+}
+
+static void conn_close(struct load_conn_s *conn)
+{
+    if (conn->fd != -1)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->out_len = conn->out_off = 0;
+    conn->pending_count = 0;
+}
+
+static int conn_finished(struct load_conn_s *conn)
+{
+    return conn->sent >= (uint64_t)cfg.packets && conn->pending_count == 0;
+}
+
+/**
+ * Queues the next packet for sending, as scheduled at @param start.
+ */
+static void queue_packet(struct load_conn_s *conn, uint64_t start)
+{
+    size_t len = cfg.min_size;
+    if (cfg.max_size > cfg.min_size)
+    {
+        len += (size_t)(((uint64_t)rand() << 31 | rand()) % (cfg.max_size - cfg.min_size + 1));
+    }
+    uint64_t seq = conn->sent++;
+
+    if (conn->out_off == conn->out_len)
+    {
+        conn->out_off = conn->out_len = 0;
+    }
+    size_t command_len = conn->negotiate_delta ? strlen(DELTA_COMMAND) : 0;
+    if (conn->out_len + command_len + len > conn->out_cap)
+    {
+        conn->out_cap = conn->out_len + command_len + len;
+        conn->out = xrealloc(conn->out, conn->out_cap);
+    }
+    memcpy(&conn->out[conn->out_len], DELTA_COMMAND, command_len);
+    conn->out_len += command_len;
+    conn->negotiate_delta = 0;
+    char *packet = &conn->out[conn->out_len];
+    format_tag(packet, conn->id, seq);
+    for (size_t i = TAG_LEN; i < len; i++)
+    {
+        packet[i] = packet_byte(conn->id, seq, len, i);
+    }
+    conn->out_len += len;
+
+    if (conn->pending_count == conn->pending_cap)
+    {
+        size_t cap = conn->pending_cap ? conn->pending_cap * 2 : 16;
+        struct pending_s *ring = xrealloc(NULL, cap * sizeof(struct pending_s));
+        for (size_t i = 0; i < conn->pending_count; i++)
+        {
+            ring[i] = conn->pending[(conn->pending_head + i) % conn->pending_cap];
+        }
+        free(conn->pending);
+        conn->pending = ring;
+        conn->pending_head = 0;
+        conn->pending_cap = cap;
+    }
+    struct pending_s *p = &conn->pending[(conn->pending_head + conn->pending_count++) % conn->pending_cap];
+    p->seq = seq;
+    p->len = len;
+    p->start_ns = start;
+}
+
+static void record_latency(struct load_conn_s *conn, uint64_t latency)
+{
+    if (conn->slow)
+    {
+        stats.slow_packets++;
+        return;
+    }
+    if (stats.latency_count == stats.latency_cap)
+    {
+        stats.latency_cap = stats.latency_cap ? stats.latency_cap * 2 : 4096;
+        stats.latencies = xrealloc(stats.latencies, stats.latency_cap * sizeof(uint64_t));
+    }
+    stats.latencies[stats.latency_count++] = latency;
+    stats.packets++;
+}
+
+/**
+ * Consumes @param n received bytes, completing every reply that ends within them.
+ * @return 0 on success, -1 when the stream is not what the server should have sent
+ */
+static int consume_reply(struct load_conn_s *conn, const char *data, size_t n, uint64_t now)
+{
+    size_t pos = 0;
+    while (pos < n)
+    {
+        if (conn->pending_count == 0)
+        {
+            conn_error(conn, "data received with no packet outstanding");
+            return -1;
+        }
+        struct pending_s *p = &conn->pending[conn->pending_head];
+        char tag[TAG_LEN];
+        format_tag(tag, conn->id, p->seq);
+
+        if (!conn->tag_found)
+        {
+            // the tag may straddle the previous receive, so look at its tail first
+            char window[2 * TAG_LEN];
+            size_t head = n - pos < TAG_LEN - 1 ? n - pos : TAG_LEN - 1;
+            memcpy(window, conn->tail, conn->tail_len);
+            memcpy(&window[conn->tail_len], &data[pos], head);
+            const char *found = memmem(window, conn->tail_len + head, tag, TAG_LEN);
+            if (found != NULL)
+            {
+                // tag bytes from the tail were already counted in reply_len
+                size_t in_data = (found - window) + TAG_LEN - conn->tail_len;
+                conn->reply_len += in_data;
+                pos += in_data;
+            }
+            else
+            {
+                found = memmem(&data[pos], n - pos, tag, TAG_LEN);
+                if (found == NULL)
+                {
+                    conn->reply_len += n - pos;
+                    size_t keep = TAG_LEN - 1;
+                    if (n - pos >= keep)
+                    {
+                        memcpy(conn->tail, &data[n - keep], keep);
+                    }
+                    else
+                    {
+                        size_t old = conn->tail_len + (n - pos) > keep ? keep - (n - pos) : conn->tail_len;
+                        memmove(conn->tail, &conn->tail[conn->tail_len - old], old);
+                        memcpy(&conn->tail[old], &data[pos], n - pos);
+                        keep = old + (n - pos);
+                    }
+                    conn->tail_len = keep;
+                    return 0;
+                }
+                size_t in_data = (found - &data[pos]) + TAG_LEN;
+                conn->reply_len += in_data;
+                pos += in_data;
+            }
+            conn->tag_found = 1;
+            conn->packet_pos = TAG_LEN;
+            conn->tail_len = 0;
+            continue;
+        }
+
+        // the rest of our packet ends the reply
+        while (pos < n && conn->packet_pos < p->len)
+        {
+            if (data[pos] != packet_byte(conn->id, p->seq, p->len, conn->packet_pos))
+            {
+                conn_error(conn, "echoed packet corrupted");
+                return -1;
+            }
+            pos++;
+            conn->packet_pos++;
+            conn->reply_len++;
+        }
+        if (conn->packet_pos < p->len)
+        {
+            return 0;
+        }
+
+        // the log only grows, so each full reply holds the previous one plus our packet
+        if (!cfg.delta && conn->reply_len < conn->last_reply_len + p->len)
+        {
+            conn_error(conn, "reply shorter than the previous one");
+            return -1;
+        }
+        record_latency(conn, now - p->start_ns);
+        stats.bytes_in += conn->reply_len;
+        conn->last_reply_len = conn->reply_len;
+        conn->reply_len = 0;
+        conn->tag_found = 0;
+        conn->pending_head = (conn->pending_head + 1) % conn->pending_cap;
+        conn->pending_count--;
+        conn->completed++;
+    }
+    return 0;
+}
+
+/**
+ * Queues whatever packets are due and sends as much as the socket takes.
+ */
+static void conn_send(struct load_conn_s *conn, uint64_t now)
+{
+    if (cfg.rate > 0)
+    {
+        while (conn->sent < (uint64_t)cfg.packets && conn->next_send_ns <= now)
+        {
+            queue_packet(conn, conn->next_send_ns);
+            conn->next_send_ns += (uint64_t)(1e9 / cfg.rate);
+        }
+    }
+    else if (conn->pending_count == 0 && conn->sent < (uint64_t)cfg.packets)
+    {
+        queue_packet(conn, now);
+    }
+
+    while (conn->out_off < conn->out_len)
+    {
+        ssize_t n = send(conn->fd, &conn->out[conn->out_off], conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                conn_error(conn, strerror(errno));
+                conn_close(conn);
+            }
+            return;
+        }
+        conn->out_off += n;
+        stats.bytes_out += n;
+    }
+}
+
+static void conn_recv(struct load_conn_s *conn, uint64_t now)
+{
+    size_t budget = SIZE_MAX;
+    if (conn->slow)
+    {
+        // one read per period keeps the reader at cfg.read_rate
+        budget = cfg.read_rate < RX_CHUNK ? (size_t)cfg.read_rate / 10 + 1 : RX_CHUNK;
+    }
+    while (budget > 0)
+    {
+        size_t want = budget < RX_CHUNK ? budget : RX_CHUNK;
+        ssize_t n = recv(conn->fd, rx_buf, want, 0);
+        if (n == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                conn_error(conn, strerror(errno));
+                conn_close(conn);
+            }
+            return;
+        }
+        if (n == 0)
+        {
+            if (cfg.one_per_connection && conn->pending_count == 0)
+            {
+                // a server without -k closes after each reply, the storm reconnects anyway
+                return;
+            }
+            if (!conn_finished(conn))
+            {
+                conn_error(conn, "server closed the connection early (is it running with -k?)");
+            }
+            conn_close(conn);
+            return;
+        }
+        if (consume_reply(conn, rx_buf, n, now_ns()) != 0)
+        {
+            conn_close(conn);
+            return;
+        }
+        if (conn->slow)
+        {
+            budget -= n;
+            conn->read_resume_ns = now + (uint64_t)(n * 1e9 / cfg.read_rate);
+            return;
+        }
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(double p)
+{
+    if (stats.latency_count == 0)
+    {
+        return 0;
+    }
+    size_t i = (size_t)(p * (stats.latency_count - 1));
+    return stats.latencies[i] / 1000.0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: aesdsocket-load [-S small|huge|slow|storm] [-H host] [-p port] [-c connections]\n"
+                    "       [-n packets] [-s size|min-max] [-r rate] [-L slow_readers] [-R read_bytes_per_sec] [-1] [-d]\n");
+    exit(2);
+}
+
+static void parse_size(const char *arg)
+{
+    char *end;
+    cfg.min_size = cfg.max_size = strtoull(arg, &end, 10);
+    if (*end == '-')
+    {
+        cfg.max_size = strtoull(end + 1, &end, 10);
+    }
+    if (*end != '\0' || cfg.max_size < cfg.min_size)
+    {
+        usage();
+    }
+}
+
+/**
+ * Canned scenarios, which later options may still override
+ */
+static void apply_scenario(const char *name)
+{
+    if (strcmp(name, "small") == 0)
+    {
+        // many small pipelined-size packets on many connections
+        cfg.connections = 32;
+        cfg.packets = 200;
+        cfg.min_size = 32;
+        cfg.max_size = 256;
+    }
+    else if (strcmp(name, "huge") == 0)
+    {
+        // bulk loaders, exercising the large packet path
+        cfg.connections = 2;
+        cfg.packets = 4;
+        cfg.min_size = cfg.max_size = 8 * 1024 * 1024;
+    }
+    else if (strcmp(name, "slow") == 0)
+    {
+        // half the clients read their replies at 1 MiB/s
+        cfg.connections = 16;
+        cfg.packets = 20;
+        cfg.min_size = cfg.max_size = 512;
+        cfg.slow_readers = 8;
+        cfg.read_rate = 1024 * 1024;
+    }
+    else if (strcmp(name, "storm") == 0)
+    {
+        // a new connection for every packet
+        cfg.connections = 64;
+        cfg.packets = 20;
+        cfg.min_size = cfg.max_size = 64;
+        cfg.one_per_connection = 1;
+    }
+    else
+    {
+        usage();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *scenario = "custom";
+    int opt;
+    while ((opt = getopt(argc, argv, "S:H:p:c:n:s:r:L:R:1d")) != -1)
+    {
+        switch (opt)
+        {
+        case 'S':
+            scenario = optarg;
+            apply_scenario(optarg);
+            break;
+        case 'H':
+            cfg.host = optarg;
+            break;
+        case 'p':
+            cfg.port = optarg;
+            break;
+        case 'c':
+            cfg.connections = atoi(optarg);
+            break;
+        case 'n':
+            cfg.packets = atol(optarg);
+            break;
+        case 's':
+            parse_size(optarg);
+            break;
+        case 'r':
+            cfg.rate = atof(optarg);
+            break;
+        case 'L':
+            cfg.slow_readers = atoi(optarg);
+            break;
+        case 'R':
+            cfg.read_rate = atof(optarg);
+            break;
+        case '1':
+            cfg.one_per_connection = 1;
+            break;
+        case 'd':
+            cfg.delta = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (cfg.connections < 1 || cfg.packets < 1 || cfg.slow_readers > cfg.connections ||
+        (cfg.slow_readers > 0 && cfg.read_rate <= 0))
+    {
+        usage();
+    }
+    if (cfg.min_size < TAG_LEN + 1)
+    {
+        cfg.min_size = TAG_LEN + 1;
+    }
+    if (cfg.max_size < cfg.min_size)
+    {
+        cfg.max_size = cfg.min_size;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int rc = getaddrinfo(cfg.host, cfg.port, &hints, &server_addr);
+    if (rc != 0)
+    {
+        fprintf(stderr, "%s: %s\n", cfg.host, gai_strerror(rc));
+        return 1;
+    }
+    run_id = (uint32_t)(now_ns() ^ ((uint64_t)getpid() << 16));
+    srand(run_id);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct load_conn_s *conns = calloc(cfg.connections, sizeof(struct load_conn_s));
+    if (epoll_fd == -1 || conns == NULL)
+    {
+        perror("setup");
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < cfg.connections; i++)
+    {
+        conns[i].id = i;
+        conns[i].slow = i < cfg.slow_readers;
+        // spread open loop senders over one period
+        conns[i].next_send_ns = start + (cfg.rate > 0 ? (uint64_t)(1e9 / cfg.rate) * i / cfg.connections : 0);
+        if (conn_open(&conns[i]) != 0)
+        {
+            conn_error(&conns[i], strerror(errno));
+        }
+    }
+
+    int active = cfg.connections;
+    while (active > 0)
+    {
+        uint64_t now = now_ns();
+        uint64_t wake = UINT64_MAX;
+        active = 0;
+        for (int i = 0; i < cfg.connections; i++)
+        {
+            struct load_conn_s *conn = &conns[i];
+            if (conn->fd == -1)
+            {
+                continue;
+            }
+            if (conn_finished(conn))
+            {
+                conn_close(conn);
+                continue;
+            }
+            active++;
+            if (conn->connected)
+            {
+                conn_send(conn, now);
+            }
+            if (conn->fd == -1)
+            {
+                continue;
+            }
+            update_events(conn, now);
+            if (cfg.rate > 0 && conn->sent < (uint64_t)cfg.packets && conn->next_send_ns < wake)
+            {
+                wake = conn->next_send_ns;
+            }
+            if (conn->slow && conn->read_resume_ns > now && conn->read_resume_ns < wake)
+            {
+                wake = conn->read_resume_ns;
+            }
+        }
+        if (active == 0)
+        {
+            break;
+        }
+
+        int timeout = -1;
+        if (wake != UINT64_MAX)
+        {
+            timeout = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+        }
+        struct epoll_event events[MAX_EVENTS];
+        int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        now = now_ns();
+        for (int i = 0; i < nfds; i++)
+        {
+            struct load_conn_s *conn = events[i].data.ptr;
+            if (conn->fd == -1)
+            {
+                continue;
+            }
+            if (!conn->connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0)
+                {
+                    conn_error(conn, strerror(err));
+                    conn_close(conn);
+                    continue;
+                }
+                conn->connected = 1;
+                conn_send(conn, now);
+            }
+            else if (events[i].events & EPOLLOUT)
+            {
+                conn_send(conn, now);
+            }
+            if (conn->fd != -1 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && conn->connected)
+            {
+                conn_recv(conn, now);
+            }
+
+            // a storm connection lives for one packet, then the slot reconnects
+            if (cfg.one_per_connection && conn->fd != -1 && conn->pending_count == 0 && conn->completed > 0 &&
+                conn->completed == conn->sent)
+            {
+                conn_close(conn);
+                if (conn->sent < (uint64_t)cfg.packets && conn_open(conn) != 0)
+                {
+                    conn_error(conn, strerror(errno));
+                }
+            }
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    qsort(stats.latencies, stats.latency_count, sizeof(uint64_t), compare_u64);
+    uint64_t total_packets = stats.packets + stats.slow_packets;
+    printf("scenario %s: %d connections (%d slow readers), %ld packets each, %zu-%zu bytes, %s\n", scenario,
+           cfg.connections, cfg.slow_readers, cfg.packets, cfg.min_size, cfg.max_size,
+           cfg.rate > 0 ? "open loop" : "closed loop");
+    printf("elapsed %.3f s  packets %llu  connects %llu  errors %llu\n", elapsed, (unsigned long long)total_packets,
+           (unsigned long long)stats.connects, (unsigned long long)stats.errors);
+    printf("throughput %.0f pkt/s  tx %.2f MB/s  rx %.2f MB/s\n", total_packets / elapsed,
+           stats.bytes_out / elapsed / 1e6, stats.bytes_in / elapsed / 1e6);
+    printf("latency us  p50 %.0f  p99 %.0f  p999 %.0f  max %.0f\n", percentile_us(0.5), percentile_us(0.99),
+           percentile_us(0.999), percentile_us(1.0));
+
+    freeaddrinfo(server_addr);
+    return stats.errors ? 1 : 0;
+}
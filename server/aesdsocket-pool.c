@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "metrics.h"
+#include "admission.h"
+
+struct conn_item_s
+{
+    struct sockaddr_in client;
+    int conn_fd;
+};
+
+/**
+ * Bounded multi-producer multi-consumer queue of accepted connections.
+ * Producers block while it is full, which defers accepting and leaves
+ * further connections waiting in the kernel listen backlog.
+ */
+struct conn_queue_s
+{
+    struct conn_item_s *items;
+    int size;
+    int head;
+    int count;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+static struct conn_queue_s queue;
+static pthread_t *workers = NULL;
+static int num_workers = 0;
+/**
+ * Accept threads of the listeners other than the first, which the calling thread serves
+ */
+static pthread_t *acceptors = NULL;
+static int num_acceptors = 0;
+/**
+ * The calling thread, accepting on the first listener until pool_server_drain()
+ */
+static pthread_t main_acceptor;
+static int main_accepting = 0;
+
+static void unlock_queue(void *arg)
+{
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+static void queue_push(const struct conn_item_s *item)
+{
+    pthread_mutex_lock(&queue.mutex);
+    // accept threads are cancelled while waiting here on shutdown
+    pthread_cleanup_push(unlock_queue, NULL);
+    while (queue.count == queue.size)
+    {
+        pthread_cond_wait(&queue.not_full, &queue.mutex);
+    }
+    queue.items[(queue.head + queue.count) % queue.size] = *item;
+    queue.count++;
+    pthread_cond_signal(&queue.not_empty);
+    pthread_cleanup_pop(1);
+}
+
+static void queue_pop(struct conn_item_s *item)
+{
+    pthread_mutex_lock(&queue.mutex);
+    // workers are cancelled while waiting here on shutdown
+    pthread_cleanup_push(unlock_queue, NULL);
+    while (queue.count == 0)
+    {
+        pthread_cond_wait(&queue.not_empty, &queue.mutex);
+    }
+    *item = queue.items[queue.head];
+    queue.head = (queue.head + 1) % queue.size;
+    queue.count--;
+    pthread_cond_signal(&queue.not_full);
+    pthread_cleanup_pop(1);
+}
+
+static void *pool_worker(void *arg)
+{
+    struct list_data_s dat;
+    memset(&dat, 0, sizeof(dat));
+    dat.thread = pthread_self();
+
+    while (1)
+    {
+        struct conn_item_s item;
+        queue_pop(&item);
+        dat.client = item.client;
+        dat.conn_fd = item.conn_fd;
+        dat.result = serve_connection(&dat);
+    }
+    return NULL;
+}
+
+/**
+ * Gives back the slot an accept thread took for a connection it did not accept yet.
+ */
+static void leave_slot(void *arg)
+{
+    if (admission.policy != ADMIT_REJECT)
+    {
+        admission_conn_leave();
+    }
+}
+
+static void *pool_acceptor(void *arg)
+{
+    int listen_fd = (int)(intptr_t)arg;
+    while (1)
+    {
+        struct conn_item_s item;
+        if (admission.policy != ADMIT_REJECT)
+        {
+            // at the limit, further connections wait in the listen backlog
+            admission_conn_wait();
+        }
+        // accept threads are cancelled while waiting here on shutdown or hand over
+        pthread_cleanup_push(leave_slot, NULL);
+        item.conn_fd = -1;
+        while (item.conn_fd == -1)
+        {
+            item.conn_fd = accept_connection(listen_fd, &item.client);
+            if (item.conn_fd == -1 && errno != EINTR && errno != ECONNABORTED)
+            {
+                exit_error("Failed to accept");
+            }
+        }
+        pthread_cleanup_pop(0);
+        if (admission.policy == ADMIT_REJECT && !admission_conn_try_enter())
+        {
+            admission_reject(item.conn_fd);
+            continue;
+        }
+        // a connection once accepted is queued, even when cancelled meanwhile
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        metrics_add(METRIC_ACCEPTS, 1);
+
+        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(item.client.sin_addr));
+
+        queue_push(&item);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+    return NULL;
+}
+
+void pool_server_run(const int *listen_fds, int nlisteners, int nworkers, int depth)
+{
+    queue.items = calloc(depth, sizeof(struct conn_item_s));
+    if (queue.items == NULL)
+    {
+        exit_error("No queue memory available");
+    }
+    queue.size = depth;
+    queue.head = 0;
+    queue.count = 0;
+    pthread_mutex_init(&queue.mutex, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+    pthread_cond_init(&queue.not_full, NULL);
+
+    workers = calloc(nworkers, sizeof(pthread_t));
+    acceptors = calloc(nlisteners, sizeof(pthread_t));
+    if (workers == NULL || acceptors == NULL)
+    {
+        exit_error("No worker memory available");
+    }
+
+    for (int i = 0; i < nworkers; i++)
+    {
+        if (pthread_create(&workers[i], NULL, pool_worker, NULL) != 0)
+        {
+            exit_error("Could not create worker thread");
+        }
+        num_workers = i + 1;
+    }
+    for (int i = 1; i < nlisteners; i++)
+    {
+        if (pthread_create(&acceptors[num_acceptors], NULL, pool_acceptor, (void *)(intptr_t)listen_fds[i]) != 0)
+        {
+            exit_error("Could not create accept thread");
+        }
+        pin_to_core(acceptors[num_acceptors++], i);
+    }
+    if (nlisteners > 1)
+    {
+        // pinned last, so no worker or accept thread inherits this one's CPU
+        pin_to_core(pthread_self(), 0);
+    }
+
+    main_acceptor = pthread_self();
+    main_accepting = 1;
+    server_started();
+    pool_acceptor((void *)(intptr_t)listen_fds[0]);
+}
+
+/**
+ * Closes every queued connection.  Caller holds queue.mutex, or no thread is left to.
+ */
+static void close_queued(void)
+{
+    while (queue.count > 0)
+    {
+        close(queue.items[queue.head].conn_fd);
+        queue.head = (queue.head + 1) % queue.size;
+        queue.count--;
+    }
+}
+
+void pool_server_drain(void)
+{
+    for (int i = 0; i < num_acceptors; i++)
+    {
+        pthread_cancel(acceptors[i]);
+        pthread_join(acceptors[i], NULL);
+    }
+    num_acceptors = 0;
+    if (main_accepting)
+    {
+        pthread_cancel(main_acceptor);
+        pthread_join(main_acceptor, NULL);
+        main_accepting = 0;
+    }
+}
+
+void pool_server_stop(void)
+{
+    for (int i = 0; i < num_workers; i++)
+    {
+        pthread_cancel(workers[i]);
+        pthread_join(workers[i], NULL);
+    }
+    num_workers = 0;
+
+    // an accept thread blocked on the full queue only stops once its connection is queued
+    pthread_mutex_lock(&queue.mutex);
+    close_queued();
+    pthread_cond_broadcast(&queue.not_full);
+    pthread_mutex_unlock(&queue.mutex);
+
+    for (int i = 0; i < num_acceptors; i++)
+    {
+        if (!pthread_equal(acceptors[i], pthread_self()))
+        {
+            pthread_cancel(acceptors[i]);
+            pthread_join(acceptors[i], NULL);
+        }
+    }
+    num_acceptors = 0;
+    if (main_accepting && !pthread_equal(main_acceptor, pthread_self()))
+    {
+        pthread_cancel(main_acceptor);
+        pthread_join(main_acceptor, NULL);
+        main_accepting = 0;
+    }
+    close_queued();
+}
@@ -0,0 +1,1233 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "queue.h"
+#include "aesdsocket.h"
+#include "append-log.h"
+#include "log-command.h"
+#include "metrics.h"
+#include "admission.h"
+#include "handoff.h"
+#include "wake-fd.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 1024
+/**
+ * Receive buffers provided to the kernel through a buffer ring, so a single
+ * multishot recv per connection serves every packet it sends
+ */
+#define RECV_BUF_COUNT 512
+#define RECV_BUF_SIZE 16384
+#define RECV_BUF_GROUP 0
+/**
+ * Bytes moved per linked file read, socket send pair
+ */
+#define TX_CHUNK 65536
+/**
+ * Bytes per send straight from a mapped log, bounded since the result is an int
+ */
+#define TX_MAPPED_CHUNK (1 << 30)
+
+/**
+ * Operation kinds, stored in the low bits of the 8 byte aligned connection pointer
+ * used as user_data
+ */
+typedef enum
+{
+    OP_IGNORE = 0,
+    OP_ACCEPT,
+    OP_RECV,
+    OP_READ,
+    OP_SEND,
+    OP_TICK,
+    OP_WATCH,
+    /**
+     * The hand over's drain fd, or the stop fd once stopping is set
+     */
+    OP_DRAIN,
+} uringop_t;
+
+#define OP_MASK 7
+
+struct uring_conn_s
+{
+    struct sockaddr_in client;
+    int conn_fd;
+    char *tx_buf;
+    struct line_assembler rx;
+    /**
+     * Spill file receiving the current packet while spilling is set, up to its newline
+     * once spill_complete is set, see splice-ingest.h
+     */
+    struct splice_ingest ingest;
+    int spilling;
+    int spill_complete;
+    int recv_armed;
+    int ops_pending;
+    int eof;
+    int closing;
+    /**
+     * Sending every append from tx_offset on, see log-command.h
+     */
+    int subscribed;
+    int tx_active;
+    int tx_error;
+    off_t tx_start;
+    off_t tx_offset;
+    off_t tx_end;
+    size_t tx_chunk;
+    /**
+     * Set by AESDCHAR_DELTA, after which replies start at delta_sent, the end of the
+     * previous reply
+     */
+    int delta;
+    off_t delta_sent;
+    uint64_t packet_start;
+    time_t last_active;
+    /**
+     * Link in the idle list, or the subscribers once subscribed
+     */
+    TAILQ_ENTRY(uring_conn_s)
+    idle_entry;
+};
+
+struct uring_s
+{
+    int ring_fd;
+    /**
+     * The ring mappings, cq_ring being sq_ring when the kernel maps both at once
+     */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    int buf_ring_registered;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    unsigned short buf_tail;
+    char *recv_bufs;
+    int listen_fd;
+    int accept_multishot;
+    /**
+     * An accept request is in flight, and accepting is paused at the connection limit
+     */
+    int accept_armed;
+    int accept_paused;
+    /**
+     * Set once a new process asked for the listener, from then on accept is never re-armed
+     */
+    int draining;
+    /**
+     * Posted once the accept request is gone for good
+     */
+    sem_t drained;
+    int drain_acked;
+    /**
+     * Written by uring_server_stop() after setting stopping, the ring thread then posts
+     * stopped and exits
+     */
+    int stop_fd;
+    atomic_int stopping;
+    sem_t stopped;
+    atomic_int running;
+    pthread_t thread;
+    struct __kernel_timespec tick;
+    TAILQ_HEAD(uring_idlehead, uring_conn_s)
+    idle;
+    TAILQ_HEAD(uring_subscriberhead, uring_conn_s)
+    subscribers;
+};
+
+static struct uring_s uring;
+
+static void uring_conn_process(struct uring_conn_s *conn);
+
+static time_t now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static int uring_enter(unsigned to_submit, unsigned min_complete)
+{
+    int rc;
+    do
+    {
+        rc = syscall(__NR_io_uring_enter, uring.ring_fd, to_submit, min_complete,
+                     min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rc == -1 && errno == EINTR);
+    return rc;
+}
+
+/**
+ * Publishes queued SQEs, then submits them and waits for @param min_complete completions
+ * with a single io_uring_enter().
+ */
+static void uring_submit(unsigned min_complete)
+{
+    __atomic_store_n(uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE);
+    if (uring_enter(uring.to_submit, min_complete) == -1 && errno != EBUSY)
+    {
+        exit_error("io_uring_enter failed");
+    }
+    uring.to_submit = 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+    unsigned head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+    if (uring.sq_local_tail - head == uring.sq_entries)
+    {
+        // SQ full, hand what we have to the kernel first
+        uring_submit(0);
+        head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+        if (uring.sq_local_tail - head == uring.sq_entries)
+        {
+            errno = EBUSY;
+            exit_error("io_uring submission queue stuck");
+        }
+    }
+    struct io_uring_sqe *sqe = &uring.sqes[uring.sq_local_tail & *uring.sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    uring.sq_local_tail++;
+    uring.to_submit++;
+    return sqe;
+}
+
+static inline uint64_t user_data(struct uring_conn_s *conn, uringop_t op)
+{
+    return (uint64_t)(uintptr_t)conn | op;
+}
+
+static void uring_buffer_return(unsigned short bid)
+{
+    struct io_uring_buf *buf = &uring.buf_ring->bufs[uring.buf_tail & (RECV_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)&uring.recv_bufs[(size_t)bid * RECV_BUF_SIZE];
+    buf->len = RECV_BUF_SIZE;
+    buf->bid = bid;
+    uring.buf_tail++;
+    __atomic_store_n(&uring.buf_ring->tail, uring.buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Releases whatever uring_setup() got to set up, leaving errno as it found it.
+ */
+static void uring_teardown(void)
+{
+    int err = errno;
+    if (uring.buf_ring_registered)
+    {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = RECV_BUF_GROUP;
+        syscall(__NR_io_uring_register, uring.ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        uring.buf_ring_registered = 0;
+    }
+    if (uring.buf_ring != NULL)
+    {
+        munmap(uring.buf_ring, RECV_BUF_COUNT * sizeof(struct io_uring_buf));
+        uring.buf_ring = NULL;
+    }
+    free(uring.recv_bufs);
+    uring.recv_bufs = NULL;
+    if (uring.sqes != NULL)
+    {
+        munmap(uring.sqes, uring.sqes_size);
+        uring.sqes = NULL;
+    }
+    if (uring.cq_ring != NULL && uring.cq_ring != uring.sq_ring)
+    {
+        munmap(uring.cq_ring, uring.cq_ring_size);
+    }
+    uring.cq_ring = NULL;
+    if (uring.sq_ring != NULL)
+    {
+        munmap(uring.sq_ring, uring.sq_ring_size);
+        uring.sq_ring = NULL;
+    }
+    if (uring.ring_fd != -1)
+    {
+        close(uring.ring_fd);
+        uring.ring_fd = -1;
+    }
+    errno = err;
+}
+
+/**
+ * Creates the ring and its provided receive buffers.
+ * @return 0 on success, -1 with errno set and nothing left set up otherwise
+ */
+static int uring_setup(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    uring.ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring.ring_fd == -1 && errno == EINVAL)
+    {
+        // older kernel without the optional setup flags
+        memset(&params, 0, sizeof(params));
+        uring.ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (uring.ring_fd == -1)
+    {
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+    }
+
+    char *sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.ring_fd,
+                        IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+    {
+        uring_teardown();
+        return -1;
+    }
+    uring.sq_ring = sq_ptr;
+    uring.sq_ring_size = sq_size;
+    char *cq_ptr = sq_ptr;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.ring_fd,
+                      IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+        {
+            uring_teardown();
+            return -1;
+        }
+    }
+    uring.cq_ring = cq_ptr;
+    uring.cq_ring_size = cq_size;
+    uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    struct io_uring_sqe *sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     uring.ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        uring_teardown();
+        return -1;
+    }
+    uring.sqes = sqes;
+
+    uring.sq_entries = params.sq_entries;
+    uring.sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    uring.sq_local_tail = *uring.sq_tail;
+    unsigned *sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++)
+    {
+        // SQEs are always used in ring order, so the indirection array is the identity
+        sq_array[i] = i;
+    }
+    uring.cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+    struct io_uring_buf_ring *buf_ring = mmap(NULL, RECV_BUF_COUNT * sizeof(struct io_uring_buf),
+                                              PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    uring.buf_ring = (buf_ring == MAP_FAILED) ? NULL : buf_ring;
+    uring.recv_bufs = malloc((size_t)RECV_BUF_COUNT * RECV_BUF_SIZE);
+    if (uring.buf_ring == NULL || uring.recv_bufs == NULL)
+    {
+        uring_teardown();
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)uring.buf_ring;
+    reg.ring_entries = RECV_BUF_COUNT;
+    reg.bgid = RECV_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, uring.ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        uring_teardown();
+        return -1;
+    }
+    uring.buf_ring_registered = 1;
+    uring.buf_tail = 0;
+    for (unsigned short bid = 0; bid < RECV_BUF_COUNT; bid++)
+    {
+        uring_buffer_return(bid);
+    }
+    return 0;
+}
+
+static void uring_arm_accept(void)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = uring.listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (uring.accept_multishot)
+    {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = user_data(NULL, OP_ACCEPT);
+    uring.accept_armed = 1;
+}
+
+static void uring_arm_recv(struct uring_conn_s *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->conn_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUF_GROUP;
+    sqe->user_data = user_data(conn, OP_RECV);
+    conn->recv_armed = 1;
+}
+
+static void uring_arm_tick(void)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&uring.tick;
+    sqe->len = 1;
+    sqe->user_data = user_data(NULL, OP_TICK);
+}
+
+/**
+ * Waits for the log's watch fd, which is written after appends while there are subscribers.
+ */
+static void uring_arm_watch(void)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = append_log_watch_fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data(NULL, OP_WATCH);
+}
+
+/**
+ * Waits for the hand over's drain fd, which becomes readable once and stays so.
+ */
+static void uring_arm_drain(void)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = handoff_drain_fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data(NULL, OP_DRAIN);
+}
+
+/**
+ * Waits for the stop fd, sharing OP_DRAIN with the drain fd since no operation kind is free.
+ */
+static void uring_arm_stop(void)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = uring.stop_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data(NULL, OP_DRAIN);
+}
+
+static void uring_close_fd(int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = user_data(NULL, OP_IGNORE);
+}
+
+/**
+ * Frees the connection once no request referring to it is left in flight.
+ */
+static void uring_conn_release(struct uring_conn_s *conn)
+{
+    if (!conn->closing || conn->recv_armed || conn->ops_pending > 0)
+    {
+        return;
+    }
+    uring_close_fd(conn->conn_fd);
+    free(conn->tx_buf);
+    line_assembler_free(&conn->rx);
+    splice_ingest_free(&conn->ingest);
+    free(conn);
+    metrics_add(METRIC_CLOSES, 1);
+    admission_conn_leave();
+    if (uring.accept_paused && !uring.draining && !admission_conn_full())
+    {
+        uring.accept_paused = 0;
+        if (!uring.accept_armed)
+        {
+            uring_arm_accept();
+        }
+    }
+}
+
+static void uring_conn_close(struct uring_conn_s *conn)
+{
+    if (conn->closing)
+    {
+        return;
+    }
+    conn->closing = 1;
+    if (conn->subscribed)
+    {
+        TAILQ_REMOVE(&uring.subscribers, conn, idle_entry);
+        append_log_unwatch();
+    }
+    else if (config.persistent)
+    {
+        TAILQ_REMOVE(&uring.idle, conn, idle_entry);
+    }
+
+    if (conn->recv_armed || conn->ops_pending > 0)
+    {
+        // cancel the multishot recv and any send blocked on this socket
+        struct io_uring_sqe *sqe = uring_get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = conn->conn_fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = user_data(NULL, OP_IGNORE);
+    }
+    uring_conn_release(conn);
+}
+
+static void uring_conn_error(struct uring_conn_s *conn, const char *message, int err)
+{
+    syslog(LOG_ERR, "(uring %s) %s: %s", inet_ntoa(conn->client.sin_addr), message, strerror(err));
+    uring_conn_close(conn);
+}
+
+/**
+ * Queues the next chunk of the reply as a file read linked to a socket send.  Reads of
+ * the committed range complete from the page cache without leaving the ring thread,
+ * and MSG_WAITALL has the kernel finish short sends itself.  A mapped log needs no
+ * read, the whole reply is sent straight from the mapping.
+ */
+static void uring_conn_tx(struct uring_conn_s *conn)
+{
+    size_t chunk = conn->tx_end - conn->tx_offset;
+    const char *mapped = append_log_mapped(conn->tx_offset);
+    struct io_uring_sqe *sqe;
+    if (mapped != NULL)
+    {
+        conn->tx_chunk = chunk < TX_MAPPED_CHUNK ? chunk : TX_MAPPED_CHUNK;
+        sqe = uring_get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->conn_fd;
+        sqe->addr = (uint64_t)(uintptr_t)mapped;
+        sqe->len = conn->tx_chunk;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = user_data(conn, OP_SEND);
+        conn->ops_pending++;
+        return;
+    }
+    conn->tx_chunk = chunk < TX_CHUNK ? chunk : TX_CHUNK;
+    if (append_log_fd() == -1)
+    {
+        // a bounded log has no file to read, copy out of the history instead
+        ssize_t copied = append_log_read(&conn->tx_offset, conn->tx_end, conn->tx_buf, conn->tx_chunk);
+        conn->tx_chunk = (copied > 0) ? (size_t)copied : 0;
+        if (conn->tx_chunk == 0)
+        {
+            // the rest fell out of the history, the empty send just completes the reply
+            conn->tx_offset = conn->tx_end;
+        }
+        sqe = uring_get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->conn_fd;
+        sqe->addr = (uint64_t)(uintptr_t)conn->tx_buf;
+        sqe->len = conn->tx_chunk;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = user_data(conn, OP_SEND);
+        conn->ops_pending++;
+        return;
+    }
+
+    sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = append_log_fd();
+    sqe->off = conn->tx_offset;
+    sqe->addr = (uint64_t)(uintptr_t)conn->tx_buf;
+    sqe->len = conn->tx_chunk;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = user_data(conn, OP_READ);
+    conn->ops_pending++;
+
+    sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->conn_fd;
+    sqe->addr = (uint64_t)(uintptr_t)conn->tx_buf;
+    sqe->len = conn->tx_chunk;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = user_data(conn, OP_SEND);
+    conn->ops_pending++;
+}
+
+/**
+ * Starts sending a subscriber whatever was committed since its last push, unless a push
+ * is still in flight, which starts the next one as it completes.
+ */
+static void uring_subscriber_push(struct uring_conn_s *conn)
+{
+    off_t end = append_log_committed();
+    if (conn->closing || conn->tx_active || conn->tx_offset >= end)
+    {
+        return;
+    }
+    if (conn->tx_buf == NULL && (conn->tx_buf = malloc(TX_CHUNK)) == NULL)
+    {
+        uring_conn_error(conn, "malloc fail", ENOMEM);
+        return;
+    }
+    conn->tx_active = 1;
+    conn->tx_error = 0;
+    conn->tx_start = conn->tx_offset;
+    conn->tx_end = end;
+    uring_conn_tx(conn);
+}
+
+static void uring_conn_tx_complete(struct uring_conn_s *conn)
+{
+    if (conn->ops_pending > 0)
+    {
+        return;
+    }
+    if (conn->closing)
+    {
+        uring_conn_release(conn);
+        return;
+    }
+    if (conn->tx_error)
+    {
+        uring_conn_error(conn, "reply fail", conn->tx_error);
+        return;
+    }
+    if (conn->tx_offset < conn->tx_end)
+    {
+        uring_conn_tx(conn);
+        return;
+    }
+
+    conn->tx_active = 0;
+    if (conn->subscribed)
+    {
+        metrics_add(METRIC_PUSHED_BYTES, conn->tx_end - conn->tx_start);
+        uring_subscriber_push(conn);
+        return;
+    }
+    metrics_reply_sent(conn->tx_end - conn->tx_start, conn->packet_start);
+    if (!config.persistent ||
+        (handoff_draining() && !conn->spilling && line_assembler_pending(&conn->rx) == 0))
+    {
+        syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(conn->client.sin_addr));
+        uring_conn_close(conn);
+        return;
+    }
+    uring_conn_process(conn);
+}
+
+/**
+ * Turns the connection into a subscriber starting at @param offset.  Subscribers never
+ * time out, and anything they send after subscribing is discarded.
+ */
+static void uring_conn_subscribe(struct uring_conn_s *conn, off_t offset)
+{
+    if (config.persistent)
+    {
+        TAILQ_REMOVE(&uring.idle, conn, idle_entry);
+    }
+    TAILQ_INSERT_TAIL(&uring.subscribers, conn, idle_entry);
+    conn->subscribed = 1;
+    conn->tx_offset = offset;
+    metrics_add(METRIC_SUBSCRIBES, 1);
+    append_log_watch();
+    uring_subscriber_push(conn);
+}
+
+/**
+ * Appends and replies to the received packets in order, one reply in flight at a time.
+ */
+static void uring_conn_process(struct uring_conn_s *conn)
+{
+    if (conn->subscribed)
+    {
+        if (conn->eof && !conn->closing)
+        {
+            syslog(LOG_INFO, "Closed subscription from %s", inet_ntoa(conn->client.sin_addr));
+            uring_conn_close(conn);
+        }
+        return;
+    }
+
+    while (!conn->closing && !conn->tx_active)
+    {
+        int command = LOG_COMMAND_NONE;
+        off_t from = conn->delta ? conn->delta_sent : 0;
+        off_t len;
+        if (conn->spilling)
+        {
+            if (!conn->spill_complete)
+            {
+                if (conn->eof)
+                {
+                    uring_conn_error(conn, "Client connection failed", ECONNRESET);
+                }
+                return;
+            }
+            conn->packet_start = metrics_packet_received(conn->ingest.len);
+            len = append_log_append_file(conn->ingest.spill_fd, conn->ingest.len);
+            conn->spilling = 0;
+            conn->spill_complete = 0;
+            if (len != -1 && splice_ingest_reset(&conn->ingest) != 0)
+            {
+                uring_conn_error(conn, "Could not reset spill file", errno);
+                return;
+            }
+        }
+        else
+        {
+            size_t packet_len;
+            const char *packet = line_assembler_next(&conn->rx, &packet_len);
+            if (packet == NULL)
+            {
+                if (admission_packet_too_large(line_assembler_pending(&conn->rx)))
+                {
+                    metrics_add(METRIC_LIMIT_CLOSES, 1);
+                    uring_conn_error(conn, "Client connection failed", EMSGSIZE);
+                    return;
+                }
+                if (line_assembler_pending(&conn->rx) >= SPLICE_INGEST_THRESHOLD && !conn->eof)
+                {
+                    // a bulk upload, the rest of it goes from the receive buffers to disk
+                    size_t head_len;
+                    const char *head = line_assembler_drain(&conn->rx, &head_len);
+                    if (splice_ingest_begin(&conn->ingest, DATA_DIR, head, head_len) != 0)
+                    {
+                        uring_conn_error(conn, "Could not start spill file", errno);
+                        return;
+                    }
+                    conn->spilling = 1;
+                    continue;
+                }
+                if (conn->eof)
+                {
+                    if (config.persistent && line_assembler_pending(&conn->rx) == 0)
+                    {
+                        syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(conn->client.sin_addr));
+                        uring_conn_close(conn);
+                    }
+                    else
+                    {
+                        uring_conn_error(conn, "Client connection failed", ECONNRESET);
+                    }
+                }
+                return;
+            }
+
+            conn->packet_start = metrics_packet_received(packet_len);
+            command = log_command_range(packet, packet_len, &from, &len);
+            if (command == -1)
+            {
+                uring_conn_error(conn, "Command out of range", errno);
+                return;
+            }
+            if (command == LOG_COMMAND_SUBSCRIBE_TO)
+            {
+                uring_conn_subscribe(conn, from);
+                return;
+            }
+            if (command == LOG_COMMAND_NONE)
+            {
+                len = append_log_append(packet, packet_len);
+            }
+        }
+        if (len == -1)
+        {
+            uring_conn_error(conn, "failed to write to file", errno);
+            return;
+        }
+        if (command == LOG_COMMAND_DELTA_FROM)
+        {
+            conn->delta = 1;
+        }
+        if (command != LOG_COMMAND_RANGE)
+        {
+            conn->delta_sent = len;
+        }
+
+        if (conn->tx_buf == NULL && (conn->tx_buf = malloc(TX_CHUNK)) == NULL)
+        {
+            uring_conn_error(conn, "malloc fail", ENOMEM);
+            return;
+        }
+        conn->tx_active = 1;
+        conn->tx_error = 0;
+        conn->tx_start = from;
+        conn->tx_offset = from;
+        conn->tx_end = len;
+        if (conn->tx_end == conn->tx_start)
+        {
+            uring_conn_tx_complete(conn);
+        }
+        else
+        {
+            uring_conn_tx(conn);
+        }
+    }
+}
+
+static void uring_accept_conn(int res)
+{
+    if (!admission_conn_try_enter())
+    {
+        admission_reject(res);
+        return;
+    }
+
+    struct uring_conn_s *conn = malloc(sizeof(struct uring_conn_s));
+    if (conn == NULL)
+    {
+        syslog(LOG_ERR, "No connection memory available");
+        close(res);
+        admission_conn_leave();
+        return;
+    }
+    memset(conn, 0, sizeof(struct uring_conn_s));
+    metrics_add(METRIC_ACCEPTS, 1);
+    conn->conn_fd = res;
+    line_assembler_init(&conn->rx);
+    conn->rx.budget = &admission_rx_budget;
+    splice_ingest_init(&conn->ingest);
+    if (admission.policy != ADMIT_REJECT && admission_conn_full())
+    {
+        // further connections wait in the listen backlog until uring_conn_release()
+        uring.accept_paused = 1;
+    }
+    socklen_t socklen = sizeof(conn->client);
+    getpeername(conn->conn_fd, (struct sockaddr *)&conn->client, &socklen);
+
+    syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(conn->client.sin_addr));
+
+    if (config.persistent)
+    {
+        conn->last_active = now_seconds();
+        TAILQ_INSERT_TAIL(&uring.idle, conn, idle_entry);
+    }
+    uring_arm_recv(conn);
+}
+
+static void uring_handle_accept(int res, uint32_t flags)
+{
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        uring.accept_armed = 0;
+        if (res == -EINVAL && uring.accept_multishot)
+        {
+            syslog(LOG_INFO, "Kernel lacks multishot accept, accepting one connection per request");
+            uring.accept_multishot = 0;
+        }
+    }
+    if (res >= 0)
+    {
+        uring_accept_conn(res);
+    }
+    else if (res != -EINVAL && res != -ECANCELED)
+    {
+        syslog(LOG_ERR, "Failed to accept: %s", strerror(-res));
+    }
+    if (uring.draining)
+    {
+        if (!uring.accept_armed && !uring.drain_acked)
+        {
+            uring.drain_acked = 1;
+            sem_post(&uring.drained);
+        }
+        return;
+    }
+    // re-armed last, so a connection taking the last slot leaves the next in the backlog
+    if (!uring.accept_armed && !uring.accept_paused)
+    {
+        uring_arm_accept();
+    }
+}
+
+/**
+ * Stores @param len received bytes at @param data, into the spill file up to the end of
+ * a packet being spilled and into conn->rx otherwise.
+ * @return 0 on success, or the errno of the failure
+ */
+static int uring_conn_store(struct uring_conn_s *conn, const char *data, size_t len)
+{
+    if (conn->spilling && !conn->spill_complete)
+    {
+        size_t consumed;
+        int rc = splice_ingest_append(&conn->ingest, data, len, &consumed);
+        if (rc == -1)
+        {
+            return errno;
+        }
+        if (rc == 0 && admission_packet_too_large(conn->ingest.len))
+        {
+            metrics_add(METRIC_LIMIT_CLOSES, 1);
+            return EMSGSIZE;
+        }
+        conn->spill_complete = rc;
+        data += consumed;
+        len -= consumed;
+        if (len == 0)
+        {
+            return 0;
+        }
+    }
+
+    size_t space;
+    char *rx_ptr = line_assembler_reserve(&conn->rx, len, &space);
+    if (rx_ptr == NULL)
+    {
+        int err = errno;
+        // without a reply in flight every complete packet was processed, so rx holds a single partial one
+        if (err == ENOBUFS && admission.policy == ADMIT_SPILL && !conn->spilling && !conn->tx_active)
+        {
+            size_t head_len;
+            const char *head = line_assembler_drain(&conn->rx, &head_len);
+            if (splice_ingest_begin(&conn->ingest, DATA_DIR, head, head_len) != 0)
+            {
+                return errno;
+            }
+            conn->spilling = 1;
+            return uring_conn_store(conn, data, len);
+        }
+        if (err == ENOBUFS)
+        {
+            metrics_add(METRIC_LIMIT_CLOSES, 1);
+        }
+        return err;
+    }
+    memcpy(rx_ptr, data, len);
+    line_assembler_commit(&conn->rx, len);
+    return 0;
+}
+
+static void uring_handle_recv(struct uring_conn_s *conn, int res, uint32_t flags)
+{
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        // a subscriber's data is only returned to the ring
+        if (res > 0 && !conn->closing && !conn->eof && !conn->subscribed)
+        {
+            metrics_add(METRIC_BYTES_IN, res);
+            int err = uring_conn_store(conn, &uring.recv_bufs[(size_t)bid * RECV_BUF_SIZE], res);
+            if (err != 0)
+            {
+                uring_buffer_return(bid);
+                uring_conn_error(conn, "Client connection failed", err);
+                if (!(flags & IORING_CQE_F_MORE))
+                {
+                    conn->recv_armed = 0;
+                    uring_conn_release(conn);
+                }
+                return;
+            }
+        }
+        uring_buffer_return(bid);
+    }
+
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        conn->recv_armed = 0;
+        if (conn->closing)
+        {
+            uring_conn_release(conn);
+            return;
+        }
+        if (res == 0)
+        {
+            conn->eof = 1;
+        }
+        else if (res == -ENOBUFS || res > 0)
+        {
+            // out of provided buffers, or the kernel ended the multishot early
+            uring_arm_recv(conn);
+        }
+        else
+        {
+            uring_conn_error(conn, "Client connection failed", -res);
+            return;
+        }
+    }
+
+    if (conn->closing)
+    {
+        return;
+    }
+    if (config.persistent && !conn->subscribed)
+    {
+        conn->last_active = now_seconds();
+        TAILQ_REMOVE(&uring.idle, conn, idle_entry);
+        TAILQ_INSERT_TAIL(&uring.idle, conn, idle_entry);
+    }
+    uring_conn_process(conn);
+}
+
+static void uring_handle_tx(struct uring_conn_s *conn, uringop_t op, int res)
+{
+    conn->ops_pending--;
+    if (res < 0 || (size_t)res != conn->tx_chunk)
+    {
+        // a short read severs the link, cancelling the send
+        if (!conn->tx_error)
+        {
+            conn->tx_error = (res < 0) ? -res : EIO;
+        }
+    }
+    else if (op == OP_SEND)
+    {
+        conn->tx_offset += res;
+    }
+    uring_conn_tx_complete(conn);
+}
+
+/**
+ * Fans an append out to every subscriber not still sending an earlier one.
+ */
+static void uring_handle_watch(void)
+{
+    uint64_t count;
+    if (read(append_log_watch_fd(), &count, sizeof(count)) == -1 && errno != EAGAIN)
+    {
+        exit_error("Could not read log watch fd");
+    }
+    struct uring_conn_s *conn, *next;
+    TAILQ_FOREACH_SAFE(conn, &uring.subscribers, idle_entry, next)
+    {
+        uring_subscriber_push(conn);
+    }
+    uring_arm_watch();
+}
+
+/**
+ * Stops accepting for good and closes the connections with no packet in progress,
+ * the others closing after their reply.
+ */
+static void uring_handle_drain(void)
+{
+    uring.draining = 1;
+    if (uring.accept_armed)
+    {
+        // acknowledged by uring_handle_accept() once the request is gone
+        struct io_uring_sqe *sqe = uring_get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = user_data(NULL, OP_ACCEPT);
+        sqe->user_data = user_data(NULL, OP_IGNORE);
+    }
+    else
+    {
+        uring.drain_acked = 1;
+        sem_post(&uring.drained);
+    }
+
+    struct uring_conn_s *conn, *next;
+    if (config.persistent)
+    {
+        TAILQ_FOREACH_SAFE(conn, &uring.idle, idle_entry, next)
+        {
+            if (!conn->tx_active && !conn->spilling && line_assembler_pending(&conn->rx) == 0)
+            {
+                syslog(LOG_INFO, "Closed idle connection from %s for hand over", inet_ntoa(conn->client.sin_addr));
+                uring_conn_close(conn);
+            }
+        }
+    }
+    TAILQ_FOREACH_SAFE(conn, &uring.subscribers, idle_entry, next)
+    {
+        syslog(LOG_INFO, "Closed subscription from %s for hand over", inet_ntoa(conn->client.sin_addr));
+        uring_conn_close(conn);
+    }
+}
+
+/**
+ * Ends the ring thread between completions, leaving its connections for exit() to close.
+ */
+static void uring_handle_stop(void)
+{
+    sem_post(&uring.stopped);
+    pthread_exit(NULL);
+}
+
+static void uring_expire_idle(void)
+{
+    time_t now = now_seconds();
+    struct uring_conn_s *conn;
+    while ((conn = TAILQ_FIRST(&uring.idle)) != NULL && conn->last_active + config.idle_timeout <= now)
+    {
+        syslog(LOG_INFO, "Idle timeout on connection from %s", inet_ntoa(conn->client.sin_addr));
+        uring_conn_close(conn);
+    }
+}
+
+int uring_server_run(int listen_fd)
+{
+    memset(&uring, 0, sizeof(uring));
+    uring.listen_fd = listen_fd;
+    // multishot accept would take connections off the backlog beyond a deferring limit
+    uring.accept_multishot = admission.max_connections == 0 || admission.policy == ADMIT_REJECT;
+    TAILQ_INIT(&uring.idle);
+    TAILQ_INIT(&uring.subscribers);
+    uring.ring_fd = -1;
+    if (uring_setup() != 0)
+    {
+        return -1;
+    }
+    if (sem_init(&uring.drained, 0, 0) != 0 || sem_init(&uring.stopped, 0, 0) != 0)
+    {
+        exit_error("Could not create drain semaphore");
+    }
+    uring.stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (uring.stop_fd == -1)
+    {
+        exit_error("Could not create stop eventfd");
+    }
+    uring.thread = pthread_self();
+
+    uring_arm_accept();
+    uring_arm_watch();
+    if (handoff_drain_fd() != -1)
+    {
+        uring_arm_drain();
+    }
+    if (config.persistent && config.idle_timeout > 0)
+    {
+        uring.tick.tv_sec = 1;
+        uring_arm_tick();
+    }
+    uring_arm_stop();
+    atomic_store(&uring.running, 1);
+    server_started();
+
+    while (1)
+    {
+        uring_submit(1);
+
+        unsigned head = *uring.cq_head;
+        unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+            struct uring_conn_s *conn = (struct uring_conn_s *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+            uringop_t op = cqe->user_data & OP_MASK;
+            int res = cqe->res;
+            uint32_t flags = cqe->flags;
+            // the CQE slot may be reused once head moves past it
+            __atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+            switch (op)
+            {
+            case OP_ACCEPT:
+                uring_handle_accept(res, flags);
+                break;
+            case OP_RECV:
+                uring_handle_recv(conn, res, flags);
+                break;
+            case OP_READ:
+            case OP_SEND:
+                uring_handle_tx(conn, op, res);
+                break;
+            case OP_TICK:
+                uring_expire_idle();
+                uring_arm_tick();
+                break;
+            case OP_WATCH:
+                uring_handle_watch();
+                break;
+            case OP_DRAIN:
+                if (atomic_load(&uring.stopping))
+                {
+                    uring_handle_stop();
+                }
+                else
+                {
+                    uring_handle_drain();
+                }
+                break;
+            case OP_IGNORE:
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+void uring_server_drain(void)
+{
+    while (sem_wait(&uring.drained) == -1 && errno == EINTR)
+    {
+    }
+}
+
+void uring_server_stop(void)
+{
+    if (!atomic_load(&uring.running) || pthread_equal(uring.thread, pthread_self()))
+    {
+        return;
+    }
+    atomic_store(&uring.stopping, 1);
+    if (wake_fd_signal(uring.stop_fd) != 0)
+    {
+        return;
+    }
+    while (sem_wait(&uring.stopped) == -1 && errno == EINTR)
+    {
+    }
+}
+
+#else /* HAVE_IO_URING */
+
+int uring_server_run(int listen_fd)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_server_drain(void)
+{
+}
+
+void uring_server_stop(void)
+{
+}
+
+#endif /* HAVE_IO_URING */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -8,18 +9,30 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <syslog.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <time.h>
+#include <sys/time.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <poll.h>
 #include "queue.h"
-
-#define BLOCK_SIZE 4096
-
-#define DATA_FILE "/var/tmp/aesdsocketdata"
+#include "aesdsocket.h"
+#include "append-log.h"
+#include "log-command.h"
+#include "log-subscribers.h"
+#include "timestamp.h"
+#include "metrics.h"
+#include "admission.h"
+#include "handoff.h"
+#include "bounded-history.h"
 
 typedef enum
 {
@@ -27,38 +40,183 @@ typedef enum
     CLEAN_SERVER = 2,
     CLEAN_RES = 4,
     CLEAN_TIMER = 8,
+    CLEAN_EPOLL = 16,
+    CLEAN_POOL = 32,
+    CLEAN_REAPER = 64,
+    CLEAN_METRICS = 128,
+    CLEAN_SHARDS = 256,
+    CLEAN_SUBSCRIBERS = 512,
+    CLEAN_HANDOFF = 1024,
+    CLEAN_URING = 2048,
 } cleanupflags_t;
 
-struct list_data_s
+typedef enum
 {
-    struct sockaddr_in client;
-    pthread_t thread;
-    int conn_fd;
-    int result;
-    char *rx_buffer;
-    SLIST_ENTRY(list_data_s)
-    entry;
-};
+    MODE_THREAD,
+    MODE_EPOLL,
+    MODE_POOL,
+    MODE_URING,
+} servermode_t;
 
-struct locked_file_s
+struct server_config_s config;
+struct addrinfo *res = NULL;
+/**
+ * Listening sockets, more than one sharing the port through SO_REUSEPORT when sharded
+ */
+static int *server_conns = NULL;
+static int num_server_conns = 0;
+static int num_shards = 1;
+/**
+ * Accept threads of the thread per connection mode, one per shard but the first,
+ * which the main thread serves
+ */
+static pthread_t *shard_threads = NULL;
+static int num_shard_threads = 0;
+/**
+ * CPUs the process may run on, as found at startup
+ */
+static cpu_set_t process_cpus;
+static int cleanup_state = 0;
+static servermode_t server_mode = MODE_THREAD;
+/**
+ * The thread running main(), an accept thread in the thread per connection mode
+ */
+static pthread_t main_thread;
+/**
+ * Hot restart, see handoff.h.  Once handed_off is set the listeners and the data file
+ * belong to the new server, and are only closed on exit.
+ */
+static const char *handoff_path = NULL;
+static int handoff_sock = -1;
+static pthread_t handoff_thread_id;
+static int handoff_running = 0;
+static int handed_off = 0;
+/**
+ * Keep the data file across restarts, recovering it on start instead of truncating it
+ */
+static int warm_start = 0;
+/**
+ * Set by -L records:N or -L bytes:SIZE, keeping only the most recent records in memory
+ * instead of a data file, see bounded-history.h
+ */
+static int bounded_log = 0;
+static unsigned long history_records = 0;
+static size_t history_bytes = 0;
+/**
+ * Seconds a hand over waits for connections to finish before going ahead regardless
+ */
+static long drain_timeout = 30;
+/**
+ * Set by server_started(), so a hand over never finds a server mode half set up
+ */
+static struct
 {
-    int fd;
+    int started;
     pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} serving = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+/**
+ * Bookkeeping of the thread per connection mode.  Handlers push themselves on the
+ * completion stack when they finish, and the reaper joins and frees exactly those.
+ */
+struct reaper_s
+{
+    pthread_t thread;
+    /**
+     * Every handler not reaped yet, in accept order, protected by mutex
+     */
+    TAILQ_HEAD(threadhead, list_data_s)
+    live;
+    pthread_mutex_t mutex;
+    /**
+     * Lock-free stack of finished handlers, newest first
+     */
+    _Atomic(struct list_data_s *) completed;
+    sem_t wakeup;
 };
 
-static struct locked_file_s logfile;
-struct addrinfo *res = NULL;
-static int server_conn;
-static int cleanup_state = 0;
-SLIST_HEAD(slisthead, list_data_s)
-head;
-timer_t periodic_timer;
+static struct reaper_s reaper = {
+    .live = TAILQ_HEAD_INITIALIZER(reaper.live),
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
 
 void cleanup(int exit_code)
 {
+    // a thread failing while another shuts down leaves it to finish, its join included
+    static atomic_int cleaning = 0;
+    if (atomic_exchange(&cleaning, 1))
+    {
+        pthread_exit(NULL);
+    }
+
+    if (cleanup_state & CLEAN_HANDOFF)
+    {
+        if (handoff_running && !pthread_equal(handoff_thread_id, pthread_self()))
+        {
+            pthread_cancel(handoff_thread_id);
+            pthread_join(handoff_thread_id, NULL);
+        }
+        close(handoff_sock);
+        if (!handed_off)
+        {
+            unlink(handoff_path);
+        }
+    }
+
+    if (cleanup_state & CLEAN_SHARDS)
+    {
+        for (int i = 0; i < num_shard_threads; i++)
+        {
+            if (!pthread_equal(shard_threads[i], pthread_self()))
+            {
+                pthread_cancel(shard_threads[i]);
+                pthread_join(shard_threads[i], NULL);
+            }
+        }
+        if (!pthread_equal(main_thread, pthread_self()))
+        {
+            pthread_cancel(main_thread);
+            pthread_join(main_thread, NULL);
+        }
+    }
+
+    if (cleanup_state & CLEAN_URING)
+    {
+        uring_server_stop();
+    }
+
+    if (cleanup_state & CLEAN_EPOLL)
+    {
+        epoll_server_stop();
+    }
+
+    if (cleanup_state & CLEAN_POOL)
+    {
+        pool_server_stop();
+    }
+
+    if (cleanup_state & CLEAN_SUBSCRIBERS)
+    {
+        log_subscribers_stop();
+    }
+
+    if (cleanup_state & CLEAN_REAPER)
+    {
+        pthread_cancel(reaper.thread);
+        pthread_join(reaper.thread, NULL);
+    }
+
     if (cleanup_state & CLEAN_TIMER)
     {
-        timer_delete(periodic_timer);
+        timestamp_stop();
+    }
+
+    if (cleanup_state & CLEAN_METRICS)
+    {
+        metrics_stop();
     }
 
     if (cleanup_state & CLEAN_RES)
@@ -68,26 +226,32 @@ void cleanup(int exit_code)
 
     if (cleanup_state & CLEAN_SERVER)
     {
-        close(server_conn);
+        for (int i = 0; i < num_server_conns; i++)
+        {
+            // an accept still queued in io_uring keeps the socket open after close(),
+            // but once handed over the socket is the new server's to shut down
+            if (!handed_off)
+            {
+                shutdown(server_conns[i], SHUT_RDWR);
+            }
+            close(server_conns[i]);
+        }
     }
 
-    if (cleanup_state & CLEAN_FD)
+    // with the reaper gone every handler, finished or not, is only on the live list.
+    // They are stopped before the log, whose group commit thread may owe them a reply.
+    struct list_data_s *dat = NULL;
+    while ((dat = TAILQ_FIRST(&reaper.live)) != NULL)
     {
-        close(logfile.fd);
-        remove(DATA_FILE);
+        pthread_cancel(dat->thread);
+        pthread_join(dat->thread, NULL);
+        TAILQ_REMOVE(&reaper.live, dat, entry);
+        free(dat);
     }
 
-    struct list_data_s *dat = NULL;
-    while (!SLIST_EMPTY(&head))
+    if (cleanup_state & CLEAN_FD)
     {
-        dat = SLIST_FIRST(&head);
-        if (dat->thread)
-        {
-            pthread_cancel(dat->thread);
-            pthread_join(dat->thread, NULL);
-        }
-        SLIST_REMOVE_HEAD(&head, entry);
-        free(dat);
+        append_log_close(!handed_off && !warm_start);
     }
 
     closelog();
@@ -100,36 +264,93 @@ void exit_error(const char *message)
     cleanup(-1);
 }
 
-void signal_handler(int signum)
+/**
+ * Waits for SIGINT or SIGTERM, blocked in every thread, and shuts down from thread
+ * context once the server is fully started.
+ */
+static void *signal_thread(void *arg)
 {
+    sigset_t *signals = arg;
+    int signum;
+    while (sigwait(signals, &signum) != 0)
+    {
+    }
     syslog(LOG_INFO, "Caught signal, exiting");
+
+    pthread_mutex_lock(&serving.mutex);
+    while (!serving.started)
+    {
+        pthread_cond_wait(&serving.cond, &serving.mutex);
+    }
+    pthread_mutex_unlock(&serving.mutex);
     cleanup(0);
+    return NULL;
 }
 
 void open_data_file(void)
 {
-    logfile.fd = open(DATA_FILE, O_RDWR | O_TRUNC | O_CREAT, 0644);
-    if (logfile.fd < 0)
+    if (bounded_log)
     {
-        exit_error("Failed to open logfile");
+        if (append_log_open_bounded(history_records, history_bytes) != 0)
+        {
+            exit_error("Failed to set up the bounded history");
+        }
+        cleanup_state |= CLEAN_FD;
+        return;
+    }
+    if (!warm_start)
+    {
+        if (append_log_open(DATA_FILE) != 0)
+        {
+            exit_error("Failed to open logfile");
+        }
+        cleanup_state |= CLEAN_FD;
+        return;
+    }
+
+    off_t torn;
+    if (append_log_recover(DATA_FILE, &torn) != 0)
+    {
+        exit_error("Failed to recover logfile");
     }
     cleanup_state |= CLEAN_FD;
-    pthread_mutex_init(&logfile.mutex, NULL);
+    if (torn > 0)
+    {
+        syslog(LOG_WARNING, "Cut a torn record of %ld bytes off the end of %s", (long)torn, DATA_FILE);
+    }
+    syslog(LOG_INFO, "Recovered %lu records, %ld bytes from %s", append_log_records(), (long)append_log_committed(),
+           DATA_FILE);
 }
 
 void open_server(void)
 {
-    server_conn = socket(PF_INET, SOCK_STREAM, 0);
-    if (server_conn < 0)
+    server_conns = calloc(num_shards, sizeof(int));
+    if (server_conns == NULL)
     {
-        exit_error("Failed to create server socket %s");
+        exit_error("No listener memory available");
     }
     cleanup_state |= CLEAN_SERVER;
 
-    int reuse = 1;
-    if (setsockopt(server_conn, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0)
+    for (int i = 0; i < num_shards; i++)
     {
-        exit_error("Could not set socket option");
+        server_conns[i] = socket(PF_INET, SOCK_STREAM, 0);
+        if (server_conns[i] < 0)
+        {
+            exit_error("Failed to create server socket %s");
+        }
+        num_server_conns = i + 1;
+
+        int reuse = 1;
+        if (setsockopt(server_conns[i], SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0)
+        {
+            exit_error("Could not set socket option");
+        }
+        // the kernel then spreads incoming connections over every shard's listener
+        if (num_shards > 1 &&
+            setsockopt(server_conns[i], SOL_SOCKET, SO_REUSEPORT, (const char *)&reuse, sizeof(reuse)) < 0)
+        {
+            exit_error("Could not set SO_REUSEPORT");
+        }
     }
 }
 
@@ -148,9 +369,37 @@ void bind_server(void)
     }
     cleanup_state |= CLEAN_RES;
 
-    if (bind(server_conn, res->ai_addr, sizeof(struct sockaddr)) != 0)
+    for (int i = 0; i < num_shards; i++)
     {
-        exit_error("Could not bind");
+        if (bind(server_conns[i], res->ai_addr, sizeof(struct sockaddr)) != 0)
+        {
+            exit_error("Could not bind");
+        }
+    }
+}
+
+void pin_to_core(pthread_t thread, int index)
+{
+    int count = CPU_COUNT(&process_cpus);
+    if (count == 0)
+    {
+        return;
+    }
+    index %= count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &process_cpus) && index-- == 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            int rc = pthread_setaffinity_np(thread, sizeof(set), &set);
+            if (rc != 0)
+            {
+                syslog(LOG_ERR, "Could not pin thread to CPU %d: %s", cpu, strerror(rc));
+            }
+            return;
+        }
     }
 }
 
@@ -189,227 +438,1106 @@ void start_daemon(void)
     }
 }
 
-void cleanup_thread(struct list_data_s *dat, int result_code)
+void server_started(void)
+{
+    pthread_mutex_lock(&serving.mutex);
+    serving.started = 1;
+    pthread_cond_broadcast(&serving.cond);
+    pthread_mutex_unlock(&serving.mutex);
+}
+
+int cleanup_connection(struct list_data_s *dat, int result_code)
 {
     close(dat->conn_fd);
-    free(dat->rx_buffer);
-    dat->result = result_code;
-    pthread_exit(NULL);
+    line_assembler_free(&dat->rx);
+    splice_ingest_free(&dat->ingest);
+    metrics_add(METRIC_CLOSES, 1);
+    admission_conn_leave();
+    return result_code;
 }
 
-void thread_error(struct list_data_s *dat, const char *message)
+int connection_error(struct list_data_s *dat, const char *message)
 {
     syslog(LOG_ERR, "(thread %s) %s: %s", inet_ntoa(dat->client.sin_addr), message, strerror(errno));
-    cleanup_thread(dat, -1);
+    return cleanup_connection(dat, -1);
 }
 
-void *conn_handler(void *arg)
+/**
+ * Closes a connection that went over a packet size or memory limit.
+ * @return -1
+ */
+static int connection_over_limit(struct list_data_s *dat, const char *message)
 {
-    struct list_data_s *dat = (struct list_data_s *)arg;
+    syslog(LOG_WARNING, "(thread %s) %s, closing", inet_ntoa(dat->client.sin_addr), message);
+    metrics_add(METRIC_LIMIT_CLOSES, 1);
+    return cleanup_connection(dat, -1);
+}
 
-    int packet_len = 0;
-    int next_size = BLOCK_SIZE;
+/**
+ * Replies with the log range [@param from, @param len), a snapshot which needs no lock
+ * while sending, to the packet received at @param start.
+ * @return 0 on success, -1 on failure
+ */
+static int reply_with_log(struct list_data_s *dat, off_t from, off_t len, uint64_t start)
+{
+    off_t offset = from;
+    if (append_log_send(dat->conn_fd, &offset, len) == -1)
+    {
+        return -1;
+    }
+    metrics_reply_sent(len - from, start);
+    return 0;
+}
 
-    dat->rx_buffer = malloc(BLOCK_SIZE);
-    if (dat->rx_buffer == NULL)
+/**
+ * Hands the connection over to the subscriber thread, which sends it the log from
+ * @param offset on and every append after, so this handler can finish.
+ * @return 0 on success, -1 on failure
+ */
+static int serve_subscriber(struct list_data_s *dat, off_t offset)
+{
+    if (log_subscribers_add(dat->conn_fd, &dat->client, offset) != 0)
     {
-        thread_error(dat, "malloc fail");
+        return connection_error(dat, "Could not subscribe");
     }
+    line_assembler_free(&dat->rx);
+    splice_ingest_free(&dat->ingest);
+    return 0;
+}
 
-    while (1)
+/**
+ * Waits for the next packet of a persistent connection, unless a hand over starts
+ * first.  Only needed with a hand over socket, otherwise recv() simply blocks.
+ * @return 1 once the connection is readable, 0 when it should be closed instead
+ */
+static int wait_for_packet(struct list_data_s *dat)
+{
+    if (handoff_drain_fd() == -1)
     {
+        return 1;
+    }
+    struct pollfd fds[2] = {
+        {.fd = dat->conn_fd, .events = POLLIN},
+        {.fd = handoff_drain_fd(), .events = POLLIN},
+    };
+    int timeout = config.idle_timeout > 0 ? config.idle_timeout * 1000 : -1;
+    int n;
+    while ((n = poll(fds, 2, timeout)) == -1 && errno == EINTR)
+    {
+    }
+    if (n == 0)
+    {
+        syslog(LOG_INFO, "Idle timeout on connection from %s", inet_ntoa(dat->client.sin_addr));
+        return 0;
+    }
+    // a packet that already arrived is still served
+    if (n == -1 || fds[0].revents != 0)
+    {
+        return 1;
+    }
+    syslog(LOG_INFO, "Closed idle connection from %s for hand over", inet_ntoa(dat->client.sin_addr));
+    return 0;
+}
 
-        int num_rx = recv(dat->conn_fd, &dat->rx_buffer[packet_len], next_size, 0);
-        if (num_rx == -1)
+/**
+ * Finishes the packet whose first bytes are pending in dat->rx through the spill file,
+ * then appends and replies to it.
+ * @return 0 on success, -1 on failure
+ */
+static int serve_large_packet(struct list_data_s *dat)
+{
+    size_t head_len;
+    const char *head = line_assembler_drain(&dat->rx, &head_len);
+    if (splice_ingest_begin(&dat->ingest, DATA_DIR, head, head_len) != 0)
+    {
+        return connection_error(dat, "Could not start spill file");
+    }
+
+    int rc;
+    while ((rc = splice_ingest_recv(&dat->ingest, dat->conn_fd)) == 0)
+    {
+        if (admission_packet_too_large(dat->ingest.len))
         {
-            close(dat->conn_fd);
-            thread_error(dat, "Client connection failed");
+            metrics_add(METRIC_BYTES_IN, dat->ingest.len - head_len);
+            return connection_over_limit(dat, "Packet too large");
         }
-        int new_packet_len = packet_len + num_rx;
+    }
+    metrics_add(METRIC_BYTES_IN, dat->ingest.len - head_len);
+    if (rc == -1)
+    {
+        return connection_error(dat, "Client connection failed");
+    }
+
+    uint64_t start = metrics_packet_received(dat->ingest.len);
+    // see append_log_append(), a submitter only stops between appends
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    off_t len = append_log_append_file(dat->ingest.spill_fd, dat->ingest.len);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    if (len == -1)
+    {
+        return connection_error(dat, "failed to write to file");
+    }
+    if (splice_ingest_reset(&dat->ingest) != 0)
+    {
+        return connection_error(dat, "Could not reset spill file");
+    }
+    off_t from = dat->delta ? dat->delta_sent : 0;
+    dat->delta_sent = len;
+    if (reply_with_log(dat, from, len, start) != 0)
+    {
+        return connection_error(dat, "sendfile fail");
+    }
+    return 0;
+}
 
-        if (dat->rx_buffer[new_packet_len - 1] == '\n')
+int serve_connection(struct list_data_s *dat)
+{
+    line_assembler_init(&dat->rx);
+    dat->rx.budget = &admission_rx_budget;
+    splice_ingest_init(&dat->ingest);
+    dat->delta = 0;
+    dat->delta_sent = 0;
+
+    if (config.persistent && config.idle_timeout > 0)
+    {
+        struct timeval tv = {.tv_sec = config.idle_timeout, .tv_usec = 0};
+        if (setsockopt(dat->conn_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
         {
-            // END OF PACKET
-            packet_len = new_packet_len;
-            break;
+            return connection_error(dat, "Could not set idle timeout");
         }
-        if (num_rx < next_size)
+    }
+
+    while (1)
+    {
+        size_t packet_len;
+        const char *packet = line_assembler_next(&dat->rx, &packet_len);
+        if (packet == NULL && line_assembler_pending(&dat->rx) >= SPLICE_INGEST_THRESHOLD)
         {
-            dat->rx_buffer[new_packet_len] = 0;
-            char *eop = strchr(&dat->rx_buffer[packet_len], '\n');
-            if (eop == NULL)
+            // a bulk upload, keep the rest of it out of userspace
+            if (serve_large_packet(dat) != 0)
             {
-                next_size -= num_rx;
-                packet_len = new_packet_len;
+                return -1;
             }
-            else
+            if (!config.persistent)
             {
-                // END OF PACKET
-                packet_len = eop - dat->rx_buffer + 1;
                 break;
             }
+            continue;
         }
-        else
+
+        if (packet == NULL)
         {
-            // alloc more space for next block
-            packet_len = new_packet_len;
-            next_size = BLOCK_SIZE;
-            syslog(LOG_INFO, "realloc() %d", packet_len + BLOCK_SIZE);
-            char *rptr = realloc(dat->rx_buffer, packet_len + BLOCK_SIZE);
-            if (rptr == NULL)
+            if (admission_packet_too_large(line_assembler_pending(&dat->rx)))
             {
-                close(dat->conn_fd);
-                thread_error(dat, "malloc fail");
+                return connection_over_limit(dat, "Packet too large");
             }
-            dat->rx_buffer = rptr;
+            if (config.persistent && line_assembler_pending(&dat->rx) == 0 && !wait_for_packet(dat))
+            {
+                break;
+            }
+
+            size_t space;
+            char *rx_ptr = line_assembler_reserve(&dat->rx, BLOCK_SIZE, &space);
+            if (rx_ptr == NULL && errno == ENOBUFS && admission.policy == ADMIT_SPILL)
+            {
+                // out of receive memory, the rest of the packet goes to disk instead
+                if (serve_large_packet(dat) != 0)
+                {
+                    return -1;
+                }
+                if (!config.persistent)
+                {
+                    break;
+                }
+                continue;
+            }
+            if (rx_ptr == NULL && errno == ENOBUFS)
+            {
+                return connection_over_limit(dat, "Receive memory budget exhausted");
+            }
+            if (rx_ptr == NULL)
+            {
+                return connection_error(dat, "malloc fail");
+            }
+
+            ssize_t num_rx = recv(dat->conn_fd, rx_ptr, space, 0);
+            if (num_rx == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (config.persistent)
+            {
+                if (num_rx == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    syslog(LOG_INFO, "Idle timeout on connection from %s", inet_ntoa(dat->client.sin_addr));
+                    break;
+                }
+                if (num_rx == 0 && line_assembler_pending(&dat->rx) == 0)
+                {
+                    // client is done sending
+                    break;
+                }
+            }
+            if (num_rx == 0)
+            {
+                errno = ECONNRESET;
+            }
+            if (num_rx <= 0)
+            {
+                return connection_error(dat, "Client connection failed");
+            }
+            line_assembler_commit(&dat->rx, num_rx);
+            metrics_add(METRIC_BYTES_IN, num_rx);
+            continue;
+        }
+
+        // END OF PACKET
+        uint64_t start = metrics_packet_received(packet_len);
+        off_t from, len;
+        int command = log_command_range(packet, packet_len, &from, &len);
+        if (command == -1)
+        {
+            return connection_error(dat, "Command out of range");
+        }
+        if (command == LOG_COMMAND_SUBSCRIBE_TO)
+        {
+            return serve_subscriber(dat, from);
+        }
+        if (command == LOG_COMMAND_DELTA_FROM)
+        {
+            dat->delta = 1;
+        }
+        if (command == LOG_COMMAND_NONE)
+        {
+            from = dat->delta ? dat->delta_sent : 0;
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            len = append_log_append(packet, packet_len);
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        }
+        if (len == -1)
+        {
+            return connection_error(dat, "failed to write to file");
+        }
+        if (command != LOG_COMMAND_RANGE)
+        {
+            dat->delta_sent = len;
+        }
+
+        if (reply_with_log(dat, from, len, start) != 0)
+        {
+            return connection_error(dat, "sendfile fail");
+        }
+
+        if (!config.persistent)
+        {
+            break;
         }
     }
 
-    if (pthread_mutex_lock(&logfile.mutex) != 0)
+    syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(dat->client.sin_addr));
+
+    return cleanup_connection(dat, 1);
+}
+
+void *conn_handler(void *arg)
+{
+    struct list_data_s *dat = (struct list_data_s *)arg;
+    dat->result = serve_connection(dat);
+
+    struct list_data_s *top = atomic_load_explicit(&reaper.completed, memory_order_relaxed);
+    do
     {
-        thread_error(dat, "Could not get fs lock");
+        dat->done_next = top;
+    } while (!atomic_compare_exchange_weak_explicit(&reaper.completed, &top, dat, memory_order_release,
+                                                    memory_order_relaxed));
+    if (top == NULL)
+    {
+        // the reaper drains the whole stack, so only a push onto an empty one wakes it
+        sem_post(&reaper.wakeup);
     }
-    lseek(logfile.fd, 0, SEEK_END);
-    int written = write(logfile.fd, dat->rx_buffer, packet_len);
-    if (written == -1)
+    return NULL;
+}
+
+void *reaper_thread(void *arg)
+{
+    while (1)
     {
-        close(dat->conn_fd);
-        pthread_mutex_unlock(&logfile.mutex);
-        thread_error(dat, "failed to write to file");
+        while (sem_wait(&reaper.wakeup) == -1 && errno == EINTR)
+        {
+        }
+
+        // finish the batch even if cancelled meanwhile, so no handler is lost
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        struct list_data_s *dat = atomic_exchange_explicit(&reaper.completed, NULL, memory_order_acquire);
+        while (dat != NULL)
+        {
+            struct list_data_s *next = dat->done_next;
+            // taking the mutex also orders the read of dat->thread after pthread_create()
+            pthread_mutex_lock(&reaper.mutex);
+            TAILQ_REMOVE(&reaper.live, dat, entry);
+            pthread_mutex_unlock(&reaper.mutex);
+            int rc = pthread_join(dat->thread, NULL);
+            if (rc != 0)
+            {
+                syslog(LOG_ERR, "Thread join failed: %s", strerror(rc));
+            }
+            free(dat);
+            dat = next;
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
     }
+    return NULL;
+}
 
-    off_t offset = 0;
-    size_t len = lseek(logfile.fd, 0, SEEK_END);
-    lseek(logfile.fd, 0, SEEK_SET);
-    ssize_t socksent = sendfile(dat->conn_fd, logfile.fd, &offset, len);
-    if (socksent == -1)
+/**
+ * Starts @param start_routine free to run on any CPU even when started by a pinned
+ * accept thread.
+ */
+static int create_thread(pthread_t *thread, void *(*start_routine)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (CPU_COUNT(&process_cpus) > 0)
     {
-        close(dat->conn_fd);
-        pthread_mutex_unlock(&logfile.mutex);
-        thread_error(dat, "sendfile fail");
+        pthread_attr_setaffinity_np(&attr, sizeof(process_cpus), &process_cpus);
+    }
+    int rc = pthread_create(thread, &attr, start_routine, arg);
+    pthread_attr_destroy(&attr);
+    return rc;
+}
+
+int accept_connection(int listen_fd, struct sockaddr_in *client)
+{
+    socklen_t socklen = sizeof(*client);
+    if (handoff_drain_fd() == -1)
+    {
+        return accept(listen_fd, (struct sockaddr *)client, &socklen);
+    }
+    while (1)
+    {
+        struct pollfd fds = {.fd = listen_fd, .events = POLLIN};
+        if (poll(&fds, 1, -1) == -1 && errno != EINTR)
+        {
+            return -1;
+        }
+        // a cancellation acting inside accept() could lose the connection it just took
+        int oldstate;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+        int fd = accept(listen_fd, (struct sockaddr *)client, &socklen);
+        int err = errno;
+        pthread_setcancelstate(oldstate, NULL);
+        if (fd != -1 || (err != EAGAIN && err != EWOULDBLOCK && err != EINTR))
+        {
+            errno = err;
+            return fd;
+        }
     }
+}
 
-    if (pthread_mutex_unlock(&logfile.mutex) != 0)
+/**
+ * Frees the connection @param arg of an accept thread cancelled before accepting it,
+ * giving back the slot taken for it.
+ */
+static void cancel_accept(void *arg)
+{
+    free(arg);
+    if (admission.policy != ADMIT_REJECT)
     {
-        close(dat->conn_fd);
-        thread_error(dat, "failed to unlock logfile mutex");
+        admission_conn_leave();
     }
+}
 
-    syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(dat->client.sin_addr));
+/**
+ * Accepts connections on the listener @param arg and starts a handler thread for each.
+ */
+static void *accept_loop(void *arg)
+{
+    int listen_fd = (int)(intptr_t)arg;
+    while (1)
+    {
+        struct list_data_s *dat = (struct list_data_s *)malloc(sizeof(struct list_data_s));
+        if (dat == NULL)
+        {
+            exit_error("No thread memory available");
+        }
+        memset(dat, 0, sizeof(struct list_data_s));
 
-    cleanup_thread(dat, 1);
+        if (admission.policy != ADMIT_REJECT)
+        {
+            // at the limit, further connections wait in the listen backlog
+            admission_conn_wait();
+        }
+
+        // accept threads are cancelled while waiting here on shutdown or hand over
+        pthread_cleanup_push(cancel_accept, dat);
+        dat->conn_fd = accept_connection(listen_fd, &dat->client);
+        pthread_cleanup_pop(0);
+        if (dat->conn_fd == -1)
+        {
+            exit_error("Failed to accept");
+        }
+        if (admission.policy == ADMIT_REJECT && !admission_conn_try_enter())
+        {
+            admission_reject(dat->conn_fd);
+            free(dat);
+            continue;
+        }
+        // a shard thread cancelled from here on would leak the connection
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        metrics_add(METRIC_ACCEPTS, 1);
+
+        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(dat->client.sin_addr));
+
+        // listed before it starts, so the reaper always finds it there
+        pthread_mutex_lock(&reaper.mutex);
+        TAILQ_INSERT_TAIL(&reaper.live, dat, entry);
+        if (create_thread(&dat->thread, conn_handler, dat) != 0)
+        {
+            TAILQ_REMOVE(&reaper.live, dat, entry);
+            pthread_mutex_unlock(&reaper.mutex);
+            exit_error("Could not create thread");
+        }
+        pthread_mutex_unlock(&reaper.mutex);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
     return NULL;
 }
 
-void timer_handler(sigval_t v)
+/**
+ * Cancels and joins the accept threads of the thread per connection mode, the main
+ * thread among them, leaving the handlers running.
+ */
+static void stop_accept_threads(void)
 {
-    struct locked_file_s *f = (struct locked_file_s *)v.sival_ptr;
-    char tsbuffer[64];
+    for (int i = 0; i < num_shard_threads; i++)
+    {
+        pthread_cancel(shard_threads[i]);
+        pthread_join(shard_threads[i], NULL);
+    }
+    num_shard_threads = 0;
+    pthread_cancel(main_thread);
+    pthread_join(main_thread, NULL);
+    cleanup_state &= ~CLEAN_SHARDS;
+}
+
+/**
+ * Waits up to drain_timeout seconds for every connection to close.
+ */
+static void drain_connections(void)
+{
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += drain_timeout;
+    long open;
+    while ((open = admission_connections()) > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+        {
+            syslog(LOG_WARNING, "%ld connections still open after %ld seconds, handing over regardless", open,
+                   drain_timeout);
+            return;
+        }
+        struct timespec poll_interval = {.tv_sec = 0, .tv_nsec = 1000000};
+        nanosleep(&poll_interval, NULL);
+    }
+}
+
+/**
+ * Waits for a new server on the hand over socket, then stops accepting, drains and
+ * passes it the listeners and the data file before exiting.
+ */
+static void *handoff_thread(void *arg)
+{
+    int conn_fd;
+    while ((conn_fd = handoff_accept(handoff_sock)) == -1)
+    {
+        if (errno != EPROTO && errno != EINTR && errno != ECONNABORTED)
+        {
+            exit_error("Failed to accept on the hand over socket");
+        }
+        syslog(LOG_WARNING, "Ignored a connection to the hand over socket: %s", strerror(errno));
+    }
+    // the new server is waiting, a shutdown now would leave it with nothing
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    syslog(LOG_INFO, "Handing over to a new server, draining connections");
+
+    pthread_mutex_lock(&serving.mutex);
+    while (!serving.started)
+    {
+        pthread_cond_wait(&serving.cond, &serving.mutex);
+    }
+    pthread_mutex_unlock(&serving.mutex);
+
+    handoff_begin_drain();
+    switch (server_mode)
+    {
+    case MODE_THREAD:
+        stop_accept_threads();
+        break;
+    case MODE_POOL:
+        pool_server_drain();
+        break;
+    case MODE_EPOLL:
+        epoll_server_drain();
+        break;
+    case MODE_URING:
+        uring_server_drain();
+        break;
+    }
+    if (cleanup_state & CLEAN_SUBSCRIBERS)
+    {
+        log_subscribers_stop();
+        cleanup_state &= ~CLEAN_SUBSCRIBERS;
+    }
+    drain_connections();
+
+    // after the last append of this server, any connection left over fails its next one
+    if (cleanup_state & CLEAN_TIMER)
+    {
+        timestamp_stop();
+        cleanup_state &= ~CLEAN_TIMER;
+    }
+    append_log_seal();
+    // the new server binds the metrics socket in turn, it must not find it removed later
+    if (cleanup_state & CLEAN_METRICS)
+    {
+        metrics_stop();
+        cleanup_state &= ~CLEAN_METRICS;
+    }
 
-    time_t t = time(NULL);
-    struct tm *tms = localtime(&t);
-    size_t len = strftime(tsbuffer, sizeof(tsbuffer) - 1, "%a, %d %b %Y %T %z", tms);
-    tsbuffer[len] = '\n';
-    pthread_mutex_lock(&f->mutex);
-    lseek(f->fd, 0, SEEK_END);
-    write(f->fd, "timestamp:", 10);
-    write(f->fd, tsbuffer, len + 1);
-    pthread_mutex_unlock(&f->mutex);
+    struct handoff_state state;
+    state.sock_fd = handoff_sock;
+    state.data_fd = append_log_fd();
+    state.committed = append_log_committed();
+    state.nlisteners = num_server_conns;
+    memcpy(state.listen_fds, server_conns, num_server_conns * sizeof(int));
+    handed_off = 1;
+    if (handoff_send(conn_fd, &state) != 0)
+    {
+        exit_error("Could not hand over to the new server");
+    }
+    syslog(LOG_INFO, "Handed over %ld bytes of data to the new server, exiting", (long)state.committed);
+    cleanup(0);
+    return NULL;
+}
+
+/**
+ * Takes over the listeners and the data file of the server running at handoff_path,
+ * if there is one.
+ * @return 1 when taken over, 0 when no server runs there
+ */
+static int take_over(void)
+{
+    struct handoff_state state;
+    int rc = handoff_receive(handoff_path, &state);
+    if (rc == -1)
+    {
+        exit_error("Could not take over from the running server");
+    }
+    if (rc == 0)
+    {
+        return 0;
+    }
+    handoff_sock = state.sock_fd;
+    cleanup_state |= CLEAN_HANDOFF;
+
+    if (append_log_adopt(state.data_fd, DATA_FILE, state.committed) != 0)
+    {
+        exit_error("Could not take over the data file");
+    }
+    cleanup_state |= CLEAN_FD;
+
+    server_conns = calloc(state.nlisteners, sizeof(int));
+    if (server_conns == NULL)
+    {
+        exit_error("No listener memory available");
+    }
+    memcpy(server_conns, state.listen_fds, state.nlisteners * sizeof(int));
+    num_server_conns = state.nlisteners;
+    num_shards = state.nlisteners;
+    cleanup_state |= CLEAN_SERVER;
+    syslog(LOG_INFO, "Took over %d listeners and %ld bytes of data from the running server", num_server_conns,
+           (long)state.committed);
+    return 1;
+}
+
+void usage_error(void)
+{
+    syslog(LOG_ERR, "Invalid arguments");
+    fprintf(stderr, "Usage: aesdsocket [-d] [-m thread|epoll|pool|uring] [-l loops] [-w workers] [-q depth] [-k idle_seconds] [-g] [-D none|periodic:ms|sync] [-t timestamp_seconds] [-M metrics_socket] [-s shards]\n"
+                    "       [-c max_connections] [-p max_packet] [-b rx_budget] [-B backlog] [-O defer|reject|spill]\n"
+                    "       [-H handoff_socket] [-T drain_seconds] [-r] [-L file|mmap[:chunk_mb]|records:n|bytes:size]\n"
+                    "A hand over (-H) passes on the listeners, not the connections: each is closed once idle,\n"
+                    "so persistent (-k) and subscribed clients see EOF and have to reconnect to the new server.\n");
+    cleanup(-1);
+}
+
+/**
+ * Parses a byte count with an optional k, m or g suffix.
+ * @return the count, or 0 when @param arg is not one
+ */
+static size_t parse_bytes(const char *arg)
+{
+    if (*arg < '0' || *arg > '9')
+    {
+        // strtoull() would take a minus sign too, negating the result
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (errno == ERANGE || n > SIZE_MAX)
+    {
+        return 0;
+    }
+    size_t unit = 1;
+    switch (*end)
+    {
+    case 'g':
+    case 'G':
+        unit *= 1024;
+        // fall through
+    case 'm':
+    case 'M':
+        unit *= 1024;
+        // fall through
+    case 'k':
+    case 'K':
+        unit *= 1024;
+        end++;
+        break;
+    }
+    return (*end != '\0' || n > SIZE_MAX / unit) ? 0 : n * unit;
+}
+
+/**
+ * Parses @param arg as a decimal number from @param min to @param max, exiting with
+ * the usage message when it is anything else.
+ * @return the number
+ */
+static long parse_count(const char *arg, long min, long max)
+{
+    char *end;
+    errno = 0;
+    long n = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno == ERANGE || n < min || n > max)
+    {
+        usage_error();
+    }
+    return n;
 }
 
 int main(int argc, char *argv[])
 {
     openlog(NULL, 0, LOG_USER);
+    main_thread = pthread_self();
 
-    if (argc > 2 || ((argc == 2) && strcmp(argv[1], "-d")))
+    int run_daemon = 0;
+    int group_commit = 0;
+    durability_t durability = DURABILITY_NONE;
+    long sync_period_ms = 0;
+    long map_chunk_mb = 0;
+    servermode_t mode = MODE_THREAD;
+    long nloops = sysconf(_SC_NPROCESSORS_ONLN);
+    long nworkers = 4 * nloops;
+    long depth = 128;
+    long backlog = 10;
+    long timestamp_ms = TIMESTAMP_DEFAULT_INTERVAL_MS;
+    const char *metrics_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "dm:l:w:q:k:gD:t:M:s:c:p:b:B:O:H:T:rL:")) != -1)
     {
-        syslog(LOG_ERR, "Invalid arguments");
-        cleanup(-1);
+        switch (opt)
+        {
+        case 'd':
+            run_daemon = 1;
+            break;
+        case 'm':
+            if (strcmp(optarg, "thread") == 0)
+            {
+                mode = MODE_THREAD;
+            }
+            else if (strcmp(optarg, "epoll") == 0)
+            {
+                mode = MODE_EPOLL;
+            }
+            else if (strcmp(optarg, "pool") == 0)
+            {
+                mode = MODE_POOL;
+            }
+            else if (strcmp(optarg, "uring") == 0)
+            {
+                mode = MODE_URING;
+            }
+            else
+            {
+                usage_error();
+            }
+            break;
+        case 'l':
+            nloops = parse_count(optarg, 1, INT_MAX);
+            break;
+        case 'w':
+            nworkers = parse_count(optarg, 1, INT_MAX);
+            break;
+        case 'q':
+            depth = parse_count(optarg, 1, INT_MAX);
+            break;
+        case 'g':
+            group_commit = 1;
+            break;
+        case 'D':
+            if (strcmp(optarg, "none") == 0)
+            {
+                durability = DURABILITY_NONE;
+            }
+            else if (strcmp(optarg, "sync") == 0)
+            {
+                durability = DURABILITY_SYNC;
+            }
+            else if (strncmp(optarg, "periodic:", 9) == 0)
+            {
+                durability = DURABILITY_PERIODIC;
+                sync_period_ms = parse_count(&optarg[9], 1, LONG_MAX);
+            }
+            else
+            {
+                usage_error();
+            }
+            break;
+        case 'M':
+            metrics_path = optarg;
+            break;
+        case 'H':
+            handoff_path = optarg;
+            break;
+        case 'r':
+            warm_start = 1;
+            break;
+        case 'L':
+            // the last -L given wins
+            map_chunk_mb = 0;
+            bounded_log = 0;
+            if (strcmp(optarg, "mmap") == 0)
+            {
+                map_chunk_mb = DEFAULT_MAP_CHUNK_MB;
+            }
+            else if (strncmp(optarg, "mmap:", 5) == 0)
+            {
+                map_chunk_mb = parse_count(&optarg[5], 1, LONG_MAX >> 20);
+            }
+            else if (strncmp(optarg, "records:", 8) == 0)
+            {
+                bounded_log = 1;
+                history_bytes = 0;
+                history_records = parse_count(&optarg[8], 1, BOUNDED_HISTORY_MAX_RECORDS);
+            }
+            else if (strncmp(optarg, "bytes:", 6) == 0)
+            {
+                bounded_log = 1;
+                history_records = 0;
+                history_bytes = parse_bytes(&optarg[6]);
+                if (history_bytes == 0)
+                {
+                    usage_error();
+                }
+            }
+            else if (strcmp(optarg, "file") != 0)
+            {
+                usage_error();
+            }
+            break;
+        case 'T':
+            drain_timeout = parse_count(optarg, 0, INT_MAX);
+            break;
+        case 'c':
+            admission.max_connections = parse_count(optarg, 1, LONG_MAX);
+            break;
+        case 'p':
+            admission.max_packet = parse_bytes(optarg);
+            if (admission.max_packet == 0)
+            {
+                usage_error();
+            }
+            break;
+        case 'b':
+            admission_rx_budget.limit = parse_bytes(optarg);
+            if (admission_rx_budget.limit == 0)
+            {
+                usage_error();
+            }
+            break;
+        case 'B':
+            backlog = parse_count(optarg, 1, INT_MAX);
+            break;
+        case 'O':
+            if (strcmp(optarg, "defer") == 0)
+            {
+                admission.policy = ADMIT_DEFER;
+            }
+            else if (strcmp(optarg, "reject") == 0)
+            {
+                admission.policy = ADMIT_REJECT;
+            }
+            else if (strcmp(optarg, "spill") == 0)
+            {
+                admission.policy = ADMIT_SPILL;
+            }
+            else
+            {
+                usage_error();
+            }
+            break;
+        case 's':
+            // 0 shards the listener once per CPU
+            num_shards = parse_count(optarg, 0, INT_MAX);
+            break;
+        case 't':
+        {
+            // fractional seconds allowed, so -t 0.25 stamps four times a second
+            char *end;
+            errno = 0;
+            double seconds = strtod(optarg, &end);
+            // checked before converting, which is undefined for values a long can't hold
+            if (end == optarg || *end != '\0' || errno == ERANGE ||
+                !(seconds > 0 && seconds <= LONG_MAX / 1000.0))
+            {
+                usage_error();
+            }
+            timestamp_ms = seconds * 1000 + 0.5;
+            if (timestamp_ms < 1)
+            {
+                usage_error();
+            }
+            break;
+        }
+        case 'k':
+            config.persistent = 1;
+            config.idle_timeout = parse_count(optarg, 0, INT_MAX);
+            break;
+        default:
+            usage_error();
+        }
     }
-
-    if (signal(SIGINT, signal_handler) == SIG_ERR)
+    if (optind != argc)
     {
-        syslog(LOG_ERR, "Failed to register SIGINT handler");
-        cleanup(-1);
+        usage_error();
+    }
+    if (bounded_log && (warm_start || handoff_path != NULL || durability != DURABILITY_NONE))
+    {
+        // there is no file to recover, hand over or sync
+        usage_error();
+    }
+    if (nloops < 1)
+    {
+        nloops = 1;
+    }
+    if (nworkers < 1)
+    {
+        nworkers = 4;
+    }
+    if (sched_getaffinity(0, sizeof(process_cpus), &process_cpus) != 0)
+    {
+        CPU_ZERO(&process_cpus);
+    }
+    // a running server hands over its listeners, whose number then overrides -s
+    int taken_over = handoff_path != NULL && take_over();
+    if (num_shards == 0)
+    {
+        num_shards = CPU_COUNT(&process_cpus) > 0 ? CPU_COUNT(&process_cpus) : 1;
+    }
+    if (handoff_path != NULL && num_shards > HANDOFF_MAX_LISTENERS)
+    {
+        num_shards = HANDOFF_MAX_LISTENERS;
+    }
+    if (mode == MODE_URING && num_shards > 1 && taken_over)
+    {
+        syslog(LOG_INFO, "io_uring mode serves one listener, using epoll for the %d taken over", num_shards);
+        mode = MODE_EPOLL;
+    }
+    if (mode == MODE_URING && num_shards > 1)
+    {
+        // a listener nobody accepts on would still be handed its share of connections
+        syslog(LOG_INFO, "io_uring mode serves from one thread, using a single listener");
+        num_shards = 1;
+    }
+    if (mode == MODE_EPOLL && nloops < num_shards)
+    {
+        nloops = num_shards;
     }
 
-    if (signal(SIGTERM, signal_handler) == SIG_ERR)
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
     {
-        syslog(LOG_ERR, "Failed to register SIGTERM handler");
+        syslog(LOG_ERR, "Failed to ignore SIGPIPE");
         cleanup(-1);
     }
 
-    open_data_file();
+    // blocked before any thread exists, so SIGINT and SIGTERM only ever reach
+    // signal_thread() and SIGUSR1 the metrics signalfd
+    static sigset_t exit_signals;
+    sigemptyset(&exit_signals);
+    sigaddset(&exit_signals, SIGINT);
+    sigaddset(&exit_signals, SIGTERM);
+    sigset_t blocked = exit_signals;
+    sigaddset(&blocked, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &blocked, NULL);
+
+    if (!taken_over)
+    {
+        open_data_file();
 
-    open_server();
+        open_server();
 
-    bind_server();
+        bind_server();
+    }
+
+    if (handoff_path != NULL && !taken_over)
+    {
+        handoff_sock = handoff_listen(handoff_path);
+        if (handoff_sock == -1)
+        {
+            exit_error("Could not listen on the hand over socket");
+        }
+        cleanup_state |= CLEAN_HANDOFF;
+    }
+    for (int i = 0; handoff_path != NULL && i < num_server_conns; i++)
+    {
+        // see accept_connection(), the flag is shared with every server the listener goes to
+        int flags = fcntl(server_conns[i], F_GETFL);
+        if (flags == -1 || fcntl(server_conns[i], F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            exit_error("Could not make server socket non-blocking");
+        }
+    }
 
-    if (argc == 2)
+    if (run_daemon)
     {
         start_daemon();
     }
 
-    if (listen(server_conn, 10) != 0)
+    // threads don't survive the fork, so they are started in the daemon
+    pthread_t signal_thread_id;
+    if (create_thread(&signal_thread_id, signal_thread, &exit_signals) != 0)
     {
-        exit_error("Failed to listen");
+        exit_error("Could not create signal thread");
     }
+    pthread_detach(signal_thread_id);
 
-    SLIST_INIT(&head);
+    if (append_log_set_durability(durability, sync_period_ms) != 0)
+    {
+        exit_error("Could not set up durability");
+    }
 
-    struct sigevent sigev;
-    memset(&sigev, 0, sizeof(sigev));
-    sigev.sigev_notify = SIGEV_THREAD;
-    sigev.sigev_value.sival_ptr = &logfile;
-    sigev.sigev_notify_function = timer_handler;
-    timer_create(CLOCK_REALTIME, &sigev, &periodic_timer);
+    if (map_chunk_mb > 0 && append_log_map((size_t)map_chunk_mb << 20) != 0)
+    {
+        exit_error("Could not map the data file");
+    }
 
-    struct itimerspec its;
-    its.it_interval.tv_sec = 10;
-    its.it_interval.tv_nsec = 0;
-    its.it_value.tv_sec = 10;
-    its.it_value.tv_nsec = 0;
+    if (group_commit && append_log_start_group_commit() != 0)
+    {
+        exit_error("Could not start group commit thread");
+    }
 
-    timer_settime(periodic_timer, 0, &its, NULL);
+    if (admission_init() != 0)
+    {
+        exit_error("Could not set up admission control");
+    }
 
-    while (1)
+    if (handoff_path != NULL && handoff_init() != 0)
     {
-        struct list_data_s *dat = (struct list_data_s *)malloc(sizeof(struct list_data_s));
-        if (dat == NULL)
-        {
-            exit_error("No thread memory available");
-        }
-        memset(dat, 0, sizeof(struct list_data_s));
+        exit_error("Could not set up hand over");
+    }
 
-        SLIST_INSERT_HEAD(&head, dat, entry);
+    if (metrics_start(metrics_path) != 0)
+    {
+        exit_error("Could not start metrics");
+    }
+    cleanup_state |= CLEAN_METRICS;
 
-        socklen_t socklen = sizeof(dat->client);
-        dat->conn_fd = accept(server_conn, (struct sockaddr *)&dat->client, &socklen);
-        if (dat->conn_fd == -1)
+    for (int i = 0; i < num_shards; i++)
+    {
+        if (listen(server_conns[i], backlog) != 0)
         {
-            exit_error("Failed to accept");
+            exit_error("Failed to listen");
         }
+    }
 
-        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(dat->client.sin_addr));
+    if (timestamp_start(timestamp_ms) != 0)
+    {
+        exit_error("Could not start timestamp timer");
+    }
+    cleanup_state |= CLEAN_TIMER;
 
-        if (pthread_create(&dat->thread, NULL, conn_handler, dat) != 0)
+    if (handoff_sock != -1)
+    {
+        if (create_thread(&handoff_thread_id, handoff_thread, NULL) != 0)
         {
-            exit_error("Could not create thread");
+            exit_error("Could not create hand over thread");
         }
+        handoff_running = 1;
+    }
+
+    server_mode = mode;
+    if (mode == MODE_URING)
+    {
+        cleanup_state |= CLEAN_URING;
+        uring_server_run(server_conns[0]);
+        cleanup_state &= ~CLEAN_URING;
+        syslog(LOG_ERR, "io_uring unavailable (%s), falling back to epoll", strerror(errno));
+        mode = MODE_EPOLL;
+        server_mode = mode;
+    }
+
+    if (mode == MODE_EPOLL)
+    {
+        cleanup_state |= CLEAN_EPOLL;
+        epoll_server_run(server_conns, num_shards, nloops);
+    }
+
+    // the event loops push to their own subscribers, the blocking modes hand theirs to a thread
+    if (log_subscribers_start() != 0)
+    {
+        exit_error("Could not start subscriber thread");
+    }
+    cleanup_state |= CLEAN_SUBSCRIBERS;
+
+    if (mode == MODE_POOL)
+    {
+        cleanup_state |= CLEAN_POOL;
+        pool_server_run(server_conns, num_shards, nworkers, depth);
+    }
 
-        struct list_data_s *tmp = NULL;
-        SLIST_FOREACH_SAFE(dat, &head, entry, tmp)
+    if (sem_init(&reaper.wakeup, 0, 0) != 0)
+    {
+        exit_error("Could not create reaper semaphore");
+    }
+    if (create_thread(&reaper.thread, reaper_thread, NULL) != 0)
+    {
+        exit_error("Could not create reaper thread");
+    }
+    cleanup_state |= CLEAN_REAPER;
+
+    shard_threads = calloc(num_shards, sizeof(pthread_t));
+    if (shard_threads == NULL)
+    {
+        exit_error("No shard memory available");
+    }
+    cleanup_state |= CLEAN_SHARDS;
+    for (int i = 1; i < num_shards; i++)
+    {
+        if (create_thread(&shard_threads[num_shard_threads], accept_loop, (void *)(intptr_t)server_conns[i]) != 0)
         {
-            if (dat->result)
-            {
-                if (pthread_join(dat->thread, NULL) != 0)
-                {
-                    exit_error("Thread join failed");
-                }
-                SLIST_REMOVE(&head, dat, list_data_s, entry);
-                free(dat);
-            }
+            exit_error("Could not create accept thread");
         }
+        pin_to_core(shard_threads[num_shard_threads++], i);
     }
+    if (num_shards > 1)
+    {
+        pin_to_core(pthread_self(), 0);
+    }
+
+    server_started();
+    accept_loop((void *)(intptr_t)server_conns[0]);
     exit_error("Execution reached end of function");
 }
\ No newline at end of file
@@ -0,0 +1,147 @@
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "queue.h"
+#include "line-assembler.h"
+#include "splice-ingest.h"
+
+#define BLOCK_SIZE 4096
+
+#define DATA_DIR "/var/tmp"
+#define DATA_FILE DATA_DIR "/aesdsocketdata"
+/**
+ * MiB the data file grows by at a time with -L mmap
+ */
+#define DEFAULT_MAP_CHUNK_MB 64
+
+struct list_data_s
+{
+    struct sockaddr_in client;
+    pthread_t thread;
+    int conn_fd;
+    int result;
+    struct line_assembler rx;
+    struct splice_ingest ingest;
+    /**
+     * Set by AESDCHAR_DELTA, after which replies start at delta_sent, the end of the
+     * previous reply
+     */
+    int delta;
+    off_t delta_sent;
+    TAILQ_ENTRY(list_data_s)
+    entry;
+    /**
+     * Link in the completion stack, set by the handler thread as it finishes
+     */
+    struct list_data_s *done_next;
+};
+
+struct server_config_s
+{
+    /**
+     * Keep connections open and handle every newline terminated packet they carry
+     */
+    int persistent;
+    /**
+     * Seconds a persistent connection may stay quiet before it is closed, 0 for no limit
+     */
+    int idle_timeout;
+};
+
+extern struct server_config_s config;
+
+void exit_error(const char *message);
+
+/**
+ * Called by each server mode once it is set up, right before serving, so a hand over
+ * never finds it half started.
+ */
+void server_started(void);
+
+/**
+ * Accepts a connection on @param listen_fd, blocking until there is one, with the
+ * peer's address stored in @param client.  A cancellation point, which never loses
+ * a connection to a cancellation with a hand over socket, the listener then being
+ * non-blocking and polled first.
+ * @return the connection, or -1 with errno set
+ */
+int accept_connection(int listen_fd, struct sockaddr_in *client);
+
+/**
+ * Pins @param thread to the @param index th CPU the process may run on, wrapping
+ * around when there are fewer.  Failure is logged and otherwise ignored.
+ */
+void pin_to_core(pthread_t thread, int index);
+
+/**
+ * Receives one packet on dat->conn_fd, appends it and replies with the data file,
+ * repeating for every following packet when config.persistent is set.
+ * Always closes the connection before returning.
+ * @return 1 on success, -1 on failure
+ */
+int serve_connection(struct list_data_s *dat);
+
+/**
+ * Runs the edge-triggered epoll reactor on @param nloops loop threads, the calling
+ * thread being one of them.  Loop i accepts on listener i % @param nlisteners of
+ * @param listen_fds, and is pinned to a core when there is more than one listener.
+ * Does not return.
+ */
+void epoll_server_run(const int *listen_fds, int nlisteners, int nloops);
+
+/**
+ * Waits until every loop stopped accepting for good, which they do once the hand over
+ * drain fd is signalled.  Connections with no packet in progress are closed, the
+ * others after their reply.
+ */
+void epoll_server_drain(void);
+
+/**
+ * Cancels and joins every loop thread other than the calling one.
+ */
+void epoll_server_stop(void);
+
+/**
+ * Starts @param nworkers pre-spawned worker threads, then accepts on each of the
+ * @param nlisteners sockets in @param listen_fds from an accept thread of its own,
+ * the calling thread serving the first, and hands each connection to the pool
+ * through a queue holding at most @param depth connections.  Does not return.
+ */
+void pool_server_run(const int *listen_fds, int nlisteners, int nworkers, int depth);
+
+/**
+ * Cancels and joins the accept threads, the calling thread of pool_server_run() among
+ * them, leaving the workers to serve every connection already accepted.
+ */
+void pool_server_drain(void);
+
+/**
+ * Cancels and joins the worker and accept threads, the one running pool_server_run()
+ * among them unless it is the calling one, and closes any queued connections.
+ */
+void pool_server_stop(void);
+
+/**
+ * Serves every connection from the calling thread through one io_uring instance:
+ * multishot accept and recv, and replies spliced from the data file to the socket.
+ * Does not return once running.
+ * @return -1 with errno set when io_uring is unavailable, before accepting anything
+ */
+int uring_server_run(int listen_fd);
+
+/**
+ * Waits until the ring stopped accepting for good, which it does once the hand over
+ * drain fd is signalled, closing the connections with no packet in progress.
+ */
+void uring_server_drain(void);
+
+/**
+ * Stops the ring thread between completions and waits for it, returning at once when
+ * called from the ring thread or before the ring is running.
+ */
+void uring_server_stop(void);
+
+#endif /* AESDSOCKET_H */
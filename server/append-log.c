@@ -0,0 +1,1219 @@
+/**
+ * @file append-log.c
+ * @brief Append-only data file with an atomically published committed length
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include "append-log.h"
+#include "newline-scan.h"
+#include "metrics.h"
+#include "bounded-history.h"
+#include "wake-fd.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct locked_file_s
+{
+    int fd;
+    pthread_mutex_t mutex;
+    /**
+     * Length of the file up to the end of the last complete append.  Written with
+     * release semantics while holding mutex, read with acquire semantics lock-free.
+     */
+    _Atomic off_t committed;
+    /**
+     * Set by append_log_seal() while holding mutex, failing every later append
+     */
+    int sealed;
+    /**
+     * Set by append_log_open_bounded(), records then go to the bounded history
+     * instead of a file
+     */
+    int bounded;
+    const char *path;
+};
+
+static struct locked_file_s logfile = {
+    .fd = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Address space reserved by append_log_map(), the most a mapped log can grow to
+ */
+#if SIZE_MAX > 0xffffffffUL
+#define MAP_RESERVE ((size_t)1 << 40)
+#else
+#define MAP_RESERVE ((size_t)1 << 30)
+#endif
+
+/**
+ * The log's memory mapping, base NULL unless append_log_map() was called.  Grown while
+ * holding logfile.mutex, in place since base never moves, so readers of the committed
+ * range need no lock.
+ */
+static struct
+{
+    char *base;
+    size_t chunk;
+    /**
+     * Bytes of the file mapped at base, the file being at least that long
+     */
+    off_t mapped;
+} mapping;
+
+#define INDEX_CHUNK_SHIFT 12
+#define INDEX_CHUNK_RECORDS (1UL << INDEX_CHUNK_SHIFT)
+#define INDEX_CHUNKS (1UL << 20)
+
+/**
+ * End offset of every record, in fixed size chunks so that the entries never move
+ * and readers need no lock.  Written while holding logfile.mutex, before count is
+ * published with release semantics; entries below count never change.
+ */
+static struct
+{
+    _Atomic(off_t *) chunks[INDEX_CHUNKS];
+    _Atomic unsigned long count;
+} record_index;
+
+/**
+ * Makes room in the index for @param n more records.  Caller holds logfile.mutex.
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int index_reserve_locked(unsigned long n)
+{
+    unsigned long count = atomic_load_explicit(&record_index.count, memory_order_relaxed);
+    if (n > INDEX_CHUNKS * INDEX_CHUNK_RECORDS - count)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+    for (unsigned long chunk = count >> INDEX_CHUNK_SHIFT; chunk <= (count + n - 1) >> INDEX_CHUNK_SHIFT; chunk++)
+    {
+        if (atomic_load_explicit(&record_index.chunks[chunk], memory_order_relaxed) == NULL)
+        {
+            off_t *entries = malloc(INDEX_CHUNK_RECORDS * sizeof(off_t));
+            if (entries == NULL)
+            {
+                return -1;
+            }
+            atomic_store_explicit(&record_index.chunks[chunk], entries, memory_order_release);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Records the end of the next record at @param end, unpublished until
+ * index_publish_locked().  Caller holds logfile.mutex and reserved the entry.
+ * @param pending the number of records added since the last publish
+ */
+static void index_add_locked(unsigned long pending, off_t end)
+{
+    unsigned long record = atomic_load_explicit(&record_index.count, memory_order_relaxed) + pending;
+    off_t *entries = atomic_load_explicit(&record_index.chunks[record >> INDEX_CHUNK_SHIFT], memory_order_relaxed);
+    entries[record & (INDEX_CHUNK_RECORDS - 1)] = end;
+}
+
+static void index_publish_locked(unsigned long added)
+{
+    unsigned long count = atomic_load_explicit(&record_index.count, memory_order_relaxed);
+    atomic_store_explicit(&record_index.count, count + added, memory_order_release);
+}
+
+/**
+ * @return the end offset of the published @param record
+ */
+static off_t index_end(unsigned long record)
+{
+    off_t *entries = atomic_load_explicit(&record_index.chunks[record >> INDEX_CHUNK_SHIFT], memory_order_acquire);
+    return entries[record & (INDEX_CHUNK_RECORDS - 1)];
+}
+
+static void index_clear(void)
+{
+    for (unsigned long chunk = 0; chunk < INDEX_CHUNKS; chunk++)
+    {
+        off_t *entries = atomic_exchange(&record_index.chunks[chunk], NULL);
+        if (entries == NULL)
+        {
+            break;
+        }
+        free(entries);
+    }
+    atomic_store(&record_index.count, 0);
+}
+
+/**
+ * A record waiting for the group commit thread, living on the submitter's stack
+ */
+struct append_request
+{
+    const char *buf;
+    size_t len;
+    /**
+     * Committed length right after this record, or -1 if it could not be written
+     */
+    off_t end;
+    int err;
+    /**
+     * Set by the appender once end is valid, protected by group_commit.mutex
+     */
+    int done;
+    struct append_request *next;
+};
+
+struct group_commit_s
+{
+    pthread_t thread;
+    int running;
+    /**
+     * Lock-free stack of submitted requests, newest first
+     */
+    _Atomic(struct append_request *) pending;
+    sem_t wakeup;
+    pthread_mutex_t mutex;
+    pthread_cond_t committed;
+};
+
+static struct group_commit_s group_commit = {
+    .running = 0,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .committed = PTHREAD_COND_INITIALIZER,
+};
+
+struct durability_s
+{
+    durability_t mode;
+    int period_ms;
+    pthread_t thread;
+    int running;
+    /**
+     * Everything below synced has reached the disk, protected by mutex
+     */
+    off_t synced;
+    int in_progress;
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+};
+
+/**
+ * Subscribers waiting for appends past what they have been sent
+ */
+struct watch_s
+{
+    /**
+     * Registered subscribers, appends signal wake_fd only while there are any
+     */
+    atomic_int watchers;
+    int wake_fd;
+};
+
+static struct watch_s watch = {
+    .wake_fd = -1,
+};
+
+static struct durability_s durability = {
+    .mode = DURABILITY_NONE,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Makes sure everything below @param end is on disk.  Concurrent callers share one
+ * fdatasync(): whoever finds none in progress syncs up to the current committed
+ * length on behalf of everybody waiting.  Callers have cancellation disabled, one
+ * cancelled while waiting for another's fdatasync() would keep durability.mutex.
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int log_sync_to(off_t end)
+{
+    int rc = 0;
+    pthread_mutex_lock(&durability.mutex);
+    while (durability.synced < end && rc == 0)
+    {
+        if (durability.in_progress)
+        {
+            pthread_cond_wait(&durability.done, &durability.mutex);
+            continue;
+        }
+        durability.in_progress = 1;
+        off_t target = atomic_load_explicit(&logfile.committed, memory_order_acquire);
+        pthread_mutex_unlock(&durability.mutex);
+
+        rc = fdatasync(logfile.fd);
+        int err = errno;
+
+        pthread_mutex_lock(&durability.mutex);
+        durability.in_progress = 0;
+        if (rc == 0 && target > durability.synced)
+        {
+            durability.synced = target;
+        }
+        pthread_cond_broadcast(&durability.done);
+        errno = err;
+    }
+    pthread_mutex_unlock(&durability.mutex);
+    return rc;
+}
+
+static void *periodic_sync_thread(void *arg)
+{
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1)
+    {
+        next.tv_sec += durability.period_ms / 1000;
+        next.tv_nsec += (durability.period_ms % 1000) * 1000000L;
+        if (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+        {
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        log_sync_to(atomic_load_explicit(&logfile.committed, memory_order_acquire));
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * Indexes a record ending at each newline of the log's first @param committed bytes,
+ * and one more for any bytes after the last.  Caller holds logfile.mutex.
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int index_rebuild_locked(off_t committed)
+{
+    size_t buf_size = 1 << 20;
+    char *buf = malloc(buf_size);
+    size_t *positions = malloc(INDEX_CHUNK_RECORDS * sizeof(size_t));
+    if (buf == NULL || positions == NULL)
+    {
+        free(buf);
+        free(positions);
+        return -1;
+    }
+
+    // only a hint, multi-GB logs are read front to back once
+    posix_fadvise(logfile.fd, 0, committed, POSIX_FADV_SEQUENTIAL);
+    int rc = 0;
+    off_t offset = 0;
+    while (rc == 0 && offset < committed)
+    {
+        size_t want = (committed - offset) < (off_t)buf_size ? (size_t)(committed - offset) : buf_size;
+        ssize_t len = pread(logfile.fd, buf, want, offset);
+        if (len <= 0)
+        {
+            if (len == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (len == 0)
+            {
+                errno = EIO;
+            }
+            rc = -1;
+            break;
+        }
+        size_t scanned = 0;
+        while (scanned < (size_t)len)
+        {
+            size_t found = newline_scan(&buf[scanned], len - scanned, positions, INDEX_CHUNK_RECORDS);
+            if (found == 0)
+            {
+                break;
+            }
+            if (index_reserve_locked(found) != 0)
+            {
+                rc = -1;
+                break;
+            }
+            for (size_t i = 0; i < found; i++)
+            {
+                index_add_locked(i, offset + scanned + positions[i] + 1);
+            }
+            index_publish_locked(found);
+            scanned += positions[found - 1] + 1;
+        }
+        // a record split over two reads is picked up by the next one
+        offset += (scanned > 0) ? (off_t)scanned : len;
+    }
+    unsigned long count = atomic_load_explicit(&record_index.count, memory_order_relaxed);
+    if (rc == 0 && committed > 0 && (count == 0 || index_end(count - 1) != committed))
+    {
+        rc = index_reserve_locked(1);
+        if (rc == 0)
+        {
+            index_add_locked(0, committed);
+            index_publish_locked(1);
+        }
+    }
+    free(buf);
+    free(positions);
+    return rc;
+}
+
+/**
+ * Serves the log from the open @param fd at @param path, whose first @param committed
+ * bytes are complete records.
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int log_start(int fd, const char *path, off_t committed)
+{
+    logfile.fd = fd;
+    logfile.path = path;
+    logfile.sealed = 0;
+    logfile.bounded = 0;
+    index_clear();
+    if (committed > 0)
+    {
+        // kept out of the lock metrics, which are about appends
+        pthread_mutex_lock(&logfile.mutex);
+        int rc = index_rebuild_locked(committed);
+        pthread_mutex_unlock(&logfile.mutex);
+        if (rc != 0)
+        {
+            return -1;
+        }
+    }
+    atomic_store_explicit(&logfile.committed, committed, memory_order_release);
+    if (watch.wake_fd == -1 && (watch.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int append_log_open(const char *path)
+{
+    int fd = open(path, O_RDWR | O_TRUNC | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    return log_start(fd, path, 0);
+}
+
+/**
+ * @return the length of the first @param size bytes of @param fd up to and including
+ * their last newline, 0 when there is none, or -1 on failure with errno set
+ */
+static off_t last_newline_end(int fd, off_t size)
+{
+    char buf[4096];
+    off_t end = size;
+    while (end > 0)
+    {
+        size_t want = end < (off_t)sizeof(buf) ? (size_t)end : sizeof(buf);
+        ssize_t len = pread(fd, buf, want, end - want);
+        if (len == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len != (ssize_t)want)
+        {
+            if (len >= 0)
+            {
+                errno = EIO;
+            }
+            return -1;
+        }
+        char *newline = memrchr(buf, '\n', want);
+        if (newline != NULL)
+        {
+            return end - want + (newline - buf) + 1;
+        }
+        end -= want;
+    }
+    return 0;
+}
+
+int append_log_recover(const char *path, off_t *torn)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    off_t committed = -1;
+    if (fstat(fd, &st) != 0 || (committed = last_newline_end(fd, st.st_size)) == -1 ||
+        (committed < st.st_size && ftruncate(fd, committed) != 0))
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    *torn = st.st_size - committed;
+    return log_start(fd, path, committed);
+}
+
+int append_log_adopt(int fd, const char *path, off_t committed)
+{
+    return log_start(fd, path, committed);
+}
+
+int append_log_open_bounded(unsigned long max_records, size_t max_bytes)
+{
+    if (bounded_history_init(max_records, max_bytes) != 0 || log_start(-1, NULL, 0) != 0)
+    {
+        return -1;
+    }
+    logfile.bounded = 1;
+    return 0;
+}
+
+/**
+ * Preallocates and maps the file up to at least @param end.  Caller holds
+ * logfile.mutex.
+ * @return 0 on success, -1 with errno set, ENOSPC when the disk is full, which is
+ * found out here rather than by an append faulting on a page that has no block
+ */
+static int map_extend_locked(off_t end)
+{
+    while (mapping.mapped < end)
+    {
+        if ((size_t)mapping.mapped + mapping.chunk > MAP_RESERVE)
+        {
+            errno = EFBIG;
+            return -1;
+        }
+        if (fallocate(logfile.fd, 0, mapping.mapped, mapping.chunk) != 0)
+        {
+            struct stat st;
+            if (errno != EOPNOTSUPP || fstat(logfile.fd, &st) != 0)
+            {
+                return -1;
+            }
+            // without preallocation at least make the whole chunk part of the file
+            if (st.st_size < mapping.mapped + (off_t)mapping.chunk &&
+                ftruncate(logfile.fd, mapping.mapped + mapping.chunk) != 0)
+            {
+                return -1;
+            }
+        }
+        if (mmap(mapping.base + mapping.mapped, mapping.chunk, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 logfile.fd, mapping.mapped) == MAP_FAILED)
+        {
+            return -1;
+        }
+        mapping.mapped += mapping.chunk;
+    }
+    return 0;
+}
+
+/**
+ * Unmaps the log, first cutting the file back to the committed length unless it is
+ * about to be removed anyway, or was sealed, which did so already and may have
+ * handed it to another server appending to it since.
+ */
+static void map_release(int remove_file)
+{
+    pthread_mutex_lock(&logfile.mutex);
+    if (!remove_file && !logfile.sealed && ftruncate(logfile.fd, atomic_load(&logfile.committed)) != 0)
+    {
+        // a warm start still cuts the preallocated tail off as a torn record
+        syslog(LOG_ERR, "Could not cut the data file back to its committed length: %s", strerror(errno));
+    }
+    munmap(mapping.base, MAP_RESERVE);
+    mapping.base = NULL;
+    mapping.mapped = 0;
+    pthread_mutex_unlock(&logfile.mutex);
+}
+
+int append_log_map(size_t chunk)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (chunk == 0 || chunk % page_size != 0 || chunk > MAP_RESERVE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    void *base = mmap(NULL, MAP_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&logfile.mutex);
+    mapping.base = base;
+    mapping.chunk = chunk;
+    mapping.mapped = 0;
+    // one chunk past the committed length, so the first append does not have to grow it
+    int rc = map_extend_locked(atomic_load(&logfile.committed) + 1);
+    int err = errno;
+    if (rc != 0)
+    {
+        munmap(base, MAP_RESERVE);
+        mapping.base = NULL;
+        mapping.mapped = 0;
+    }
+    pthread_mutex_unlock(&logfile.mutex);
+    errno = err;
+    return rc;
+}
+
+const char *append_log_mapped(off_t offset)
+{
+    return (mapping.base == NULL) ? NULL : mapping.base + offset;
+}
+
+void append_log_seal(void)
+{
+    // an append holding the mutex finishes first, so the committed length is final after this
+    pthread_mutex_lock(&logfile.mutex);
+    logfile.sealed = 1;
+    if (mapping.base != NULL && ftruncate(logfile.fd, atomic_load(&logfile.committed)) != 0)
+    {
+        syslog(LOG_ERR, "Could not cut the data file back to its committed length: %s", strerror(errno));
+    }
+    pthread_mutex_unlock(&logfile.mutex);
+}
+
+void append_log_close(int remove_file)
+{
+    if (durability.running)
+    {
+        pthread_cancel(durability.thread);
+        pthread_join(durability.thread, NULL);
+        durability.running = 0;
+    }
+
+    if (group_commit.running)
+    {
+        pthread_cancel(group_commit.thread);
+        pthread_join(group_commit.thread, NULL);
+        group_commit.running = 0;
+    }
+
+    if (logfile.bounded)
+    {
+        bounded_history_free();
+        logfile.bounded = 0;
+    }
+    else if (logfile.fd < 0)
+    {
+        return;
+    }
+    if (mapping.base != NULL)
+    {
+        map_release(remove_file);
+    }
+    if (logfile.fd >= 0)
+    {
+        close(logfile.fd);
+    }
+    logfile.fd = -1;
+    index_clear();
+    if (watch.wake_fd != -1)
+    {
+        close(watch.wake_fd);
+        watch.wake_fd = -1;
+    }
+    if (remove_file && logfile.path != NULL)
+    {
+        remove(logfile.path);
+    }
+}
+
+/**
+ * Takes logfile.mutex, recording the wait in the lock metrics.
+ * @param locked set to the time the mutex was acquired, for log_unlock()
+ * @return 0 on success, an error number on failure
+ */
+static int log_lock(uint64_t *locked)
+{
+    uint64_t start = metrics_now_ns();
+    int rc = pthread_mutex_lock(&logfile.mutex);
+    *locked = metrics_now_ns();
+    metrics_observe(HIST_LOCK_WAIT, *locked - start);
+    return rc;
+}
+
+static void log_unlock(uint64_t locked)
+{
+    metrics_observe(HIST_LOCK_HOLD, metrics_now_ns() - locked);
+    pthread_mutex_unlock(&logfile.mutex);
+}
+
+/**
+ * Wakes the subscribers after an append.  Called without logfile.mutex, so however
+ * many subscribers there are they cost the appenders nothing but this.
+ */
+static void log_notify(void)
+{
+    // the committed length was published before, and a new watcher reads it after registering
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&watch.watchers) == 0)
+    {
+        return;
+    }
+    wake_fd_signal(watch.wake_fd);
+}
+
+/**
+ * Writes the @param iovcnt records of @param iov, @param total bytes, at the committed
+ * length and publishes the new length along with the records' index entries.  Caller
+ * holds logfile.mutex.  iov is used as scratch space.
+ * @return the new committed length, or -1 with nothing committed
+ */
+static off_t log_write_locked(struct iovec *iov, int iovcnt, size_t total)
+{
+    if (logfile.sealed)
+    {
+        errno = EROFS;
+        return -1;
+    }
+    off_t offset = atomic_load_explicit(&logfile.committed, memory_order_relaxed);
+    if (logfile.bounded)
+    {
+        if (bounded_history_add(iov, iovcnt, offset) != 0)
+        {
+            return -1;
+        }
+        offset += total;
+        atomic_store_explicit(&logfile.committed, offset, memory_order_release);
+        return offset;
+    }
+    int records = iovcnt;
+    if (index_reserve_locked(records) != 0)
+    {
+        return -1;
+    }
+    off_t record_end = offset;
+    for (int i = 0; i < records; i++)
+    {
+        record_end += iov[i].iov_len;
+        index_add_locked(i, record_end);
+    }
+
+    size_t done = 0;
+    if (mapping.base != NULL)
+    {
+        if (map_extend_locked(offset + total) != 0)
+        {
+            return -1;
+        }
+        for (int i = 0; i < iovcnt; i++)
+        {
+            memcpy(mapping.base + offset + done, iov[i].iov_base, iov[i].iov_len);
+            done += iov[i].iov_len;
+        }
+    }
+    while (done < total)
+    {
+        ssize_t written = pwritev(logfile.fd, iov, iovcnt, offset + done);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // drop any partial record so the next append starts at the committed length
+            int err = errno;
+            if (ftruncate(logfile.fd, offset) == -1)
+            {
+                err = errno;
+            }
+            errno = err;
+            return -1;
+        }
+        done += written;
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    offset += total;
+    atomic_store_explicit(&logfile.committed, offset, memory_order_release);
+    index_publish_locked(records);
+    return offset;
+}
+
+/**
+ * Commits up to IOV_MAX requests of @param batch with a single pwritev(), then wakes
+ * their submitters.
+ * @return the first request not handled
+ */
+static struct append_request *group_commit_batch(struct append_request *batch)
+{
+    struct iovec iov[IOV_MAX];
+    struct append_request *req = batch;
+    int iovcnt = 0;
+    size_t total = 0;
+    for (; req != NULL && iovcnt < IOV_MAX; req = req->next, iovcnt++)
+    {
+        iov[iovcnt].iov_base = (void *)req->buf;
+        iov[iovcnt].iov_len = req->len;
+        total += req->len;
+    }
+    struct append_request *rest = req;
+
+    uint64_t locked;
+    log_lock(&locked);
+    off_t end = log_write_locked(iov, iovcnt, total);
+    int err = errno;
+    log_unlock(locked);
+    if (end != -1)
+    {
+        log_notify();
+    }
+
+    // the whole batch shares one sync before anybody replies
+    if (end != -1 && durability.mode == DURABILITY_SYNC && log_sync_to(end) != 0)
+    {
+        err = errno;
+        end = -1;
+    }
+
+    // hand every submitter the committed length right after its own record
+    off_t record_end = end - total;
+    pthread_mutex_lock(&group_commit.mutex);
+    for (req = batch; req != rest;)
+    {
+        struct append_request *next = req->next;
+        record_end += req->len;
+        req->end = (end == -1) ? -1 : record_end;
+        req->err = err;
+        req->done = 1;
+        req = next;
+    }
+    pthread_cond_broadcast(&group_commit.committed);
+    pthread_mutex_unlock(&group_commit.mutex);
+    return rest;
+}
+
+static void *group_commit_thread(void *arg)
+{
+    while (1)
+    {
+        while (sem_wait(&group_commit.wakeup) == -1 && errno == EINTR)
+        {
+        }
+
+        // submitters wait on their requests uncancellably, so every batch taken is finished
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        struct append_request *stack = atomic_exchange_explicit(&group_commit.pending, NULL, memory_order_acquire);
+
+        // the stack is newest first, commit in submission order
+        struct append_request *batch = NULL;
+        while (stack != NULL)
+        {
+            struct append_request *next = stack->next;
+            stack->next = batch;
+            batch = stack;
+            stack = next;
+        }
+
+        while (batch != NULL)
+        {
+            batch = group_commit_batch(batch);
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+    return NULL;
+}
+
+int append_log_start_group_commit(void)
+{
+    atomic_store(&group_commit.pending, NULL);
+    if (sem_init(&group_commit.wakeup, 0, 0) != 0)
+    {
+        return -1;
+    }
+    // signals are left to the server's own threads
+    sigset_t mask, oldmask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+    int rc = pthread_create(&group_commit.thread, NULL, group_commit_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    if (rc != 0)
+    {
+        errno = rc;
+        return -1;
+    }
+    group_commit.running = 1;
+    return 0;
+}
+
+static off_t group_commit_append(const char *buf, size_t len)
+{
+    struct append_request req = {
+        .buf = buf,
+        .len = len,
+        .done = 0,
+    };
+
+    struct append_request *head = atomic_load_explicit(&group_commit.pending, memory_order_relaxed);
+    do
+    {
+        req.next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&group_commit.pending, &head, &req, memory_order_release,
+                                                    memory_order_relaxed));
+    if (head == NULL)
+    {
+        // only the first submitter into an empty queue needs to wake the appender
+        sem_post(&group_commit.wakeup);
+    }
+
+    pthread_mutex_lock(&group_commit.mutex);
+    while (!req.done)
+    {
+        pthread_cond_wait(&group_commit.committed, &group_commit.mutex);
+    }
+    pthread_mutex_unlock(&group_commit.mutex);
+
+    if (req.end == -1)
+    {
+        errno = req.err;
+    }
+    return req.end;
+}
+
+off_t append_log_append(const char *buf, size_t len)
+{
+    if (group_commit.running)
+    {
+        return group_commit_append(buf, len);
+    }
+
+    uint64_t locked;
+    if (log_lock(&locked) != 0)
+    {
+        return -1;
+    }
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+    off_t end = log_write_locked(&iov, 1, len);
+    int err = errno;
+    log_unlock(locked);
+    if (end != -1)
+    {
+        log_notify();
+    }
+    errno = err;
+
+    if (end != -1 && durability.mode == DURABILITY_SYNC && log_sync_to(end) != 0)
+    {
+        return -1;
+    }
+    return end;
+}
+
+/**
+ * Copies the first @param len bytes of @param src_fd to the committed length and
+ * publishes the new length.  Caller holds logfile.mutex.
+ * @return the new committed length, or -1 with nothing committed
+ */
+static off_t log_copy_locked(int src_fd, off_t len)
+{
+    if (logfile.sealed)
+    {
+        errno = EROFS;
+        return -1;
+    }
+    off_t offset = atomic_load_explicit(&logfile.committed, memory_order_relaxed);
+    if (logfile.bounded)
+    {
+        if (bounded_history_add_file(src_fd, len, offset) != 0)
+        {
+            return -1;
+        }
+        offset += len;
+        atomic_store_explicit(&logfile.committed, offset, memory_order_release);
+        return offset;
+    }
+    if (index_reserve_locked(1) != 0)
+    {
+        return -1;
+    }
+    index_add_locked(0, offset + len);
+    off_t src_offset = 0;
+    off_t dst_offset = offset;
+    int use_sendfile = 0;
+    if (mapping.base != NULL)
+    {
+        if (map_extend_locked(offset + len) != 0)
+        {
+            return -1;
+        }
+        while (src_offset < len)
+        {
+            ssize_t copied = pread(src_fd, mapping.base + offset + src_offset, len - src_offset, src_offset);
+            if (copied == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (copied <= 0)
+            {
+                if (copied == 0)
+                {
+                    errno = EIO;
+                }
+                return -1;
+            }
+            src_offset += copied;
+        }
+    }
+    while (src_offset < len)
+    {
+        ssize_t copied;
+        if (!use_sendfile)
+        {
+            copied = copy_file_range(src_fd, &src_offset, logfile.fd, &dst_offset, len - src_offset, 0);
+            if (copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                // no in-kernel copy between these files, sendfile() still avoids userspace
+                use_sendfile = 1;
+                continue;
+            }
+        }
+        else
+        {
+            copied = -1;
+            if (lseek(logfile.fd, dst_offset, SEEK_SET) != -1)
+            {
+                copied = sendfile(logfile.fd, src_fd, &src_offset, len - src_offset);
+                if (copied > 0)
+                {
+                    dst_offset += copied;
+                }
+            }
+        }
+        if (copied == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (copied == 0)
+        {
+            errno = EIO;
+        }
+        if (copied <= 0)
+        {
+            int err = errno;
+            if (ftruncate(logfile.fd, offset) == -1)
+            {
+                err = errno;
+            }
+            errno = err;
+            return -1;
+        }
+    }
+    offset += len;
+    atomic_store_explicit(&logfile.committed, offset, memory_order_release);
+    index_publish_locked(1);
+    return offset;
+}
+
+off_t append_log_append_file(int src_fd, off_t len)
+{
+    // bypasses the group commit queue, the mutex still orders it with every batch
+    uint64_t locked;
+    if (log_lock(&locked) != 0)
+    {
+        return -1;
+    }
+    off_t end = log_copy_locked(src_fd, len);
+    int err = errno;
+    log_unlock(locked);
+    if (end != -1)
+    {
+        log_notify();
+    }
+    errno = err;
+
+    if (end != -1 && durability.mode == DURABILITY_SYNC && log_sync_to(end) != 0)
+    {
+        return -1;
+    }
+    return end;
+}
+
+int append_log_set_durability(durability_t mode, int period_ms)
+{
+    durability.mode = mode;
+    durability.period_ms = period_ms;
+    if (mode != DURABILITY_PERIODIC)
+    {
+        return 0;
+    }
+
+    sigset_t mask, oldmask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+    int rc = pthread_create(&durability.thread, NULL, periodic_sync_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    if (rc != 0)
+    {
+        errno = rc;
+        return -1;
+    }
+    durability.running = 1;
+    return 0;
+}
+
+off_t append_log_committed(void)
+{
+    return atomic_load_explicit(&logfile.committed, memory_order_acquire);
+}
+
+unsigned long append_log_records(void)
+{
+    if (logfile.bounded)
+    {
+        return bounded_history_records();
+    }
+    return atomic_load_explicit(&record_index.count, memory_order_acquire);
+}
+
+int append_log_record(unsigned long record, off_t *start, off_t *end)
+{
+    if (logfile.bounded)
+    {
+        return bounded_history_record(record, start, end);
+    }
+    if (record >= append_log_records())
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    *start = (record == 0) ? 0 : index_end(record - 1);
+    *end = index_end(record);
+    return 0;
+}
+
+void append_log_watch(void)
+{
+    atomic_fetch_add(&watch.watchers, 1);
+}
+
+void append_log_unwatch(void)
+{
+    atomic_fetch_sub(&watch.watchers, 1);
+}
+
+int append_log_watch_fd(void)
+{
+    return watch.wake_fd;
+}
+
+int append_log_fd(void)
+{
+    return logfile.fd;
+}
+
+/**
+ * append_log_send() from the mapping, with no file lookup or page cache walk per call.
+ */
+static int log_send_mapped(int sock_fd, off_t *offset, off_t end)
+{
+    while (*offset < end)
+    {
+        ssize_t sent = send(sock_fd, mapping.base + *offset, end - *offset, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        *offset += sent;
+        metrics_add(METRIC_MAPPED_BYTES, sent);
+    }
+    return 1;
+}
+
+int append_log_send(int sock_fd, off_t *offset, off_t end)
+{
+    if (logfile.bounded)
+    {
+        return bounded_history_send(sock_fd, offset, end);
+    }
+    if (mapping.base != NULL)
+    {
+        return log_send_mapped(sock_fd, offset, end);
+    }
+    while (*offset < end)
+    {
+        // sendfile with an explicit offset leaves the shared file position alone
+        ssize_t socksent = sendfile(sock_fd, logfile.fd, offset, end - *offset);
+        if (socksent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (socksent == 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+        metrics_add(METRIC_SENDFILE_BYTES, socksent);
+    }
+    return 1;
+}
+
+ssize_t append_log_read(off_t *offset, off_t end, char *buf, size_t len)
+{
+    if (logfile.bounded)
+    {
+        return bounded_history_read(offset, end, buf, len);
+    }
+    if (*offset >= end)
+    {
+        return 0;
+    }
+    // a mapped log's stores are in the page cache, so pread() sees them as well
+    ssize_t copied;
+    while ((copied = pread(logfile.fd, buf, (end - *offset < (off_t)len) ? (size_t)(end - *offset) : len, *offset)) ==
+               -1 &&
+           errno == EINTR)
+    {
+    }
+    return copied;
+}
@@ -0,0 +1,185 @@
+/**
+ * @file append-log.h
+ * @brief Append-only data file shared by every aesdsocket connection
+ *
+ * Appends are serialized by a short critical section which publishes the new
+ * committed length.  Since bytes below the committed length never change,
+ * replies read a [offset, committed) snapshot without taking any lock.
+ *
+ * Every append is one record, and the critical section also publishes the end
+ * offset of each new record to an index, so any record is found in O(1) without
+ * reading the file.
+ *
+ * With append_log_map() the file is kept in a shared memory mapping instead, so an
+ * append is a memcpy() and replies are sent straight from the mapped pages.
+ *
+ * With append_log_open_bounded() there is no file at all, only the most recent
+ * records kept in memory, see bounded-history.h.
+ */
+
+#ifndef APPEND_LOG_H
+#define APPEND_LOG_H
+
+#include <sys/types.h>
+
+typedef enum
+{
+    /**
+     * Leave write back to the kernel
+     */
+    DURABILITY_NONE,
+    /**
+     * fdatasync() from a background thread every period_ms
+     */
+    DURABILITY_PERIODIC,
+    /**
+     * Records are on disk before append_log_append() returns, so before any reply.
+     * Concurrent appends share one fdatasync().
+     */
+    DURABILITY_SYNC,
+} durability_t;
+
+/**
+ * Creates (or truncates) the log at @param path.
+ * @return 0 on success, -1 on failure with errno set
+ */
+int append_log_open(const char *path);
+
+/**
+ * Opens the log at @param path like append_log_open(), but keeps what an earlier run
+ * left there.  A torn last record, missing its newline, is cut off, and the record
+ * index is rebuilt by scanning the file for newlines.
+ * @param torn receives the number of bytes cut off
+ * @return 0 on success, -1 on failure with errno set
+ */
+int append_log_recover(const char *path, off_t *torn);
+
+/**
+ * Takes over the log at @param path, already open at @param fd, whose first
+ * @param committed bytes hold complete records, such as one handed over by a previous
+ * server.  The record index is rebuilt from the newlines ending the records.
+ * @return 0 on success, -1 on failure with errno set
+ */
+int append_log_adopt(int fd, const char *path, off_t committed);
+
+/**
+ * Opens a log kept in memory, holding only the most recent @param max_records records
+ * and @param max_bytes bytes, either 0 for no limit of its own, instead of a file.
+ * Offsets and the committed length still count every byte ever appended, while record
+ * numbers count from the oldest record kept.  append_log_fd() is then -1.
+ * @return 0 on success, -1 on failure with errno set
+ */
+int append_log_open_bounded(unsigned long max_records, size_t max_bytes);
+
+/**
+ * Fails every append from now on with EROFS, waiting for one in progress, so the
+ * committed length is final once this returns.
+ */
+void append_log_seal(void);
+
+/**
+ * Serves the open log from a memory mapping from now on.  The file is preallocated
+ * and mapped @param chunk bytes at a time, a multiple of the page size, ahead of the
+ * appends, within an address range reserved up front so the mapping never moves under
+ * lock-free readers.  While mapped the file may extend past the committed length
+ * with zeros, which append_log_seal() and append_log_close() cut off again.
+ * @return 0 on success, -1 on failure with errno set
+ */
+int append_log_map(size_t chunk);
+
+/**
+ * @return a pointer to the committed byte at @param offset in the log's mapping, or
+ * NULL when the log is not mapped
+ */
+const char *append_log_mapped(off_t offset);
+
+/**
+ * Closes the log, removing the file when @param remove_file is set.
+ */
+void append_log_close(int remove_file);
+
+/**
+ * Starts the group commit thread.  From then on append_log_append() queues records on
+ * a lock-free submission stack, and the thread writes everything pending with one
+ * pwritev() before waking the submitters with their committed lengths.
+ * @return 0 on success, -1 on failure with errno set
+ */
+int append_log_start_group_commit(void);
+
+/**
+ * Selects how appended records are made durable, starting the periodic sync thread
+ * for DURABILITY_PERIODIC.
+ * @return 0 on success, -1 on failure with errno set
+ */
+int append_log_set_durability(durability_t mode, int period_ms);
+
+/**
+ * Appends @param len bytes of @param buf as one record.  Callers disable cancellation
+ * around it: a submitter cancelled while waiting for the group commit thread or a sync
+ * would die holding their mutex, with its request still queued on its stack.
+ * @return the committed length right after this record, or -1 on failure
+ */
+off_t append_log_append(const char *buf, size_t len);
+
+/**
+ * Appends the first @param len bytes of the file @param src_fd as one record, copied
+ * inside the kernel.  Callers disable cancellation around it, see append_log_append().
+ * @return the committed length right after this record, or -1 on failure
+ */
+off_t append_log_append_file(int src_fd, off_t len);
+
+/**
+ * @return the current committed length of the log
+ */
+off_t append_log_committed(void);
+
+/**
+ * @return the number of records appended so far, all of them ending at or below
+ * the committed length read afterwards
+ */
+unsigned long append_log_records(void);
+
+/**
+ * Looks up the byte range [*start, *end) of @param record, counted from 0.
+ * @return 0 on success, -1 with errno EINVAL when there is no such record yet
+ */
+int append_log_record(unsigned long record, off_t *start, off_t *end);
+
+/**
+ * Registers a subscriber, so that from now on every append signals
+ * append_log_watch_fd().  Check the committed length after registering, an append
+ * may have finished just before.
+ */
+void append_log_watch(void);
+
+void append_log_unwatch(void);
+
+/**
+ * @return an eventfd written to after each append while any subscriber is registered.
+ * Either read it, or never read it and register it edge-triggered.
+ */
+int append_log_watch_fd(void);
+
+/**
+ * @return the log's file descriptor, for callers queueing their own reads of the
+ * committed range (such as io_uring reads)
+ */
+int append_log_fd(void);
+
+/**
+ * Sends the log range [*offset, end) to @param sock_fd, advancing *offset by the
+ * number of bytes sent.  On a non-blocking socket this stops early when the
+ * socket is full.
+ * @return 1 once *offset reached end, 0 when the socket would block, -1 on error
+ */
+int append_log_send(int sock_fd, off_t *offset, off_t end);
+
+/**
+ * Copies the log range [*offset, end) into @param buf, at most @param len bytes, for
+ * callers that cannot use append_log_send().  A bounded log first moves *offset up to
+ * the oldest byte kept, if it fell out of the history.
+ * @return the number of bytes copied, or -1 on failure with errno set
+ */
+ssize_t append_log_read(off_t *offset, off_t end, char *buf, size_t len);
+
+#endif /* APPEND_LOG_H */
@@ -0,0 +1,380 @@
+/**
+ * @file bounded-history.c
+ * @brief Bounded in-memory history on an aesd_circular_buffer
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include "bounded-history.h"
+
+/**
+ * Records gathered into one sendmsg()
+ */
+#define SEND_BATCH 64
+
+struct history_record
+{
+    /**
+     * One held by the buffer while the record is kept, and one by each reply sending it
+     */
+    atomic_uint refs;
+    off_t start;
+    size_t len;
+    char data[];
+};
+
+static struct
+{
+    /**
+     * Protects everything below.  Only held for lookups and pointer updates, never
+     * while sending.
+     */
+    pthread_mutex_t mutex;
+    struct aesd_circular_buffer buffer;
+    unsigned long count;
+    size_t bytes;
+    unsigned long max_records;
+    size_t max_bytes;
+} history = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct history_record *record_of(const struct aesd_buffer_entry *entry)
+{
+    return (struct history_record *)(entry->buffptr - offsetof(struct history_record, data));
+}
+
+static void record_put(struct history_record *rec)
+{
+    if (atomic_fetch_sub_explicit(&rec->refs, 1, memory_order_acq_rel) == 1)
+    {
+        free(rec);
+    }
+}
+
+/**
+ * @return the buffer position of the @param index th record kept, 0 being the oldest
+ */
+static uint32_t position_of(unsigned long index)
+{
+    return (history.buffer.out_offs + index) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+static void evict_oldest_locked(void)
+{
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_remove_entry(&history.buffer);
+    struct history_record *rec = record_of(entry);
+    history.count--;
+    history.bytes -= rec->len;
+    record_put(rec);
+}
+
+static void add_locked(struct history_record *rec)
+{
+    while (history.count > 0 &&
+           (history.count >= history.max_records || (history.max_bytes > 0 && history.bytes + rec->len > history.max_bytes)))
+    {
+        evict_oldest_locked();
+    }
+    struct aesd_buffer_entry entry = {.buffptr = rec->data, .size = rec->len};
+    aesd_circular_buffer_add_entry(&history.buffer, &entry);
+    history.count++;
+    history.bytes += rec->len;
+}
+
+/**
+ * Finds the record holding log offset *offset, first moving *offset up to the oldest
+ * byte kept if it fell out of the history.  Caller holds history.mutex.
+ * @param cursor carried across calls reading forward, so each costs O(1)
+ * @param in_record receives the offset within the record
+ * @return the index of the record, or history.count when *offset is past the newest
+ */
+static unsigned long locate_locked(off_t *offset, struct aesd_circular_buffer_cursor *cursor, size_t *in_record)
+{
+    if (history.count == 0)
+    {
+        return 0;
+    }
+    off_t oldest = record_of(&history.buffer.entry[history.buffer.out_offs])->start;
+    if (*offset <= oldest)
+    {
+        *offset = oldest;
+        *in_record = 0;
+        return 0;
+    }
+    struct aesd_buffer_entry *entry =
+        aesd_circular_buffer_cursor_find(&history.buffer, cursor, *offset - oldest, in_record);
+    if (entry == NULL)
+    {
+        return history.count;
+    }
+    uint32_t position = entry - history.buffer.entry;
+    return (position + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - history.buffer.out_offs) %
+           AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+int bounded_history_init(unsigned long max_records, size_t max_bytes)
+{
+    if (max_records > BOUNDED_HISTORY_MAX_RECORDS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&history.mutex);
+    aesd_circular_buffer_init(&history.buffer);
+    history.count = 0;
+    history.bytes = 0;
+    history.max_records = (max_records == 0) ? BOUNDED_HISTORY_MAX_RECORDS : max_records;
+    history.max_bytes = max_bytes;
+    pthread_mutex_unlock(&history.mutex);
+    return 0;
+}
+
+void bounded_history_free(void)
+{
+    pthread_mutex_lock(&history.mutex);
+    while (history.count > 0)
+    {
+        evict_oldest_locked();
+    }
+    pthread_mutex_unlock(&history.mutex);
+}
+
+static struct history_record *record_alloc(off_t start, size_t len)
+{
+    struct history_record *rec = malloc(sizeof(*rec) + len);
+    if (rec != NULL)
+    {
+        atomic_init(&rec->refs, 1);
+        rec->start = start;
+        rec->len = len;
+    }
+    return rec;
+}
+
+int bounded_history_add(const struct iovec *iov, int iovcnt, off_t start)
+{
+    struct history_record **recs = malloc(iovcnt * sizeof(*recs));
+    if (recs == NULL)
+    {
+        return -1;
+    }
+    // allocated up front, so a failure adds nothing
+    for (int i = 0; i < iovcnt; i++)
+    {
+        recs[i] = record_alloc(start, iov[i].iov_len);
+        if (recs[i] == NULL)
+        {
+            while (i-- > 0)
+            {
+                free(recs[i]);
+            }
+            free(recs);
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(recs[i]->data, iov[i].iov_base, iov[i].iov_len);
+        start += iov[i].iov_len;
+    }
+
+    pthread_mutex_lock(&history.mutex);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        add_locked(recs[i]);
+    }
+    pthread_mutex_unlock(&history.mutex);
+    free(recs);
+    return 0;
+}
+
+int bounded_history_add_file(int src_fd, off_t len, off_t start)
+{
+    struct history_record *rec = record_alloc(start, len);
+    if (rec == NULL)
+    {
+        return -1;
+    }
+    off_t done = 0;
+    while (done < len)
+    {
+        ssize_t copied = pread(src_fd, rec->data + done, len - done, done);
+        if (copied == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (copied <= 0)
+        {
+            if (copied == 0)
+            {
+                errno = EIO;
+            }
+            free(rec);
+            return -1;
+        }
+        done += copied;
+    }
+
+    pthread_mutex_lock(&history.mutex);
+    add_locked(rec);
+    pthread_mutex_unlock(&history.mutex);
+    return 0;
+}
+
+unsigned long bounded_history_records(void)
+{
+    pthread_mutex_lock(&history.mutex);
+    unsigned long count = history.count;
+    pthread_mutex_unlock(&history.mutex);
+    return count;
+}
+
+int bounded_history_record(unsigned long record, off_t *start, off_t *end)
+{
+    int rc = -1;
+    pthread_mutex_lock(&history.mutex);
+    if (record < history.count)
+    {
+        struct history_record *rec = record_of(&history.buffer.entry[position_of(record)]);
+        *start = rec->start;
+        *end = rec->start + rec->len;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&history.mutex);
+    if (rc != 0)
+    {
+        errno = EINVAL;
+    }
+    return rc;
+}
+
+/**
+ * Takes a reference on each of up to @param max records covering the log range
+ * [*offset, end), pointing @param iov at their bytes.
+ * @return the number of records taken, 0 once *offset reached end
+ */
+static int gather(off_t *offset, off_t end, struct aesd_circular_buffer_cursor *cursor,
+                  struct history_record **recs, struct iovec *iov, int max)
+{
+    int n = 0;
+    size_t in_record = 0;
+    pthread_mutex_lock(&history.mutex);
+    off_t at = *offset;
+    for (unsigned long index = locate_locked(offset, cursor, &in_record); index < history.count && n < max; index++)
+    {
+        if (n == 0)
+        {
+            at = *offset;
+        }
+        if (at >= end)
+        {
+            break;
+        }
+        struct aesd_buffer_entry *entry = &history.buffer.entry[position_of(index)];
+        struct history_record *rec = record_of(entry);
+        size_t len = rec->len - in_record;
+        if ((off_t)len > end - at)
+        {
+            len = end - at;
+        }
+        atomic_fetch_add_explicit(&rec->refs, 1, memory_order_relaxed);
+        // the next batch goes on from the last record of this one
+        aesd_circular_buffer_cursor_set(&history.buffer, cursor, entry);
+        recs[n] = rec;
+        iov[n].iov_base = rec->data + in_record;
+        iov[n].iov_len = len;
+        n++;
+        at += len;
+        in_record = 0;
+    }
+    pthread_mutex_unlock(&history.mutex);
+    return n;
+}
+
+static size_t iov_length(const struct iovec *iov, int n)
+{
+    size_t len = 0;
+    for (int i = 0; i < n; i++)
+    {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+int bounded_history_send(int sock_fd, off_t *offset, off_t end)
+{
+    struct aesd_circular_buffer_cursor cursor;
+    aesd_circular_buffer_cursor_init(&cursor);
+    while (*offset < end)
+    {
+        struct history_record *recs[SEND_BATCH];
+        struct iovec iov[SEND_BATCH];
+        int n = gather(offset, end, &cursor, recs, iov, SEND_BATCH);
+        if (n == 0)
+        {
+            // the whole range was evicted before it could be sent
+            *offset = end;
+            break;
+        }
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n};
+        // without MSG_MORE every batch but the last leaves a small segment for Nagle to hold
+        int more = (*offset + (off_t)iov_length(iov, n) < end) ? MSG_MORE : 0;
+        ssize_t sent = sendmsg(sock_fd, &msg, MSG_NOSIGNAL | more);
+        int err = errno;
+        for (int i = 0; i < n; i++)
+        {
+            record_put(recs[i]);
+        }
+        if (sent == -1)
+        {
+            if (err == EAGAIN || err == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            if (err == EINTR)
+            {
+                continue;
+            }
+            errno = err;
+            return -1;
+        }
+        *offset += sent;
+    }
+    return 1;
+}
+
+size_t bounded_history_read(off_t *offset, off_t end, char *buf, size_t len)
+{
+    size_t copied = 0;
+    size_t in_record = 0;
+    struct aesd_circular_buffer_cursor cursor;
+    aesd_circular_buffer_cursor_init(&cursor);
+    pthread_mutex_lock(&history.mutex);
+    for (unsigned long index = locate_locked(offset, &cursor, &in_record); index < history.count && copied < len; index++)
+    {
+        if (*offset + (off_t)copied >= end)
+        {
+            break;
+        }
+        struct history_record *rec = record_of(&history.buffer.entry[position_of(index)]);
+        size_t chunk = rec->len - in_record;
+        if (chunk > len - copied)
+        {
+            chunk = len - copied;
+        }
+        if ((off_t)chunk > end - *offset - (off_t)copied)
+        {
+            chunk = end - *offset - copied;
+        }
+        memcpy(buf + copied, rec->data + in_record, chunk);
+        copied += chunk;
+        in_record = 0;
+    }
+    pthread_mutex_unlock(&history.mutex);
+    return copied;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file bounded-history.h
+ * @brief The most recent records of the log only, kept in memory
+ *
+ * Records live on an aesd_circular_buffer, one allocation each, and are evicted
+ * in O(1) from its oldest end once the record or byte limit is reached, so memory
+ * and reply size stay constant however long the server runs.  Offsets remain
+ * those of everything ever appended: the history covers [oldest start, committed
+ * length), and an offset that fell out of it reads on from the oldest record kept.
+ *
+ * Records are reference counted.  A reply takes references on the records it is
+ * about to send and drops them once sent, so eviction never waits for a
+ * slow reader and never frees what is being sent.
+ */
+
+#ifndef BOUNDED_HISTORY_H
+#define BOUNDED_HISTORY_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * The most records kept, whatever the limits
+ */
+#define BOUNDED_HISTORY_MAX_RECORDS AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+/**
+ * Starts an empty history keeping at most @param max_records records, 0 for
+ * BOUNDED_HISTORY_MAX_RECORDS, and at most @param max_bytes bytes, 0 for no limit.
+ * @return 0 on success, -1 with errno EINVAL when max_records is too large
+ */
+int bounded_history_init(unsigned long max_records, size_t max_bytes);
+
+/**
+ * Evicts every record, freeing each as soon as no reply holds it.
+ */
+void bounded_history_free(void);
+
+/**
+ * Adds the @param iovcnt records of @param iov, the first one starting at log offset
+ * @param start, evicting the oldest records as the limits require.  The newest record
+ * is always kept, even when larger than max_bytes on its own.
+ * @return 0 on success, -1 with errno set and nothing added
+ */
+int bounded_history_add(const struct iovec *iov, int iovcnt, off_t start);
+
+/**
+ * Adds the first @param len bytes of the file @param src_fd as one record starting at
+ * log offset @param start, like bounded_history_add().
+ * @return 0 on success, -1 with errno set and nothing added
+ */
+int bounded_history_add_file(int src_fd, off_t len, off_t start);
+
+/**
+ * @return the number of records kept
+ */
+unsigned long bounded_history_records(void);
+
+/**
+ * Looks up the log range [*start, *end) of the @param record th record kept, 0 being
+ * the oldest.
+ * @return 0 on success, -1 with errno EINVAL when fewer records are kept
+ */
+int bounded_history_record(unsigned long record, off_t *start, off_t *end);
+
+/**
+ * Sends the log range [*offset, end) to @param sock_fd, gathering up to 64 records
+ * into each sendmsg(), like append_log_send().  *offset first moves up to the oldest byte kept if it fell out
+ * of the history.
+ * @return 1 once *offset reached end, 0 when the socket would block, -1 on error
+ */
+int bounded_history_send(int sock_fd, off_t *offset, off_t end);
+
+/**
+ * Copies the log range [*offset, end) into @param buf, at most @param len bytes.
+ * *offset first moves up to the oldest byte kept if it fell out of the history, and
+ * is otherwise left alone.
+ * @return the number of bytes copied
+ */
+size_t bounded_history_read(off_t *offset, off_t end, char *buf, size_t len);
+
+#endif /* BOUNDED_HISTORY_H */
@@ -0,0 +1,268 @@
+/**
+ * @file handoff.c
+ * @brief Listener and data file hand over between an old and a new server
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "handoff.h"
+#include "wake-fd.h"
+
+#define HANDOFF_MAGIC 0x41455344
+#define HANDOFF_VERSION 1
+
+/**
+ * Seconds a connection to the hand over socket may take to greet
+ */
+#define HANDOFF_GREETING_TIMEOUT 1
+
+struct handoff_greeting
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+/**
+ * Sent along with the hand over socket, the data file and then the listeners
+ */
+struct handoff_message
+{
+    uint32_t magic;
+    uint32_t nlisteners;
+    int64_t committed;
+};
+
+static struct
+{
+    atomic_int draining;
+    int drain_fd;
+} drain = {
+    .drain_fd = -1,
+};
+
+int handoff_init(void)
+{
+    drain.drain_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    return drain.drain_fd == -1 ? -1 : 0;
+}
+
+/**
+ * Fills @param addr with @param path.
+ * @return 0 on success, -1 with errno ENAMETOOLONG when the path does not fit
+ */
+static int handoff_address(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    if (handoff_address(&addr, path) != 0)
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    // only called when connecting found nobody there, so whatever is left is stale
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_receive(const char *path, struct handoff_state *state)
+{
+    struct sockaddr_un addr;
+    if (handoff_address(&addr, path) != 0)
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return (err == ENOENT || err == ECONNREFUSED) ? 0 : -1;
+    }
+
+    struct handoff_greeting greeting = {.magic = HANDOFF_MAGIC, .version = HANDOFF_VERSION};
+    if (send(fd, &greeting, sizeof(greeting), MSG_NOSIGNAL) != sizeof(greeting))
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    struct handoff_message message;
+    struct iovec iov = {.iov_base = &message, .iov_len = sizeof(message)};
+    union
+    {
+        char buf[CMSG_SPACE((HANDOFF_MAX_LISTENERS + 2) * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    // the running server only answers once it has drained
+    ssize_t len;
+    while ((len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL)) == -1 && errno == EINTR)
+    {
+    }
+    int err = errno;
+    close(fd);
+    if (len == -1)
+    {
+        errno = err;
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int fds[HANDOFF_MAX_LISTENERS + 2];
+    memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    if (len != sizeof(message) || (msg.msg_flags & MSG_CTRUNC) || message.magic != HANDOFF_MAGIC ||
+        message.nlisteners < 1 || message.nlisteners > HANDOFF_MAX_LISTENERS || nfds != message.nlisteners + 2)
+    {
+        for (int i = 0; i < nfds; i++)
+        {
+            close(fds[i]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+
+    state->sock_fd = fds[0];
+    state->data_fd = fds[1];
+    state->committed = message.committed;
+    state->nlisteners = message.nlisteners;
+    memcpy(state->listen_fds, &fds[2], message.nlisteners * sizeof(int));
+    return 1;
+}
+
+int handoff_accept(int sock_fd)
+{
+    int fd = accept4(sock_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    // the listeners and the data file only go to another server of the same user
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+    struct timeval tv = {.tv_sec = HANDOFF_GREETING_TIMEOUT, .tv_usec = 0};
+    struct handoff_greeting greeting;
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0 ||
+        (cred.uid != getuid() && cred.uid != 0) ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+        recv(fd, &greeting, sizeof(greeting), MSG_WAITALL) != sizeof(greeting) ||
+        greeting.magic != HANDOFF_MAGIC || greeting.version != HANDOFF_VERSION)
+    {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_send(int conn_fd, const struct handoff_state *state)
+{
+    struct handoff_message message = {
+        .magic = HANDOFF_MAGIC,
+        .nlisteners = state->nlisteners,
+        .committed = state->committed,
+    };
+    struct iovec iov = {.iov_base = &message, .iov_len = sizeof(message)};
+    union
+    {
+        char buf[CMSG_SPACE((HANDOFF_MAX_LISTENERS + 2) * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    int nfds = state->nlisteners + 2;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(nfds * sizeof(int)),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    int fds[HANDOFF_MAX_LISTENERS + 2];
+    fds[0] = state->sock_fd;
+    fds[1] = state->data_fd;
+    memcpy(&fds[2], state->listen_fds, state->nlisteners * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    ssize_t len;
+    while ((len = sendmsg(conn_fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+    {
+    }
+    int err = errno;
+    close(conn_fd);
+    if (len != sizeof(message))
+    {
+        errno = (len == -1) ? err : EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+void handoff_begin_drain(void)
+{
+    atomic_store(&drain.draining, 1);
+    if (drain.drain_fd != -1)
+    {
+        wake_fd_signal(drain.drain_fd);
+    }
+}
+
+int handoff_draining(void)
+{
+    return atomic_load_explicit(&drain.draining, memory_order_relaxed);
+}
+
+int handoff_drain_fd(void)
+{
+    return drain.drain_fd;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file handoff.h
+ * @brief Hot restart, handing the listeners and the data file to a new process
+ *
+ * A server given a hand over path listens on a Unix socket there.  A new server
+ * given the same path connects to it before opening anything.  The running one
+ * then stops accepting, lets its connections finish their current packet and
+ * passes the listening sockets, the open data file and its committed length
+ * over with SCM_RIGHTS before it exits, keeping the file.  The listening
+ * sockets are the same ones, so connections arriving meanwhile wait in their
+ * backlog instead of being refused.
+ *
+ * Accepted connections are not passed on.  Persistent ones (-k) idle between
+ * packets and subscriptions are closed as the drain starts, and those with a
+ * packet in progress after its reply, so their clients see EOF and reconnect to
+ * the new server.
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <sys/types.h>
+
+/**
+ * SCM_RIGHTS carries at most 253 descriptors, two of them the hand over socket
+ * and the data file
+ */
+#define HANDOFF_MAX_LISTENERS 250
+
+struct handoff_state
+{
+    /**
+     * The listening hand over socket, passed on so the next process serves the
+     * following restart on it
+     */
+    int sock_fd;
+    int data_fd;
+    off_t committed;
+    int nlisteners;
+    int listen_fds[HANDOFF_MAX_LISTENERS];
+};
+
+/**
+ * Creates the eventfd returned by handoff_drain_fd().
+ * @return 0 on success, -1 on failure with errno set
+ */
+extern int handoff_init(void);
+
+/**
+ * Listens on a Unix socket at @param path, replacing a stale one left there.
+ * @return the socket, or -1 on failure with errno set
+ */
+extern int handoff_listen(const char *path);
+
+/**
+ * Connects to the server listening at @param path and takes over its listeners and
+ * data file, blocking while it drains.
+ * @return 1 with @param state filled in, 0 when no server listens at path, or -1 on
+ * failure with errno set
+ */
+extern int handoff_receive(const char *path, struct handoff_state *state);
+
+/**
+ * Waits on the hand over socket @param sock_fd for a new server of the same user.
+ * @return the connection to it, or -1 with errno set, EPROTO when whoever connected
+ * was not one
+ */
+extern int handoff_accept(int sock_fd);
+
+/**
+ * Passes @param state to the new server on @param conn_fd, then closes conn_fd.
+ * @return 0 on success, -1 on failure with errno set
+ */
+extern int handoff_send(int conn_fd, const struct handoff_state *state);
+
+/**
+ * Sets the draining flag and signals handoff_drain_fd().
+ */
+extern void handoff_begin_drain(void);
+
+/**
+ * @return 1 once a new server asked for the listeners, after which connections close
+ * as soon as they have no packet in progress
+ */
+extern int handoff_draining(void);
+
+/**
+ * @return an eventfd that becomes readable when draining starts, or -1 without a hand
+ * over path.  It is never read, so register it edge-triggered or poll it.
+ */
+extern int handoff_drain_fd(void);
+
+#endif /* HANDOFF_H */
@@ -0,0 +1,150 @@
+/**
+ * @file line-assembler-bench.c
+ * @brief Microbenchmark of packet reassembly for packets of 1 byte up to 100 MB
+ *
+ * Each packet is fed in recv() sized chunks, once through the line assembler
+ * and once through the previous approach of growing the buffer by BLOCK_SIZE
+ * and searching the new block with strchr().
+ * Usage: line-assembler-bench [max_packet_size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "line-assembler.h"
+
+#define BLOCK_SIZE 4096
+#define RECV_SIZE (64 * 1024)
+#define MIN_BENCH_NS 200000000LL
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static size_t assembler_run(struct line_assembler *la, const char *data, size_t len)
+{
+    size_t packet_len = 0;
+    size_t done = 0;
+    while (1)
+    {
+        if (line_assembler_next(la, &packet_len) != NULL)
+        {
+            return packet_len;
+        }
+        size_t space;
+        char *ptr = line_assembler_reserve(la, BLOCK_SIZE, &space);
+        if (ptr == NULL)
+        {
+            return 0;
+        }
+        size_t count = len - done;
+        count = count < RECV_SIZE ? count : RECV_SIZE;
+        count = count < space ? count : space;
+        memcpy(ptr, &data[done], count);
+        line_assembler_commit(la, count);
+        done += count;
+    }
+}
+
+static size_t legacy_run(const char *data, size_t len)
+{
+    size_t size = BLOCK_SIZE;
+    size_t packet_len = 0;
+    size_t done = 0;
+    char *buffer = malloc(size + 1);
+    while (buffer != NULL)
+    {
+        if (packet_len == size)
+        {
+            size += BLOCK_SIZE;
+            char *rptr = realloc(buffer, size + 1);
+            if (rptr == NULL)
+            {
+                break;
+            }
+            buffer = rptr;
+        }
+        size_t count = len - done;
+        count = count < RECV_SIZE ? count : RECV_SIZE;
+        count = count < size - packet_len ? count : size - packet_len;
+        memcpy(&buffer[packet_len], &data[done], count);
+        buffer[packet_len + count] = 0;
+        char *eop = strchr(&buffer[packet_len], '\n');
+        packet_len += count;
+        done += count;
+        if (eop != NULL)
+        {
+            packet_len = eop - buffer + 1;
+            break;
+        }
+    }
+    free(buffer);
+    return packet_len;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t max_size = 100 * 1024 * 1024;
+    if (argc > 1)
+    {
+        max_size = strtoull(argv[1], NULL, 10);
+    }
+
+    char *data = malloc(max_size);
+    if (data == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    memset(data, 'a', max_size);
+
+    printf("%12s %14s %12s %14s %12s\n", "packet_size", "assembler_ns", "MB/s", "legacy_ns", "MB/s");
+    for (size_t size = 1; size <= max_size; size *= (size < 1024 ? 32 : 10))
+    {
+        data[size - 1] = '\n';
+
+        // persistent connection: one assembler reused for every packet
+        struct line_assembler la;
+        line_assembler_init(&la);
+        long long iterations = 0;
+        long long start = now_ns();
+        long long elapsed;
+        do
+        {
+            if (assembler_run(&la, data, size) != size)
+            {
+                fprintf(stderr, "assembler returned a wrong packet length\n");
+                return 1;
+            }
+            iterations++;
+            elapsed = now_ns() - start;
+        } while (elapsed < MIN_BENCH_NS);
+        line_assembler_free(&la);
+        double asm_ns = (double)elapsed / iterations;
+
+        iterations = 0;
+        start = now_ns();
+        do
+        {
+            if (legacy_run(data, size) != size)
+            {
+                fprintf(stderr, "legacy reassembly returned a wrong packet length\n");
+                return 1;
+            }
+            iterations++;
+            elapsed = now_ns() - start;
+        } while (elapsed < MIN_BENCH_NS);
+        double legacy_ns = (double)elapsed / iterations;
+
+        printf("%12zu %14.0f %12.1f %14.0f %12.1f\n", size, asm_ns, size / asm_ns * 1000.0, legacy_ns,
+               size / legacy_ns * 1000.0);
+        data[size - 1] = 'a';
+    }
+
+    free(data);
+    return 0;
+}
@@ -0,0 +1,149 @@
+/**
+ * @file line-assembler.c
+ * @brief Streaming reassembly of newline terminated packets
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "line-assembler.h"
+#include "newline-scan.h"
+
+void line_assembler_init(struct line_assembler *la)
+{
+    memset(la, 0, sizeof(struct line_assembler));
+}
+
+/**
+ * Charges @param n bytes to @param budget.
+ * @return 0 on success, -1 when that would exceed its limit
+ */
+static int line_budget_charge(struct line_budget *budget, size_t n)
+{
+    size_t used = atomic_load_explicit(&budget->used, memory_order_relaxed);
+    do
+    {
+        if (budget->limit > 0 && used + n > budget->limit)
+        {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&budget->used, &used, used + n, memory_order_relaxed,
+                                                    memory_order_relaxed));
+    return 0;
+}
+
+void line_assembler_free(struct line_assembler *la)
+{
+    struct line_budget *budget = la->budget;
+    if (budget != NULL)
+    {
+        atomic_fetch_sub_explicit(&budget->used, la->size, memory_order_relaxed);
+    }
+    free(la->buffer);
+    line_assembler_init(la);
+    la->budget = budget;
+}
+
+char *line_assembler_reserve(struct line_assembler *la, size_t min_space, size_t *space)
+{
+    size_t pending = la->len - la->start;
+
+    if (pending == 0 && la->size > LINE_ASSEMBLER_TRIM_SIZE)
+    {
+        // don't hold on to the memory of one huge packet for the rest of the connection
+        line_assembler_free(la);
+    }
+
+    if (la->size - la->len < min_space && la->start > 0)
+    {
+        // reclaim the space of packets already taken out
+        memmove(la->buffer, &la->buffer[la->start], pending);
+        for (unsigned int i = la->eol_head; i < la->eol_head + la->eol_count; i++)
+        {
+            la->eol[i] -= la->start;
+        }
+        la->scanned -= la->start;
+        la->len = pending;
+        la->start = 0;
+    }
+
+    if (la->size - la->len < min_space)
+    {
+        size_t new_size = la->size ? la->size : LINE_ASSEMBLER_MIN_SIZE;
+        while (new_size - la->len < min_space)
+        {
+            new_size *= 2;
+        }
+        if (la->budget != NULL && line_budget_charge(la->budget, new_size - la->size) != 0)
+        {
+            errno = ENOBUFS;
+            return NULL;
+        }
+        char *rptr = realloc(la->buffer, new_size);
+        if (rptr == NULL)
+        {
+            if (la->budget != NULL)
+            {
+                atomic_fetch_sub_explicit(&la->budget->used, new_size - la->size, memory_order_relaxed);
+            }
+            errno = ENOMEM;
+            return NULL;
+        }
+        la->buffer = rptr;
+        la->size = new_size;
+    }
+
+    *space = la->size - la->len;
+    return &la->buffer[la->len];
+}
+
+void line_assembler_commit(struct line_assembler *la, size_t count)
+{
+    la->len += count;
+}
+
+const char *line_assembler_next(struct line_assembler *la, size_t *packet_len)
+{
+    if (la->eol_count == 0)
+    {
+        if (la->scanned == la->len)
+        {
+            return NULL;
+        }
+
+        // frame every packet in the new bytes at once, up to the size of the eol list
+        size_t found = newline_scan(&la->buffer[la->scanned], la->len - la->scanned, la->eol, LINE_ASSEMBLER_MAX_EOL);
+        for (size_t i = 0; i < found; i++)
+        {
+            la->eol[i] += la->scanned;
+        }
+        la->eol_head = 0;
+        la->eol_count = found;
+        la->scanned = (found == LINE_ASSEMBLER_MAX_EOL) ? la->eol[found - 1] + 1 : la->len;
+        if (found == 0)
+        {
+            return NULL;
+        }
+    }
+
+    size_t eol = la->eol[la->eol_head++];
+    la->eol_count--;
+    const char *packet = &la->buffer[la->start];
+    *packet_len = eol - la->start + 1;
+    la->start = eol + 1;
+    if (la->start == la->len)
+    {
+        // empty again, so the next receive starts at the front of the buffer
+        la->start = la->len = la->scanned = 0;
+    }
+    return packet;
+}
+
+const char *line_assembler_drain(struct line_assembler *la, size_t *pending_len)
+{
+    const char *pending = &la->buffer[la->start];
+    *pending_len = la->len - la->start;
+    la->start = la->len = la->scanned = 0;
+    la->eol_head = la->eol_count = 0;
+    return pending;
+}
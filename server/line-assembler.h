@@ -0,0 +1,119 @@
+/**
+ * @file line-assembler.h
+ * @brief Reassembles newline terminated packets from a byte stream
+ *
+ * Data is received straight into the assembler's buffer with
+ * line_assembler_reserve()/line_assembler_commit(), and complete packets are
+ * taken out in order with line_assembler_next().  The buffer grows
+ * geometrically, and only bytes that have not been searched before are scanned
+ * for a newline, so reassembling an n byte packet costs O(n) copies and
+ * O(log n) reallocations whatever the receive size.  One newline_scan() pass
+ * frames up to LINE_ASSEMBLER_MAX_EOL pipelined packets.
+ */
+
+#ifndef LINE_ASSEMBLER_H
+#define LINE_ASSEMBLER_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/**
+ * Size of the first allocation, and the size a buffer is trimmed back to once
+ * it is empty and has grown beyond LINE_ASSEMBLER_TRIM_SIZE
+ */
+#define LINE_ASSEMBLER_MIN_SIZE 4096
+#define LINE_ASSEMBLER_TRIM_SIZE (1024 * 1024)
+
+#define LINE_ASSEMBLER_MAX_EOL 64
+
+/**
+ * Byte budget shared by several assemblers, charged for the memory of their buffers
+ */
+struct line_budget
+{
+    _Atomic size_t used;
+    /**
+     * Bytes the buffers may hold together, 0 for no limit
+     */
+    size_t limit;
+};
+
+struct line_assembler
+{
+    /**
+     * Allocated storage, NULL until the first reserve
+     */
+    char *buffer;
+    /**
+     * Number of bytes allocated for buffer
+     */
+    size_t size;
+    /**
+     * Offset of the first byte not yet returned as part of a packet
+     */
+    size_t start;
+    /**
+     * Offset just past the last received byte
+     */
+    size_t len;
+    /**
+     * Bytes in [start, scanned) have been searched, their newlines are listed in eol
+     */
+    size_t scanned;
+    /**
+     * Buffer offsets of the newlines found but not yet returned, from eol[eol_head] on
+     */
+    size_t eol[LINE_ASSEMBLER_MAX_EOL];
+    unsigned int eol_head;
+    unsigned int eol_count;
+    /**
+     * Budget charged for the buffer, NULL for none.  Set after line_assembler_init(),
+     * it is kept across line_assembler_free().
+     */
+    struct line_budget *budget;
+};
+
+extern void line_assembler_init(struct line_assembler *la);
+
+extern void line_assembler_free(struct line_assembler *la);
+
+/**
+ * Makes room for at least @param min_space more bytes of received data.
+ * @param space set to the number of bytes that may be written at the returned location
+ * @return where the next received bytes should be written, or NULL with errno set to
+ * ENOBUFS when the budget is exhausted, or ENOMEM when out of memory.
+ * Pointers returned by line_assembler_next() are invalidated.
+ */
+extern char *line_assembler_reserve(struct line_assembler *la, size_t min_space, size_t *space);
+
+/**
+ * Records that @param count bytes were written at the location returned by the
+ * last line_assembler_reserve().
+ */
+extern void line_assembler_commit(struct line_assembler *la, size_t count);
+
+/**
+ * Takes the next complete packet, including its terminating newline.
+ * @param packet_len set to the packet length when a packet is returned
+ * @return the start of the packet, valid until the next line_assembler_reserve(),
+ * or NULL when no complete packet has been received yet.
+ */
+extern const char *line_assembler_next(struct line_assembler *la, size_t *packet_len);
+
+/**
+ * Takes every received byte not yet returned as part of a packet, leaving the
+ * assembler empty.  Used to hand a partial packet over to another receive path.
+ * @param pending_len set to the number of bytes taken
+ * @return the start of the bytes taken, valid until the next line_assembler_reserve()
+ */
+extern const char *line_assembler_drain(struct line_assembler *la, size_t *pending_len);
+
+/**
+ * @return the number of received bytes not yet returned as part of a packet
+ */
+static inline size_t line_assembler_pending(const struct line_assembler *la)
+{
+    return la->len - la->start;
+}
+
+#endif /* LINE_ASSEMBLER_H */
@@ -0,0 +1,164 @@
+/**
+ * @file log-command.c
+ * @brief Parsing of the seek, read range, subscribe and delta commands
+ *
+ * Seek and read range are resolved to a byte range of the log through its record
+ * index, subscribe and delta only carry the client's offset, see log-command.h.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include "log-command.h"
+#include "append-log.h"
+
+/**
+ * Parses the decimal number at *@param pos, stopping before @param end, and moves
+ * *pos past it.
+ * @return 0 on success, -1 when there are no digits or the number overflows
+ */
+static int parse_number(const char **pos, const char *end, unsigned long *value)
+{
+    const char *p = *pos;
+    unsigned long n = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+        unsigned long digit = *p - '0';
+        if (n > (~0UL - digit) / 10)
+        {
+            return -1;
+        }
+        n = n * 10 + digit;
+    }
+    if (p == *pos)
+    {
+        return -1;
+    }
+    *value = n;
+    *pos = p;
+    return 0;
+}
+
+/**
+ * Parses the "X\n" argument from @param pos to @param end, the end of the packet.
+ * @return 0 on success, -1 when it doesn't match
+ */
+static int parse_single(const char *pos, const char *end, unsigned long *x)
+{
+    if (parse_number(&pos, end, x) != 0 || pos == end || *pos++ != '\n')
+    {
+        return -1;
+    }
+    return pos == end ? 0 : -1;
+}
+
+/**
+ * Parses the "X,Y\n" arguments from @param pos to @param end, the end of the packet.
+ * @return 0 on success, -1 when they don't match
+ */
+static int parse_pair(const char *pos, const char *end, unsigned long *x, unsigned long *y)
+{
+    if (parse_number(&pos, end, x) != 0 || pos == end || *pos++ != ',')
+    {
+        return -1;
+    }
+    if (parse_number(&pos, end, y) != 0 || pos == end || *pos++ != '\n')
+    {
+        return -1;
+    }
+    return pos == end ? 0 : -1;
+}
+
+static int seek_to(unsigned long record, unsigned long byte, off_t *start, off_t *end)
+{
+    off_t record_start, record_end;
+    if (append_log_record(record, &record_start, &record_end) != 0)
+    {
+        return -1;
+    }
+    if (byte >= (unsigned long)(record_end - record_start))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    *start = record_start + byte;
+    *end = append_log_committed();
+    return LOG_COMMAND_RANGE;
+}
+
+static int read_range(unsigned long first, unsigned long count, off_t *start, off_t *end)
+{
+    unsigned long records = append_log_records();
+    if (first > records)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (count > records - first)
+    {
+        count = records - first;
+    }
+    off_t ignored;
+    *start = 0;
+    *end = 0;
+    // a bounded log may evict the records between the count above and these lookups
+    if (first > 0)
+    {
+        if (append_log_record(first - 1, &ignored, start) != 0)
+        {
+            return -1;
+        }
+        *end = *start;
+    }
+    if (count > 0 && append_log_record(first + count - 1, &ignored, end) != 0)
+    {
+        return -1;
+    }
+    return LOG_COMMAND_RANGE;
+}
+
+/**
+ * Looks up the range from @param offset to the end of the log for a command of
+ * @param kind.
+ */
+static int from_offset(unsigned long offset, off_t *start, off_t *end, log_command_t kind)
+{
+    *end = append_log_committed();
+    if (offset > (unsigned long)*end)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    *start = offset;
+    return kind;
+}
+
+int log_command_range(const char *packet, size_t len, off_t *start, off_t *end)
+{
+    const char *packet_end = packet + len;
+    unsigned long x, y;
+    size_t prefix = strlen(LOG_COMMAND_SEEKTO);
+    if (len > prefix && memcmp(packet, LOG_COMMAND_SEEKTO, prefix) == 0 &&
+        parse_pair(packet + prefix, packet_end, &x, &y) == 0)
+    {
+        return seek_to(x, y, start, end);
+    }
+    prefix = strlen(LOG_COMMAND_READRANGE);
+    if (len > prefix && memcmp(packet, LOG_COMMAND_READRANGE, prefix) == 0 &&
+        parse_pair(packet + prefix, packet_end, &x, &y) == 0)
+    {
+        return read_range(x, y, start, end);
+    }
+    prefix = strlen(LOG_COMMAND_SUBSCRIBE);
+    if (len > prefix && memcmp(packet, LOG_COMMAND_SUBSCRIBE, prefix) == 0 &&
+        parse_single(packet + prefix, packet_end, &x) == 0)
+    {
+        return from_offset(x, start, end, LOG_COMMAND_SUBSCRIBE_TO);
+    }
+    prefix = strlen(LOG_COMMAND_DELTA);
+    if (len > prefix && memcmp(packet, LOG_COMMAND_DELTA, prefix) == 0 &&
+        parse_single(packet + prefix, packet_end, &x) == 0)
+    {
+        return from_offset(x, start, end, LOG_COMMAND_DELTA_FROM);
+    }
+    return LOG_COMMAND_NONE;
+}
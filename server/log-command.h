@@ -0,0 +1,52 @@
+/**
+ * @file log-command.h
+ * @brief Control commands answered from the log's record index
+ *
+ * A packet of exactly one of these forms is not appended, the reply is only the
+ * part of the log it selects:
+ *
+ *   AESDCHAR_IOCSEEKTO:X,Y       from byte Y of record X to the end of the log
+ *   AESDCHAR_IOCREADRANGE:X,N    records X to X+N-1, fewer when the log ends sooner
+ *   AESDCHAR_SUBSCRIBE:OFFSET    from byte OFFSET to the end of the log, then every
+ *                                later append as it is committed, until the client
+ *                                closes the connection
+ *   AESDCHAR_DELTA:OFFSET        from byte OFFSET to the end of the log, and from
+ *                                then on the reply to every packet on the connection
+ *                                only holds what was appended since the last reply
+ *
+ * Records are counted from 0 in the order they were appended, timestamps included.
+ * A subscriber or delta client passes the number of bytes it has already seen as
+ * OFFSET, so it can reconnect without missing or repeating a record.  Replies
+ * without AESDCHAR_DELTA stay the whole log, as before.
+ */
+
+#ifndef LOG_COMMAND_H
+#define LOG_COMMAND_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define LOG_COMMAND_SEEKTO "AESDCHAR_IOCSEEKTO:"
+#define LOG_COMMAND_READRANGE "AESDCHAR_IOCREADRANGE:"
+#define LOG_COMMAND_SUBSCRIBE "AESDCHAR_SUBSCRIBE:"
+#define LOG_COMMAND_DELTA "AESDCHAR_DELTA:"
+
+typedef enum
+{
+    LOG_COMMAND_NONE,
+    LOG_COMMAND_RANGE,
+    LOG_COMMAND_SUBSCRIBE_TO,
+    LOG_COMMAND_DELTA_FROM,
+} log_command_t;
+
+/**
+ * Checks whether the @param len bytes of @param packet, newline included, are a
+ * command, and if so looks up the log range [*start, *end) to reply with.  For a
+ * subscription or delta replies that is what the log holds so far.
+ * Neither is touched for a packet that isn't a command.
+ * @return LOG_COMMAND_NONE for a packet to append, the kind of command otherwise, or
+ * -1 with errno EINVAL for a command naming a record or byte the log doesn't have
+ */
+int log_command_range(const char *packet, size_t len, off_t *start, off_t *end);
+
+#endif /* LOG_COMMAND_H */
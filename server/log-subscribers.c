@@ -0,0 +1,255 @@
+/**
+ * @file log-subscribers.c
+ * @brief Subscriber thread of the blocking server modes
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "queue.h"
+#include "log-subscribers.h"
+#include "append-log.h"
+#include "metrics.h"
+#include "admission.h"
+
+#define MAX_EVENTS 64
+#define DISCARD_SIZE 4096
+
+struct subscriber_s
+{
+    struct sockaddr_in client;
+    int conn_fd;
+    /**
+     * Everything below has been sent
+     */
+    off_t offset;
+    TAILQ_ENTRY(subscriber_s)
+    entry;
+};
+
+static struct
+{
+    pthread_t thread;
+    int running;
+    int epoll_fd;
+    /**
+     * Every subscriber, protected by mutex as they are added from handler threads
+     */
+    TAILQ_HEAD(subscriberhead, subscriber_s)
+    list;
+    pthread_mutex_t mutex;
+} subscribers = {
+    .epoll_fd = -1,
+    .list = TAILQ_HEAD_INITIALIZER(subscribers.list),
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Event data of the log's watch fd
+ */
+static char log_appended;
+
+static void subscriber_close(struct subscriber_s *sub)
+{
+    TAILQ_REMOVE(&subscribers.list, sub, entry);
+    // closing the fd also removes it from the epoll set
+    close(sub->conn_fd);
+    free(sub);
+    append_log_unwatch();
+    metrics_add(METRIC_CLOSES, 1);
+    admission_conn_leave();
+}
+
+/**
+ * Sends whatever was committed since the last push, until the socket is full.
+ * Caller holds subscribers.mutex.
+ */
+static void subscriber_push(struct subscriber_s *sub)
+{
+    off_t sent = sub->offset;
+    int rc = append_log_send(sub->conn_fd, &sub->offset, append_log_committed());
+    metrics_add(METRIC_PUSHED_BYTES, sub->offset - sent);
+    if (rc == -1)
+    {
+        syslog(LOG_ERR, "(subscriber %s) sendfile fail: %s", inet_ntoa(sub->client.sin_addr), strerror(errno));
+        subscriber_close(sub);
+    }
+}
+
+/**
+ * Handles the socket events of @param sub.  Caller holds subscribers.mutex.
+ */
+static void subscriber_event(struct subscriber_s *sub, uint32_t events)
+{
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR))
+    {
+        // anything sent after subscribing is discarded, the end of it closes the subscription
+        char discard[DISCARD_SIZE];
+        ssize_t num_rx;
+        while ((num_rx = recv(sub->conn_fd, discard, sizeof(discard), 0)) > 0)
+        {
+        }
+        if (num_rx == 0)
+        {
+            syslog(LOG_INFO, "Closed subscription from %s", inet_ntoa(sub->client.sin_addr));
+            subscriber_close(sub);
+            return;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            syslog(LOG_ERR, "(subscriber %s) Client connection failed: %s", inet_ntoa(sub->client.sin_addr),
+                   strerror(errno));
+            subscriber_close(sub);
+            return;
+        }
+    }
+    if (events & EPOLLOUT)
+    {
+        subscriber_push(sub);
+    }
+}
+
+static void *subscriber_thread(void *arg)
+{
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        int n = epoll_wait(subscribers.epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "Subscriber epoll_wait failed: %s", strerror(errno));
+            return NULL;
+        }
+
+        // sockets are only closed on this thread, so finish the batch even if cancelled meanwhile
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_mutex_lock(&subscribers.mutex);
+        int appended = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == &log_appended)
+            {
+                appended = 1;
+            }
+            else
+            {
+                subscriber_event(events[i].data.ptr, events[i].events);
+            }
+        }
+        if (appended)
+        {
+            // after the socket events, so none of them refers to a subscriber closed here
+            struct subscriber_s *sub, *next;
+            TAILQ_FOREACH_SAFE(sub, &subscribers.list, entry, next)
+            {
+                subscriber_push(sub);
+            }
+        }
+        pthread_mutex_unlock(&subscribers.mutex);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+    return NULL;
+}
+
+int log_subscribers_start(void)
+{
+    subscribers.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (subscribers.epoll_fd == -1)
+    {
+        return -1;
+    }
+    // never read, so each write is an edge
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &log_appended;
+    if (epoll_ctl(subscribers.epoll_fd, EPOLL_CTL_ADD, append_log_watch_fd(), &ev) == -1)
+    {
+        return -1;
+    }
+
+    // signals are left to the server's own threads
+    sigset_t mask, oldmask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+    int rc = pthread_create(&subscribers.thread, NULL, subscriber_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    if (rc != 0)
+    {
+        errno = rc;
+        return -1;
+    }
+    subscribers.running = 1;
+    return 0;
+}
+
+void log_subscribers_stop(void)
+{
+    if (subscribers.running)
+    {
+        pthread_cancel(subscribers.thread);
+        pthread_join(subscribers.thread, NULL);
+        subscribers.running = 0;
+    }
+    struct subscriber_s *sub;
+    while ((sub = TAILQ_FIRST(&subscribers.list)) != NULL)
+    {
+        subscriber_close(sub);
+    }
+    if (subscribers.epoll_fd != -1)
+    {
+        close(subscribers.epoll_fd);
+        subscribers.epoll_fd = -1;
+    }
+}
+
+int log_subscribers_add(int conn_fd, const struct sockaddr_in *client, off_t offset)
+{
+    int flags = fcntl(conn_fd, F_GETFL);
+    if (flags == -1 || fcntl(conn_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        return -1;
+    }
+    struct subscriber_s *sub = malloc(sizeof(struct subscriber_s));
+    if (sub == NULL)
+    {
+        return -1;
+    }
+    sub->client = *client;
+    sub->conn_fd = conn_fd;
+    sub->offset = offset;
+
+    pthread_mutex_lock(&subscribers.mutex);
+    TAILQ_INSERT_TAIL(&subscribers.list, sub, entry);
+    append_log_watch();
+    // a writable socket is reported at once, which sends the backlog from offset
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = sub;
+    int rc = epoll_ctl(subscribers.epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev);
+    if (rc == -1)
+    {
+        int err = errno;
+        TAILQ_REMOVE(&subscribers.list, sub, entry);
+        append_log_unwatch();
+        free(sub);
+        errno = err;
+    }
+    pthread_mutex_unlock(&subscribers.mutex);
+    if (rc == 0)
+    {
+        metrics_add(METRIC_SUBSCRIBES, 1);
+    }
+    return rc;
+}
@@ -0,0 +1,37 @@
+/**
+ * @file log-subscribers.h
+ * @brief Fan-out of appends to subscribers for the blocking server modes
+ *
+ * The thread per connection and pool modes hand every subscribed connection over
+ * to a single thread, which waits on all of their sockets and on the log's watch fd
+ * with epoll and pushes new appends with non-blocking sendfile().  A subscriber
+ * then ties up neither a handler thread nor a pool worker, however long it stays.
+ * The event loop modes push from their own loops instead.
+ */
+
+#ifndef LOG_SUBSCRIBERS_H
+#define LOG_SUBSCRIBERS_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/**
+ * Starts the subscriber thread.  The log must be open.
+ * @return 0 on success, -1 on failure with errno set
+ */
+int log_subscribers_start(void);
+
+/**
+ * Cancels and joins the subscriber thread, closing every subscriber.
+ */
+void log_subscribers_stop(void);
+
+/**
+ * Takes over the connection @param conn_fd from @param client, sending it the log
+ * from @param offset on, then every append as it is committed.  The connection is
+ * closed, and its admission slot given back, once the client closes its side.
+ * @return 0 on success, -1 on failure with errno set and conn_fd still the caller's
+ */
+int log_subscribers_add(int conn_fd, const struct sockaddr_in *client, off_t offset);
+
+#endif /* LOG_SUBSCRIBERS_H */
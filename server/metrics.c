@@ -0,0 +1,450 @@
+/**
+ * @file metrics.c
+ * @brief Per-thread metric shards, aggregated and served on read
+ */
+
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include "metrics.h"
+
+#define METRICS_TEXT_SIZE 32768
+
+struct metrics_shard
+{
+    /**
+     * Only ever written by the owning thread, so updates are a relaxed load and
+     * store, and readers never see a torn value
+     */
+    _Atomic uint64_t counters[METRIC_COUNTERS];
+    _Atomic uint64_t buckets[METRIC_HISTOGRAMS][METRIC_BUCKETS];
+    _Atomic uint64_t sums[METRIC_HISTOGRAMS];
+    /**
+     * Every shard ever created, protected by registry.mutex
+     */
+    struct metrics_shard *next;
+    /**
+     * Shards of exited threads waiting for a new owner, protected by registry.mutex
+     */
+    struct metrics_shard *free_next;
+};
+
+struct metrics_registry_s
+{
+    pthread_mutex_t mutex;
+    struct metrics_shard *all;
+    struct metrics_shard *free;
+    pthread_key_t key;
+    pthread_once_t once;
+    /**
+     * Previous read, for the rates, protected by mutex
+     */
+    uint64_t last_read_ns;
+    uint64_t last_accepts;
+    uint64_t start_ns;
+};
+
+static struct metrics_registry_s registry = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+struct metrics_server_s
+{
+    pthread_t thread;
+    int running;
+    int listen_fd;
+    int signal_fd;
+    const char *path;
+};
+
+static struct metrics_server_s server = {
+    .running = 0,
+    .listen_fd = -1,
+    .signal_fd = -1,
+};
+
+static __thread struct metrics_shard *local_shard;
+
+static const char *counter_names[METRIC_COUNTERS] = {
+    [METRIC_ACCEPTS] = "accepts_total",
+    [METRIC_CLOSES] = "closes_total",
+    [METRIC_PACKETS] = "packets_total",
+    [METRIC_BYTES_IN] = "bytes_in_total",
+    [METRIC_BYTES_OUT] = "bytes_out_total",
+    [METRIC_SENDFILE_BYTES] = "sendfile_bytes_total",
+    [METRIC_MAPPED_BYTES] = "mapped_bytes_total",
+    [METRIC_REJECTS] = "rejects_total",
+    [METRIC_LIMIT_CLOSES] = "limit_closes_total",
+    [METRIC_SUBSCRIBES] = "subscribes_total",
+    [METRIC_PUSHED_BYTES] = "pushed_bytes_total",
+};
+
+static const char *histogram_names[METRIC_HISTOGRAMS] = {
+    [HIST_PACKET_SIZE] = "packet_size_bytes",
+    [HIST_REPLY_LATENCY] = "reply_latency_us",
+    [HIST_LOCK_WAIT] = "logfile_lock_wait_ns",
+    [HIST_LOCK_HOLD] = "logfile_lock_hold_ns",
+};
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void shard_release(void *arg)
+{
+    struct metrics_shard *shard = arg;
+    pthread_mutex_lock(&registry.mutex);
+    shard->free_next = registry.free;
+    registry.free = shard;
+    pthread_mutex_unlock(&registry.mutex);
+}
+
+static void registry_init(void)
+{
+    pthread_key_create(&registry.key, shard_release);
+    registry.start_ns = registry.last_read_ns = metrics_now_ns();
+}
+
+/**
+ * @return the calling thread's shard, or NULL if none could be allocated
+ */
+static struct metrics_shard *shard_get(void)
+{
+    if (local_shard != NULL)
+    {
+        return local_shard;
+    }
+
+    pthread_once(&registry.once, registry_init);
+    pthread_mutex_lock(&registry.mutex);
+    struct metrics_shard *shard = registry.free;
+    if (shard != NULL)
+    {
+        // counts are cumulative, so the new owner simply keeps adding to them
+        registry.free = shard->free_next;
+    }
+    else
+    {
+        shard = calloc(1, sizeof(struct metrics_shard));
+        if (shard != NULL)
+        {
+            shard->next = registry.all;
+            registry.all = shard;
+        }
+    }
+    pthread_mutex_unlock(&registry.mutex);
+
+    if (shard != NULL)
+    {
+        pthread_setspecific(registry.key, shard);
+        local_shard = shard;
+    }
+    return shard;
+}
+
+static inline void shard_add(_Atomic uint64_t *value, uint64_t n)
+{
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void metrics_add(metric_counter_t counter, uint64_t n)
+{
+    struct metrics_shard *shard = shard_get();
+    if (shard != NULL)
+    {
+        shard_add(&shard->counters[counter], n);
+    }
+}
+
+void metrics_observe(metric_histogram_t histogram, uint64_t value)
+{
+    struct metrics_shard *shard = shard_get();
+    if (shard != NULL)
+    {
+        unsigned int bucket = value ? 64 - __builtin_clzll(value) : 0;
+        shard_add(&shard->buckets[histogram][bucket], 1);
+        shard_add(&shard->sums[histogram], value);
+    }
+}
+
+uint64_t metrics_packet_received(size_t len)
+{
+    metrics_add(METRIC_PACKETS, 1);
+    metrics_observe(HIST_PACKET_SIZE, len);
+    return metrics_now_ns();
+}
+
+void metrics_reply_sent(uint64_t len, uint64_t start)
+{
+    metrics_add(METRIC_BYTES_OUT, len);
+    metrics_observe(HIST_REPLY_LATENCY, (metrics_now_ns() - start) / 1000);
+}
+
+/**
+ * Appends printf formatted text at @param *len, never past @param size - 1.
+ */
+static void append_text(char *buf, size_t size, size_t *len, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void append_text(char *buf, size_t size, size_t *len, const char *format, ...)
+{
+    if (*len + 1 >= size)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(&buf[*len], size - *len, format, args);
+    va_end(args);
+    if (n > 0)
+    {
+        *len += ((size_t)n < size - *len) ? (size_t)n : size - *len - 1;
+    }
+}
+
+size_t metrics_format(char *buf, size_t size)
+{
+    uint64_t counters[METRIC_COUNTERS] = {0};
+    static uint64_t buckets[METRIC_HISTOGRAMS][METRIC_BUCKETS];
+    uint64_t sums[METRIC_HISTOGRAMS] = {0};
+    size_t len = 0;
+    if (size == 0)
+    {
+        return 0;
+    }
+    buf[0] = '\0';
+
+    pthread_once(&registry.once, registry_init);
+    pthread_mutex_lock(&registry.mutex);
+    memset(buckets, 0, sizeof(buckets));
+    for (struct metrics_shard *shard = registry.all; shard != NULL; shard = shard->next)
+    {
+        for (int c = 0; c < METRIC_COUNTERS; c++)
+        {
+            counters[c] += atomic_load_explicit(&shard->counters[c], memory_order_relaxed);
+        }
+        for (int h = 0; h < METRIC_HISTOGRAMS; h++)
+        {
+            for (int b = 0; b < METRIC_BUCKETS; b++)
+            {
+                buckets[h][b] += atomic_load_explicit(&shard->buckets[h][b], memory_order_relaxed);
+            }
+            sums[h] += atomic_load_explicit(&shard->sums[h], memory_order_relaxed);
+        }
+    }
+
+    uint64_t now = metrics_now_ns();
+    double interval = (now - registry.last_read_ns) / 1e9;
+    double accept_rate = interval > 0 ? (counters[METRIC_ACCEPTS] - registry.last_accepts) / interval : 0;
+    registry.last_read_ns = now;
+    registry.last_accepts = counters[METRIC_ACCEPTS];
+
+    append_text(buf, size, &len, "uptime_seconds %.3f\n", (now - registry.start_ns) / 1e9);
+    for (int c = 0; c < METRIC_COUNTERS; c++)
+    {
+        append_text(buf, size, &len, "%s %llu\n", counter_names[c], (unsigned long long)counters[c]);
+    }
+    // shards are read one after the other, so a connection may show as closed first
+    uint64_t active = counters[METRIC_ACCEPTS] > counters[METRIC_CLOSES]
+                          ? counters[METRIC_ACCEPTS] - counters[METRIC_CLOSES]
+                          : 0;
+    append_text(buf, size, &len, "connections_active %llu\n", (unsigned long long)active);
+    append_text(buf, size, &len, "accepts_per_second %.3f\n", accept_rate);
+
+    for (int h = 0; h < METRIC_HISTOGRAMS; h++)
+    {
+        int last = METRIC_BUCKETS - 1;
+        while (last > 0 && buckets[h][last] == 0)
+        {
+            last--;
+        }
+        uint64_t cumulative = 0;
+        for (int b = 0; b <= last; b++)
+        {
+            cumulative += buckets[h][b];
+            // bucket b holds values below 2^b, so at most 2^b - 1
+            append_text(buf, size, &len, "%s_bucket{le=\"%llu\"} %llu\n", histogram_names[h],
+                        b == 64 ? ~0ULL : (1ULL << b) - 1, (unsigned long long)cumulative);
+        }
+        append_text(buf, size, &len, "%s_bucket{le=\"+Inf\"} %llu\n", histogram_names[h],
+                    (unsigned long long)cumulative);
+        append_text(buf, size, &len, "%s_sum %llu\n", histogram_names[h], (unsigned long long)sums[h]);
+        append_text(buf, size, &len, "%s_count %llu\n", histogram_names[h], (unsigned long long)cumulative);
+    }
+    pthread_mutex_unlock(&registry.mutex);
+    return len;
+}
+
+static void metrics_dump_syslog(char *text)
+{
+    char *saveptr = NULL;
+    for (char *line = strtok_r(text, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr))
+    {
+        syslog(LOG_INFO, "metrics: %s", line);
+    }
+}
+
+static void metrics_serve(int conn_fd, char *text)
+{
+    size_t len = metrics_format(text, METRICS_TEXT_SIZE);
+    // a reader that stops reading doesn't get to stall the metrics thread
+    struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
+    setsockopt(conn_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(conn_fd, &text[sent], len - sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        sent += n;
+    }
+    close(conn_fd);
+}
+
+static void *metrics_thread(void *arg)
+{
+    static char text[METRICS_TEXT_SIZE];
+    struct pollfd fds[2] = {
+        {.fd = server.signal_fd, .events = POLLIN},
+        {.fd = server.listen_fd, .events = POLLIN},
+    };
+    nfds_t nfds = (server.listen_fd == -1) ? 1 : 2;
+
+    while (1)
+    {
+        if (poll(fds, nfds, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "Metrics poll failed: %s", strerror(errno));
+            return NULL;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(server.signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                metrics_format(text, sizeof(text));
+                metrics_dump_syslog(text);
+            }
+        }
+
+        if (nfds > 1 && (fds[1].revents & POLLIN))
+        {
+            int conn_fd = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn_fd != -1)
+            {
+                metrics_serve(conn_fd, text);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int metrics_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server.listen_fd == -1)
+    {
+        return -1;
+    }
+    // a stale socket from a previous run would make bind fail
+    unlink(path);
+    if (bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(server.listen_fd, 8) != 0)
+    {
+        return -1;
+    }
+    server.path = path;
+    return 0;
+}
+
+int metrics_start(const char *admin_path)
+{
+    pthread_once(&registry.once, registry_init);
+
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    server.signal_fd = signalfd(-1, &usr1, SFD_CLOEXEC);
+    if (server.signal_fd == -1)
+    {
+        return -1;
+    }
+    if (admin_path != NULL && metrics_listen(admin_path) != 0)
+    {
+        return -1;
+    }
+
+    sigset_t mask, oldmask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+    int rc = pthread_create(&server.thread, NULL, metrics_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    if (rc != 0)
+    {
+        errno = rc;
+        return -1;
+    }
+    server.running = 1;
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (server.running)
+    {
+        pthread_cancel(server.thread);
+        pthread_join(server.thread, NULL);
+        server.running = 0;
+    }
+    if (server.listen_fd != -1)
+    {
+        close(server.listen_fd);
+        server.listen_fd = -1;
+        if (server.path != NULL)
+        {
+            unlink(server.path);
+        }
+    }
+    if (server.signal_fd != -1)
+    {
+        close(server.signal_fd);
+        server.signal_fd = -1;
+    }
+}
@@ -0,0 +1,104 @@
+/**
+ * @file metrics.h
+ * @brief Low-overhead server metrics from per-thread counters
+ *
+ * Every thread updates its own shard without atomic read-modify-write
+ * instructions or locks; shards are summed when the metrics are read.  Shards
+ * of exited threads are recycled by new threads, so their counts are never lost
+ * and the number of shards stays bounded by the peak number of threads.
+ *
+ * The metrics are served in the Prometheus text format on an optional Unix
+ * socket, and written to syslog on SIGUSR1.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    METRIC_ACCEPTS,
+    METRIC_CLOSES,
+    METRIC_PACKETS,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_SENDFILE_BYTES,
+    /**
+     * Reply bytes sent straight from the log's memory mapping
+     */
+    METRIC_MAPPED_BYTES,
+    /**
+     * Connections reset at the connection limit, and closed over a packet or memory limit
+     */
+    METRIC_REJECTS,
+    METRIC_LIMIT_CLOSES,
+    /**
+     * Subscriptions started, and the bytes sent to subscribers
+     */
+    METRIC_SUBSCRIBES,
+    METRIC_PUSHED_BYTES,
+    METRIC_COUNTERS,
+} metric_counter_t;
+
+typedef enum
+{
+    HIST_PACKET_SIZE,
+    /**
+     * Microseconds from a complete packet being framed to the end of its reply
+     */
+    HIST_REPLY_LATENCY,
+    /**
+     * Nanoseconds spent waiting for, and holding, the data file mutex
+     */
+    HIST_LOCK_WAIT,
+    HIST_LOCK_HOLD,
+    METRIC_HISTOGRAMS,
+} metric_histogram_t;
+
+/**
+ * Power of two buckets: bucket i counts values below 2^i
+ */
+#define METRIC_BUCKETS 65
+
+extern void metrics_add(metric_counter_t counter, uint64_t n);
+
+extern void metrics_observe(metric_histogram_t histogram, uint64_t value);
+
+/**
+ * @return a monotonic timestamp in nanoseconds for latency measurements
+ */
+extern uint64_t metrics_now_ns(void);
+
+/**
+ * Counts a complete packet of @param len bytes.
+ * @return the start time to pass to metrics_reply_sent()
+ */
+extern uint64_t metrics_packet_received(size_t len);
+
+/**
+ * Counts a reply of @param len bytes to a packet received at @param start.
+ */
+extern void metrics_reply_sent(uint64_t len, uint64_t start);
+
+/**
+ * Sums every shard and formats the result as text into @param buf.
+ * @return the length of the text, truncated to @param size - 1 bytes
+ */
+extern size_t metrics_format(char *buf, size_t size);
+
+/**
+ * Starts the metrics thread, which dumps the metrics to syslog on SIGUSR1 and, when
+ * @param admin_path is not NULL, serves them to every connection on that Unix socket.
+ * SIGUSR1 must already be blocked in every thread.
+ * @return 0 on success, -1 on failure with errno set
+ */
+extern int metrics_start(const char *admin_path);
+
+/**
+ * Cancels and joins the metrics thread and removes the admin socket.
+ */
+extern void metrics_stop(void);
+
+#endif /* METRICS_H */
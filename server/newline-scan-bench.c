@@ -0,0 +1,138 @@
+/**
+ * @file newline-scan-bench.c
+ * @brief Compares the newline_scan() kernels with memchr() and strchr() framing loops
+ *
+ * Every method finds all newlines of the buffer, the kernels 64 positions per
+ * call the way the line assembler uses them.  Buffers either hold a single
+ * newline at the end (one large packet) or one every 64 bytes (many small
+ * pipelined packets).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "newline-scan.h"
+
+#define MAX_POSITIONS 64
+#define MIN_BENCH_NS 100000000LL
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static size_t frame_kernel(const char *buf, size_t len)
+{
+    size_t positions[MAX_POSITIONS];
+    size_t packets = 0;
+    size_t offset = 0;
+    while (offset < len)
+    {
+        size_t found = newline_scan(&buf[offset], len - offset, positions, MAX_POSITIONS);
+        packets += found;
+        if (found < MAX_POSITIONS)
+        {
+            break;
+        }
+        offset += positions[found - 1] + 1;
+    }
+    return packets;
+}
+
+static size_t frame_memchr(const char *buf, size_t len)
+{
+    size_t packets = 0;
+    const char *pos = buf;
+    const char *end = buf + len;
+    while ((pos = memchr(pos, '\n', end - pos)) != NULL)
+    {
+        packets++;
+        pos++;
+    }
+    return packets;
+}
+
+static size_t frame_strchr(const char *buf, size_t len)
+{
+    size_t packets = 0;
+    const char *pos = buf;
+    while ((pos = strchr(pos, '\n')) != NULL)
+    {
+        packets++;
+        pos++;
+    }
+    return packets;
+}
+
+static double bench(size_t (*frame)(const char *, size_t), const char *buf, size_t len, size_t expected)
+{
+    long long iterations = 0;
+    long long start = now_ns();
+    long long elapsed;
+    do
+    {
+        if (frame(buf, len) != expected)
+        {
+            fprintf(stderr, "wrong packet count\n");
+            exit(1);
+        }
+        iterations++;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_BENCH_NS);
+    // bytes per nanosecond is GB/s
+    return (double)len * iterations / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *kernels[] = {"scalar", "sse2", "avx2"};
+    static const size_t sizes[] = {64, 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+    static const size_t spacings[] = {0, 64};
+
+    printf("default kernel: %s\n", newline_scan_selected());
+    printf("%10s %8s %10s %10s %10s %10s %10s   (GB/s)\n", "size", "spacing", "scalar", "sse2", "avx2", "memchr",
+           "strchr");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        size_t len = sizes[s];
+        char *buf = malloc(len + 1);
+        if (buf == NULL)
+        {
+            perror("malloc");
+            return 1;
+        }
+
+        for (size_t d = 0; d < sizeof(spacings) / sizeof(spacings[0]); d++)
+        {
+            size_t expected = 0;
+            for (size_t i = 0; i < len; i++)
+            {
+                int eol = (spacings[d] == 0) ? (i == len - 1) : (i % spacings[d] == spacings[d] - 1);
+                buf[i] = eol ? '\n' : 'a';
+                expected += eol;
+            }
+            buf[len] = '\0';
+
+            printf("%10zu %8zu", len, spacings[d]);
+            for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+            {
+                if (newline_scan_select(kernels[k]) == 0)
+                {
+                    printf(" %10.2f", bench(frame_kernel, buf, len, expected));
+                }
+                else
+                {
+                    printf(" %10s", "n/a");
+                }
+            }
+            printf(" %10.2f", bench(frame_memchr, buf, len, expected));
+            printf(" %10.2f\n", bench(frame_strchr, buf, len, expected));
+        }
+        free(buf);
+    }
+    return 0;
+}
@@ -0,0 +1,289 @@
+/**
+ * @file newline-scan.c
+ * @brief Scalar, SSE2 and AVX2 newline search kernels with runtime dispatch
+ */
+
+#include <string.h>
+#include "newline-scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NEWLINE_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+struct newline_kernel
+{
+    const char *name;
+    size_t (*scan)(const char *buf, size_t len, size_t *positions, size_t max);
+    size_t (*count)(const char *buf, size_t len);
+};
+
+static size_t scan_scalar(const char *buf, size_t len, size_t *positions, size_t max)
+{
+    size_t found = 0;
+    const char *pos = buf;
+    const char *end = buf + len;
+    while (found < max && pos < end)
+    {
+        const char *eol = memchr(pos, '\n', end - pos);
+        if (eol == NULL)
+        {
+            break;
+        }
+        positions[found++] = eol - buf;
+        pos = eol + 1;
+    }
+    return found;
+}
+
+static size_t count_scalar(const char *buf, size_t len)
+{
+    size_t found = 0;
+    const char *pos = buf;
+    const char *end = buf + len;
+    while (pos < end)
+    {
+        const char *eol = memchr(pos, '\n', end - pos);
+        if (eol == NULL)
+        {
+            break;
+        }
+        found++;
+        pos = eol + 1;
+    }
+    return found;
+}
+
+/**
+ * Scans the bytes from @param offset on with the scalar kernel, reporting positions relative to buf.
+ */
+static size_t scan_tail(const char *buf, size_t offset, size_t len, size_t *positions, size_t max)
+{
+    size_t found = scan_scalar(&buf[offset], len - offset, positions, max);
+    for (size_t i = 0; i < found; i++)
+    {
+        positions[i] += offset;
+    }
+    return found;
+}
+
+#ifdef NEWLINE_SCAN_X86
+
+/**
+ * Appends the positions of the bits set in @param mask, a match mask for the vector at @param base.
+ * @return false once max positions are stored
+ */
+static inline int push_mask(unsigned int mask, size_t base, size_t *positions, size_t *found, size_t max)
+{
+    while (mask != 0)
+    {
+        positions[(*found)++] = base + __builtin_ctz(mask);
+        if (*found == max)
+        {
+            return 0;
+        }
+        mask &= mask - 1;
+    }
+    return 1;
+}
+
+__attribute__((target("sse2"))) static size_t scan_sse2(const char *buf, size_t len, size_t *positions, size_t max)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t found = 0;
+    size_t i = 0;
+
+    if (max == 0)
+    {
+        return 0;
+    }
+
+    // 64 bytes per iteration, masks are only extracted when the block holds a newline
+    for (; i + 64 <= len; i += 64)
+    {
+        __m128i c0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&buf[i]), nl);
+        __m128i c1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&buf[i + 16]), nl);
+        __m128i c2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&buf[i + 32]), nl);
+        __m128i c3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&buf[i + 48]), nl);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(c0, c1), _mm_or_si128(c2, c3))) == 0)
+        {
+            continue;
+        }
+        if (!push_mask(_mm_movemask_epi8(c0), i, positions, &found, max) ||
+            !push_mask(_mm_movemask_epi8(c1), i + 16, positions, &found, max) ||
+            !push_mask(_mm_movemask_epi8(c2), i + 32, positions, &found, max) ||
+            !push_mask(_mm_movemask_epi8(c3), i + 48, positions, &found, max))
+        {
+            return found;
+        }
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i c0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&buf[i]), nl);
+        if (!push_mask(_mm_movemask_epi8(c0), i, positions, &found, max))
+        {
+            return found;
+        }
+    }
+    return found + scan_tail(buf, i, len, &positions[found], max - found);
+}
+
+__attribute__((target("sse2"))) static size_t count_sse2(const char *buf, size_t len)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    size_t found = 0;
+    size_t i = 0;
+
+    while (i + 16 <= len)
+    {
+        // per byte lane counters, folded into found before they can overflow
+        __m128i acc = _mm_setzero_si128();
+        for (int n = 0; n < 255 && i + 16 <= len; n++, i += 16)
+        {
+            __m128i block = _mm_loadu_si128((const __m128i *)&buf[i]);
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(block, nl));
+        }
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        found += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+    return found + count_scalar(&buf[i], len - i);
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *buf, size_t len, size_t *positions, size_t max)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t found = 0;
+    size_t i = 0;
+
+    if (max == 0)
+    {
+        return 0;
+    }
+
+    // 128 bytes per iteration, masks are only extracted when the block holds a newline
+    for (; i + 128 <= len; i += 128)
+    {
+        __m256i c0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&buf[i]), nl);
+        __m256i c1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&buf[i + 32]), nl);
+        __m256i c2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&buf[i + 64]), nl);
+        __m256i c3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&buf[i + 96]), nl);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(c0, c1), _mm256_or_si256(c2, c3));
+        if (_mm256_testz_si256(any, any))
+        {
+            continue;
+        }
+        if (!push_mask(_mm256_movemask_epi8(c0), i, positions, &found, max) ||
+            !push_mask(_mm256_movemask_epi8(c1), i + 32, positions, &found, max) ||
+            !push_mask(_mm256_movemask_epi8(c2), i + 64, positions, &found, max) ||
+            !push_mask(_mm256_movemask_epi8(c3), i + 96, positions, &found, max))
+        {
+            return found;
+        }
+    }
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i c0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&buf[i]), nl);
+        if (!push_mask(_mm256_movemask_epi8(c0), i, positions, &found, max))
+        {
+            return found;
+        }
+    }
+    return found + scan_tail(buf, i, len, &positions[found], max - found);
+}
+
+__attribute__((target("avx2"))) static size_t count_avx2(const char *buf, size_t len)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t found = 0;
+    size_t i = 0;
+
+    while (i + 32 <= len)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        for (int n = 0; n < 255 && i + 32 <= len; n++, i += 32)
+        {
+            __m256i block = _mm256_loadu_si256((const __m256i *)&buf[i]);
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(block, nl));
+        }
+        unsigned long long sums[4];
+        _mm256_storeu_si256((__m256i *)sums, _mm256_sad_epu8(acc, zero));
+        found += sums[0] + sums[1] + sums[2] + sums[3];
+    }
+    return found + count_scalar(&buf[i], len - i);
+}
+
+#endif /* NEWLINE_SCAN_X86 */
+
+static const struct newline_kernel kernels[] = {
+#ifdef NEWLINE_SCAN_X86
+    {"avx2", scan_avx2, count_avx2},
+    {"sse2", scan_sse2, count_sse2},
+#endif
+    {"scalar", scan_scalar, count_scalar},
+};
+
+static const struct newline_kernel *active = &kernels[sizeof(kernels) / sizeof(kernels[0]) - 1];
+
+static int kernel_supported(const struct newline_kernel *kernel)
+{
+#ifdef NEWLINE_SCAN_X86
+    if (strcmp(kernel->name, "avx2") == 0)
+    {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (strcmp(kernel->name, "sse2") == 0)
+    {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return 1;
+}
+
+/**
+ * Picks the first supported kernel, the list being ordered from fastest to slowest.
+ * Runs before main() so the hot path never has to check whether dispatch happened.
+ */
+__attribute__((constructor)) static void newline_scan_init(void)
+{
+#ifdef NEWLINE_SCAN_X86
+    __builtin_cpu_init();
+#endif
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if (kernel_supported(&kernels[i]))
+        {
+            active = &kernels[i];
+            return;
+        }
+    }
+}
+
+size_t newline_scan(const char *buf, size_t len, size_t *positions, size_t max)
+{
+    return active->scan(buf, len, positions, max);
+}
+
+size_t newline_count(const char *buf, size_t len)
+{
+    return active->count(buf, len);
+}
+
+int newline_scan_select(const char *name)
+{
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if (strcmp(kernels[i].name, name) == 0 && kernel_supported(&kernels[i]))
+        {
+            active = &kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *newline_scan_selected(void)
+{
+    return active->name;
+}
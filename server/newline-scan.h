@@ -0,0 +1,40 @@
+/**
+ * @file newline-scan.h
+ * @brief Packet delimiter search with SIMD kernels selected at runtime
+ *
+ * On x86 the AVX2 or SSE2 kernel is used when the CPU supports it, with a
+ * memchr() based scalar kernel everywhere else.
+ */
+
+#ifndef NEWLINE_SCAN_H
+#define NEWLINE_SCAN_H
+
+#include <stddef.h>
+
+/**
+ * Finds the positions of the '\n' characters in @param buf of @param len bytes,
+ * in increasing order, stopping once @param max positions have been stored.
+ * @param positions receives the offsets of the newlines relative to buf
+ * @return the number of positions stored.  When this equals max the buffer
+ * may hold more newlines after positions[max - 1].
+ */
+extern size_t newline_scan(const char *buf, size_t len, size_t *positions, size_t max);
+
+/**
+ * @return the number of '\n' characters in @param buf of @param len bytes
+ */
+extern size_t newline_count(const char *buf, size_t len);
+
+/**
+ * Forces the kernel used by newline_scan() and newline_count(), for tests and benchmarks.
+ * @param name one of "scalar", "sse2" or "avx2"
+ * @return 0 on success, -1 if the kernel is unknown or not supported by this CPU
+ */
+extern int newline_scan_select(const char *name);
+
+/**
+ * @return the name of the kernel currently in use
+ */
+extern const char *newline_scan_selected(void);
+
+#endif /* NEWLINE_SCAN_H */
@@ -0,0 +1,191 @@
+/**
+ * @file splice-ingest.c
+ * @brief Socket -> pipe -> spill file packet receive with splice()
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "splice-ingest.h"
+#include "newline-scan.h"
+
+void splice_ingest_init(struct splice_ingest *si)
+{
+    si->pipe_fd[0] = si->pipe_fd[1] = -1;
+    si->spill_fd = -1;
+    si->len = 0;
+    si->window = NULL;
+}
+
+void splice_ingest_free(struct splice_ingest *si)
+{
+    if (si->pipe_fd[0] != -1)
+    {
+        close(si->pipe_fd[0]);
+        close(si->pipe_fd[1]);
+    }
+    if (si->spill_fd != -1)
+    {
+        close(si->spill_fd);
+    }
+    free(si->window);
+    splice_ingest_init(si);
+}
+
+/**
+ * Opens an anonymous spill file in @param dir, next to the data file so the final
+ * copy can stay within one filesystem.
+ * @return the file descriptor, or -1 with errno set
+ */
+static int open_spill_file(const char *dir)
+{
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR))
+    {
+        return fd;
+    }
+
+    // filesystem without O_TMPFILE, unlink a named file right away instead
+    char path[256];
+    if (snprintf(path, sizeof(path), "%s/aesdsocket-spill-XXXXXX", dir) >= (int)sizeof(path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd != -1)
+    {
+        unlink(path);
+    }
+    return fd;
+}
+
+/**
+ * Writes @param len bytes at @param data to the end of the spill file.
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int spill_write(struct splice_ingest *si, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = pwrite(si->spill_fd, data, len, si->len);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        si->len += written;
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+int splice_ingest_begin(struct splice_ingest *si, const char *dir, const char *head, size_t head_len)
+{
+    if (si->spill_fd == -1 && (si->spill_fd = open_spill_file(dir)) == -1)
+    {
+        return -1;
+    }
+
+    si->len = 0;
+    return spill_write(si, head, head_len);
+}
+
+int splice_ingest_append(struct splice_ingest *si, const char *data, size_t len, size_t *consumed)
+{
+    size_t eol;
+    int complete = newline_scan(data, len, &eol, 1) == 1;
+    size_t count = complete ? eol + 1 : len;
+    if (spill_write(si, data, count) != 0)
+    {
+        return -1;
+    }
+    *consumed = count;
+    return complete;
+}
+
+int splice_ingest_recv(struct splice_ingest *si, int sock_fd)
+{
+    // only the splice path needs these, so buffers received by splice_ingest_append() don't pay for them
+    if (si->window == NULL && (si->window = malloc(SPLICE_INGEST_WINDOW)) == NULL)
+    {
+        return -1;
+    }
+    if (si->pipe_fd[0] == -1 && pipe2(si->pipe_fd, O_CLOEXEC) == -1)
+    {
+        si->pipe_fd[0] = si->pipe_fd[1] = -1;
+        return -1;
+    }
+
+    ssize_t peeked;
+    do
+    {
+        peeked = recv(sock_fd, si->window, SPLICE_INGEST_WINDOW, MSG_PEEK);
+    } while (peeked == -1 && errno == EINTR);
+    if (peeked == 0)
+    {
+        errno = ECONNRESET;
+    }
+    if (peeked <= 0)
+    {
+        return -1;
+    }
+
+    size_t eol;
+    int complete = newline_scan(si->window, peeked, &eol, 1) == 1;
+    size_t count = complete ? eol + 1 : (size_t)peeked;
+
+    while (count > 0)
+    {
+        // the bytes were peeked already, so this never waits
+        ssize_t moved = splice(sock_fd, NULL, si->pipe_fd[1], NULL, count, SPLICE_F_MOVE);
+        if (moved == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (moved == 0)
+        {
+            errno = ECONNRESET;
+        }
+        if (moved <= 0)
+        {
+            return -1;
+        }
+        count -= moved;
+
+        while (moved > 0)
+        {
+            ssize_t stored = splice(si->pipe_fd[0], NULL, si->spill_fd, &si->len, moved, SPLICE_F_MOVE);
+            if (stored == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (stored == 0)
+            {
+                errno = EIO;
+            }
+            if (stored <= 0)
+            {
+                return -1;
+            }
+            moved -= stored;
+        }
+    }
+    return complete;
+}
+
+int splice_ingest_reset(struct splice_ingest *si)
+{
+    si->len = 0;
+    // release the blocks so a multi-MB packet doesn't pin disk space for the connection
+    return ftruncate(si->spill_fd, 0);
+}
@@ -0,0 +1,91 @@
+/**
+ * @file splice-ingest.h
+ * @brief Zero-copy receive of large packets into a per-connection spill file
+ *
+ * Once a packet outgrows SPLICE_INGEST_THRESHOLD it stops being buffered in
+ * userspace.  The rest of it moves from the socket through a pipe into an
+ * unlinked spill file with splice(), the end of packet being found in a small
+ * MSG_PEEK window.  Event loops that receive into their own buffers write
+ * them to the spill file with splice_ingest_append() instead.
+ *
+ * The complete packet is then committed to the data file with
+ * append_log_append_file(), which copies it inside the kernel in one step under
+ * the log lock.  Nothing reaches the data file before the newline, so a client
+ * that disconnects mid-packet leaves no trace but the spill file, which is
+ * emptied on the next packet or freed with the connection.  Streaming straight
+ * into the data file instead would hold the log lock, and every other writer,
+ * for as long as the slowest uploader takes.
+ */
+
+#ifndef SPLICE_INGEST_H
+#define SPLICE_INGEST_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Pending bytes without a newline at which a packet switches to the splice path
+ */
+#define SPLICE_INGEST_THRESHOLD (256 * 1024)
+
+/**
+ * Bytes peeked at per splice, the default pipe capacity
+ */
+#define SPLICE_INGEST_WINDOW 65536
+
+struct splice_ingest
+{
+    /**
+     * Pipe carrying socket data into the spill file, -1 until first use
+     */
+    int pipe_fd[2];
+    /**
+     * Unlinked file holding the packet being received, -1 until first use
+     */
+    int spill_fd;
+    /**
+     * Bytes of the current packet in the spill file
+     */
+    off_t len;
+    /**
+     * Peek window used to find the end of packet, NULL until first use
+     */
+    char *window;
+};
+
+extern void splice_ingest_init(struct splice_ingest *si);
+
+extern void splice_ingest_free(struct splice_ingest *si);
+
+/**
+ * Starts a packet in the spill file, creating it in @param dir on first use, with the
+ * @param head_len bytes at @param head already received into userspace.
+ * @return 0 on success, -1 on failure with errno set
+ */
+extern int splice_ingest_begin(struct splice_ingest *si, const char *dir, const char *head, size_t head_len);
+
+/**
+ * Writes the @param len received bytes at @param data to the spill file, stopping right
+ * after the end of packet.
+ * @param consumed set to the number of bytes written, the rest belonging to later packets
+ * @return 1 once the packet is complete, 0 if more data is needed, -1 on failure with
+ * errno set
+ */
+extern int splice_ingest_append(struct splice_ingest *si, const char *data, size_t len, size_t *consumed);
+
+/**
+ * Waits for data on @param sock_fd and splices it into the spill file, stopping right
+ * after the end of packet so that following packets stay in the socket.
+ * @return 1 once the packet is complete, 0 if more data is needed, -1 on failure with
+ * errno set (ECONNRESET when the peer closed before the end of packet, EAGAIN when a
+ * non-blocking socket has no data)
+ */
+extern int splice_ingest_recv(struct splice_ingest *si, int sock_fd);
+
+/**
+ * Empties the spill file once its packet has been committed.
+ * @return 0 on success, -1 on failure with errno set
+ */
+extern int splice_ingest_reset(struct splice_ingest *si);
+
+#endif /* SPLICE_INGEST_H */
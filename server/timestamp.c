@@ -0,0 +1,122 @@
+/**
+ * @file timestamp.c
+ * @brief timerfd driven timestamp records with a per-second format cache
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/timerfd.h>
+#include "timestamp.h"
+#include "append-log.h"
+
+struct timestamp_thread_s
+{
+    pthread_t thread;
+    int running;
+    int timer_fd;
+};
+
+static struct timestamp_thread_s ticker = {
+    .running = 0,
+    .timer_fd = -1,
+};
+
+const char *timestamp_format(struct timestamp_cache *cache, time_t now, size_t *len)
+{
+    if (cache->len == 0 || cache->second != now)
+    {
+        struct tm tms;
+        localtime_r(&now, &tms);
+        size_t n = strlen("timestamp:");
+        memcpy(cache->record, "timestamp:", n);
+        n += strftime(&cache->record[n], sizeof(cache->record) - n - 1, "%a, %d %b %Y %T %z", &tms);
+        cache->record[n++] = '\n';
+        cache->len = n;
+        cache->second = now;
+    }
+    *len = cache->len;
+    return cache->record;
+}
+
+static void *timestamp_thread(void *arg)
+{
+    struct timestamp_cache cache = {.len = 0};
+    while (1)
+    {
+        uint64_t expirations;
+        ssize_t rc = read(ticker.timer_fd, &expirations, sizeof(expirations));
+        if (rc != sizeof(expirations))
+        {
+            if (rc == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "Timestamp timer read failed: %s", strerror(errno));
+            return NULL;
+        }
+
+        // ticks missed while the append was blocked collapse into one record
+        size_t len;
+        const char *record = timestamp_format(&cache, time(NULL), &len);
+        // the record may sit on the group commit stack, only stop between appends
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (append_log_append(record, len) == -1)
+        {
+            syslog(LOG_ERR, "Failed to write timestamp: %s", strerror(errno));
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+    return NULL;
+}
+
+int timestamp_start(long interval_ms)
+{
+    ticker.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (ticker.timer_fd == -1)
+    {
+        return -1;
+    }
+
+    struct itimerspec its;
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(ticker.timer_fd, 0, &its, NULL) != 0)
+    {
+        return -1;
+    }
+
+    // signals are left to the server's own threads
+    sigset_t mask, oldmask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+    int rc = pthread_create(&ticker.thread, NULL, timestamp_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    if (rc != 0)
+    {
+        errno = rc;
+        return -1;
+    }
+    ticker.running = 1;
+    return 0;
+}
+
+void timestamp_stop(void)
+{
+    if (ticker.running)
+    {
+        pthread_cancel(ticker.thread);
+        pthread_join(ticker.thread, NULL);
+        ticker.running = 0;
+    }
+    if (ticker.timer_fd != -1)
+    {
+        close(ticker.timer_fd);
+        ticker.timer_fd = -1;
+    }
+}
@@ -0,0 +1,53 @@
+/**
+ * @file timestamp.h
+ * @brief Periodic "timestamp:" records appended to the data file
+ *
+ * A single long-lived thread waits on a timerfd and appends one record per
+ * expiration through append_log_append(), the same path client packets take.
+ * The formatted record only changes once per second, so it is cached and
+ * sub-second intervals reuse it.
+ */
+
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define TIMESTAMP_DEFAULT_INTERVAL_MS 10000
+
+/**
+ * Large enough for "timestamp:" followed by any RFC 2822 date and the newline
+ */
+#define TIMESTAMP_MAX_LEN 80
+
+/**
+ * Cache of the last formatted record
+ */
+struct timestamp_cache
+{
+    time_t second;
+    size_t len;
+    char record[TIMESTAMP_MAX_LEN];
+};
+
+/**
+ * Formats the record for @param now in local time, reusing @param cache when it holds
+ * the same second.
+ * @param len set to the length of the record, including the newline
+ * @return the record, valid until the next call with the same cache
+ */
+extern const char *timestamp_format(struct timestamp_cache *cache, time_t now, size_t *len);
+
+/**
+ * Starts the timestamp thread, appending a record every @param interval_ms.
+ * @return 0 on success, -1 on failure with errno set
+ */
+extern int timestamp_start(long interval_ms);
+
+/**
+ * Cancels and joins the timestamp thread.
+ */
+extern void timestamp_stop(void);
+
+#endif /* TIMESTAMP_H */
@@ -0,0 +1,29 @@
+/**
+ * @file wake-fd.c
+ * @brief Waking the threads polling an eventfd
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include "wake-fd.h"
+
+int wake_fd_signal(int fd)
+{
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) == -1)
+    {
+        if (errno == EAGAIN)
+        {
+            return 0;
+        }
+        if (errno != EINTR)
+        {
+            syslog(LOG_ERR, "Could not write wake fd: %s", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,16 @@
+/**
+ * @file wake-fd.h
+ * @brief Waking the threads polling an eventfd
+ */
+
+#ifndef WAKE_FD_H
+#define WAKE_FD_H
+
+/**
+ * Adds one to the eventfd @param fd, waking whoever polls it.  A counter too full to
+ * take it is already readable, so that counts as woken, any other failure is logged.
+ * @return 0 on success, -1 with errno set when nobody was woken
+ */
+extern int wake_fd_signal(int fd);
+
+#endif
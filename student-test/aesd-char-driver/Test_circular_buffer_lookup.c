@@ -0,0 +1,183 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * The linear walk the lookup used to do, for comparison.
+ */
+static struct aesd_buffer_entry *reference_find(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                                size_t *entry_offset)
+{
+    if ((buffer->in_offs == buffer->out_offs) && !buffer->full)
+    {
+        return NULL;
+    }
+    uint32_t pos = buffer->out_offs;
+    size_t offset = 0;
+    do
+    {
+        if (char_offset < offset + buffer->entry[pos].size)
+        {
+            *entry_offset = char_offset - offset;
+            return &buffer->entry[pos];
+        }
+        offset += buffer->entry[pos].size;
+        pos = (pos + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    } while (pos != buffer->in_offs);
+    return NULL;
+}
+
+/**
+ * @return the number of bytes held by @param buffer
+ */
+static size_t buffer_bytes(struct aesd_circular_buffer *buffer)
+{
+    size_t total = 0;
+    uint32_t index;
+    struct aesd_buffer_entry *entry;
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index)
+    {
+        uint32_t held = (index + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs) %
+                        AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        uint32_t count = buffer->full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+                                      : (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED -
+                                         buffer->out_offs) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        if (held < count)
+        {
+            total += entry->size;
+        }
+    }
+    return total;
+}
+
+/**
+ * Checks every offset of @param buffer, and one past the end, against reference_find(), both
+ * with a plain lookup and with a cursor read forward.
+ */
+static void check_lookups(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_circular_buffer_cursor cursor;
+    aesd_circular_buffer_cursor_init(&cursor);
+    size_t total = buffer_bytes(buffer);
+    for (size_t offset = 0; offset <= total; offset++)
+    {
+        size_t expected_in = 0, in = 0, cursor_in = 0;
+        struct aesd_buffer_entry *expected = reference_find(buffer, offset, &expected_in);
+        struct aesd_buffer_entry *found = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &in);
+        struct aesd_buffer_entry *cursor_found = aesd_circular_buffer_cursor_find(buffer, &cursor, offset, &cursor_in);
+        TEST_ASSERT_TRUE_MESSAGE(expected == found, "lookup found the wrong entry");
+        TEST_ASSERT_TRUE_MESSAGE(expected == cursor_found, "cursor found the wrong entry");
+        if (expected != NULL)
+        {
+            TEST_ASSERT_EQUAL_INT_MESSAGE(expected_in, in, "wrong offset in entry");
+            TEST_ASSERT_EQUAL_INT_MESSAGE(expected_in, cursor_in, "wrong offset in entry from cursor");
+        }
+    }
+}
+
+void test_circular_buffer_lookup_matches_linear_walk()
+{
+    static const char data[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    srand(1);
+
+    check_lookups(&buffer);
+    for (int i = 0; i < 3 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 7 && i < 2000; i++)
+    {
+        // zero sized entries included, they must never be returned
+        struct aesd_buffer_entry entry = {.buffptr = data, .size = rand() % 5};
+        if (rand() % 4 == 0)
+        {
+            aesd_circular_buffer_remove_entry(&buffer);
+        }
+        else
+        {
+            aesd_circular_buffer_add_entry(&buffer, &entry);
+        }
+        check_lookups(&buffer);
+    }
+}
+
+/**
+ * Only differences of the cumulative offsets matter, so lookups carry on across their
+ * wrap around.
+ */
+void test_circular_buffer_lookup_wraps_offsets()
+{
+    static const char data[] = "abcdefgh";
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    buffer.end = SIZE_MAX - 6;
+
+    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 2 && i < 20; i++)
+    {
+        struct aesd_buffer_entry entry = {.buffptr = data, .size = 1 + i % 3};
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+        check_lookups(&buffer);
+    }
+}
+
+/**
+ * A cursor whose entry was removed or overwritten starts over, never returning a stale entry.
+ */
+void test_circular_buffer_cursor_after_remove()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_cursor cursor;
+    struct aesd_buffer_entry first = {.buffptr = "one\n", .size = 4};
+    struct aesd_buffer_entry second = {.buffptr = "two\n", .size = 4};
+    size_t in;
+
+    aesd_circular_buffer_init(&buffer);
+    aesd_circular_buffer_cursor_init(&cursor);
+    TEST_ASSERT_NULL(aesd_circular_buffer_cursor_find(&buffer, &cursor, 0, &in));
+    aesd_circular_buffer_add_entry(&buffer, &first);
+    aesd_circular_buffer_add_entry(&buffer, &second);
+
+    struct aesd_buffer_entry *found = aesd_circular_buffer_cursor_find(&buffer, &cursor, 5, &in);
+    TEST_ASSERT_EQUAL_PTR(second.buffptr, found->buffptr);
+    TEST_ASSERT_EQUAL_INT(1, in);
+
+    // offsets count from the oldest entry held, so the same offset now lands in the first entry added next
+    aesd_circular_buffer_remove_entry(&buffer);
+    aesd_circular_buffer_remove_entry(&buffer);
+    aesd_circular_buffer_add_entry(&buffer, &first);
+    found = aesd_circular_buffer_cursor_find(&buffer, &cursor, 1, &in);
+    TEST_ASSERT_EQUAL_PTR(first.buffptr, found->buffptr);
+    TEST_ASSERT_EQUAL_INT(1, in);
+    TEST_ASSERT_NULL(aesd_circular_buffer_cursor_find(&buffer, &cursor, 4, &in));
+}
+
+/**
+ * A cursor set to an entry carries on from there, as a reader walking the entries itself does.
+ */
+void test_circular_buffer_cursor_set()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_cursor cursor;
+    struct aesd_buffer_entry entries[] = {
+        {.buffptr = "one\n", .size = 4},
+        {.buffptr = "two\n", .size = 4},
+        {.buffptr = "three\n", .size = 6},
+    };
+    size_t in;
+
+    aesd_circular_buffer_init(&buffer);
+    aesd_circular_buffer_cursor_init(&cursor);
+    for (int i = 0; i < 3; i++)
+    {
+        aesd_circular_buffer_add_entry(&buffer, &entries[i]);
+    }
+
+    struct aesd_buffer_entry *found = aesd_circular_buffer_cursor_find(&buffer, &cursor, 0, &in);
+    aesd_circular_buffer_cursor_set(&buffer, &cursor, found + 1);
+    TEST_ASSERT_TRUE(cursor.valid);
+    TEST_ASSERT_EQUAL_INT(found + 1 - buffer.entry, cursor.pos);
+    found = aesd_circular_buffer_cursor_find(&buffer, &cursor, 9, &in);
+    TEST_ASSERT_EQUAL_PTR(entries[2].buffptr, found->buffptr);
+    TEST_ASSERT_EQUAL_INT(1, in);
+}
@@ -0,0 +1,57 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../../server/admission.h"
+
+static atomic_int admitted;
+
+static void *wait_for_slot(void *arg)
+{
+    admission_conn_wait();
+    atomic_store(&admitted, 1);
+    return NULL;
+}
+
+void test_admission_connection_limit()
+{
+    admission.max_connections = 2;
+    TEST_ASSERT_EQUAL_INT(1, admission_conn_try_enter());
+    TEST_ASSERT_EQUAL_INT(0, admission_conn_full());
+    TEST_ASSERT_EQUAL_INT(1, admission_conn_try_enter());
+    TEST_ASSERT_EQUAL_INT(1, admission_conn_full());
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, admission_conn_try_enter(), "admitted over the limit");
+
+    admission_conn_leave();
+    TEST_ASSERT_EQUAL_INT(1, admission_conn_try_enter());
+
+    admission_conn_leave();
+    admission_conn_leave();
+    admission.max_connections = 0;
+}
+
+/**
+ * A deferred accept must go ahead as soon as a connection closes.
+ */
+void test_admission_wait_woken_by_leave()
+{
+    admission.max_connections = 1;
+    atomic_store(&admitted, 0);
+    TEST_ASSERT_EQUAL_INT(1, admission_conn_try_enter());
+
+    pthread_t thread;
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&thread, NULL, wait_for_slot, NULL));
+    usleep(50000);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, atomic_load(&admitted), "admitted over the limit");
+
+    admission_conn_leave();
+    pthread_join(thread, NULL);
+    TEST_ASSERT_EQUAL_INT(1, atomic_load(&admitted));
+    TEST_ASSERT_EQUAL_INT(1, admission_conn_full());
+
+    admission_conn_leave();
+    admission.max_connections = 0;
+}
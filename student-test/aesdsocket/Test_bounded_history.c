@@ -0,0 +1,164 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "../../server/bounded-history.h"
+
+/**
+ * Adds each of @param records as its own record, continuing from log offset @param start.
+ * @return the log offset after the last
+ */
+static off_t add_records(const char *const *records, int count, off_t start)
+{
+    for (int i = 0; i < count; i++)
+    {
+        struct iovec iov = {.iov_base = (void *)records[i], .iov_len = strlen(records[i])};
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, bounded_history_add(&iov, 1, start), "add failed");
+        start += iov.iov_len;
+    }
+    return start;
+}
+
+/**
+ * Reads the log range [*offset, end) into @param buf, terminated.
+ */
+static void read_range(off_t *offset, off_t end, char *buf, size_t size)
+{
+    size_t len = bounded_history_read(offset, end, buf, size - 1);
+    buf[len] = '\0';
+}
+
+void test_bounded_history_evicts_by_records()
+{
+    const char *records[] = {"a\n", "bb\n", "ccc\n", "dddd\n"};
+    char buf[64];
+    off_t start, end;
+
+    TEST_ASSERT_EQUAL_INT(0, bounded_history_init(3, 0));
+    off_t committed = add_records(records, 4, 0);
+    TEST_ASSERT_EQUAL_INT(14, committed);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, bounded_history_records(), "oldest record not evicted");
+
+    // record numbers count from the oldest kept, offsets from the start of the log
+    TEST_ASSERT_EQUAL_INT(0, bounded_history_record(0, &start, &end));
+    TEST_ASSERT_EQUAL_INT(2, start);
+    TEST_ASSERT_EQUAL_INT(5, end);
+    TEST_ASSERT_EQUAL_INT(0, bounded_history_record(2, &start, &end));
+    TEST_ASSERT_EQUAL_INT(9, start);
+    TEST_ASSERT_EQUAL_INT(14, end);
+    TEST_ASSERT_EQUAL_INT(-1, bounded_history_record(3, &start, &end));
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+
+    // an evicted offset reads on from the oldest record kept
+    off_t offset = 0;
+    read_range(&offset, committed, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("bb\nccc\ndddd\n", buf);
+    TEST_ASSERT_EQUAL_INT(2, offset);
+
+    // one starting inside a record reads the rest of it
+    offset = 7;
+    read_range(&offset, 12, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("c\nddd", buf);
+    TEST_ASSERT_EQUAL_INT(7, offset);
+
+    bounded_history_free();
+    TEST_ASSERT_EQUAL_INT(0, bounded_history_records());
+}
+
+void test_bounded_history_evicts_by_bytes()
+{
+    const char *records[] = {"1234\n", "abcd\n", "wxyz\n"};
+    const char *oversize = "0123456789abcdef\n";
+    char buf[64];
+    off_t start, end;
+
+    TEST_ASSERT_EQUAL_INT(0, bounded_history_init(0, 12));
+    off_t committed = add_records(records, 3, 100);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, bounded_history_records(), "byte limit not applied");
+    off_t offset = 100;
+    read_range(&offset, committed, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("abcd\nwxyz\n", buf);
+
+    // a record over the limit on its own is still kept, alone
+    committed = add_records(&oversize, 1, committed);
+    TEST_ASSERT_EQUAL_INT(1, bounded_history_records());
+    TEST_ASSERT_EQUAL_INT(0, bounded_history_record(0, &start, &end));
+    TEST_ASSERT_EQUAL_INT(115, start);
+    TEST_ASSERT_EQUAL_INT(committed, end);
+
+    bounded_history_free();
+}
+
+/**
+ * With no record limit the history keeps as many records as the buffer holds.
+ */
+void test_bounded_history_capacity()
+{
+    char record[16];
+    off_t committed = 0;
+
+    TEST_ASSERT_EQUAL_INT(-1, bounded_history_init(BOUNDED_HISTORY_MAX_RECORDS + 1, 0));
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+
+    TEST_ASSERT_EQUAL_INT(0, bounded_history_init(0, 0));
+    for (int i = 0; i < BOUNDED_HISTORY_MAX_RECORDS + 3; i++)
+    {
+        const char *records[] = {record};
+        snprintf(record, sizeof(record), "%d\n", i);
+        committed = add_records(records, 1, committed);
+    }
+    TEST_ASSERT_EQUAL_INT(BOUNDED_HISTORY_MAX_RECORDS, bounded_history_records());
+
+    off_t start, end;
+    char buf[16];
+    TEST_ASSERT_EQUAL_INT(0, bounded_history_record(0, &start, &end));
+    read_range(&start, end, buf, sizeof(buf));
+    snprintf(record, sizeof(record), "%d\n", 3);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(record, buf, "wrong oldest record");
+
+    bounded_history_free();
+}
+
+/**
+ * Several records added at once take consecutive offsets, and a reply gathers them
+ * into one writev().
+ */
+void test_bounded_history_send()
+{
+    const char *records[] = {"first\n", "second\n", "third\n"};
+    struct iovec iov[3];
+    char buf[64];
+    int sv[2];
+
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    TEST_ASSERT_EQUAL_INT(0, bounded_history_init(2, 0));
+    for (int i = 0; i < 3; i++)
+    {
+        iov[i].iov_base = (void *)records[i];
+        iov[i].iov_len = strlen(records[i]);
+    }
+    TEST_ASSERT_EQUAL_INT(0, bounded_history_add(iov, 3, 0));
+
+    off_t offset = 0;
+    TEST_ASSERT_EQUAL_INT(1, bounded_history_send(sv[0], &offset, 19));
+    TEST_ASSERT_EQUAL_INT(19, offset);
+    ssize_t len = read(sv[1], buf, sizeof(buf) - 1);
+    TEST_ASSERT_EQUAL_INT(13, len);
+    buf[len] = '\0';
+    TEST_ASSERT_EQUAL_STRING("second\nthird\n", buf);
+
+    // a range entirely evicted sends nothing and completes
+    bounded_history_add(iov, 2, 19);
+    offset = 0;
+    TEST_ASSERT_EQUAL_INT(1, bounded_history_send(sv[0], &offset, 19));
+    TEST_ASSERT_EQUAL_INT(19, offset);
+
+    bounded_history_free();
+    close(sv[0]);
+    close(sv[1]);
+}
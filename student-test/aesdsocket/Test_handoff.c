@@ -0,0 +1,125 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../../server/handoff.h"
+
+static char handoff_path[] = "/tmp/test_handoffXXXXXX";
+
+static struct handoff_state received;
+static int receive_result;
+
+static void *receive_state(void *arg)
+{
+    receive_result = handoff_receive(handoff_path, &received);
+    return NULL;
+}
+
+/**
+ * @return whether @param a and @param b refer to the same open file
+ */
+static bool same_file(int a, int b)
+{
+    int flags = fcntl(a, F_GETFL);
+    fcntl(a, F_SETFL, flags ^ O_APPEND);
+    bool same = (fcntl(b, F_GETFL) == (flags ^ O_APPEND));
+    fcntl(a, F_SETFL, flags);
+    return same;
+}
+
+void test_handoff_nobody_listening()
+{
+    struct handoff_state state;
+    TEST_ASSERT_EQUAL_INT(0, handoff_receive("/tmp/test_handoff_absent", &state));
+}
+
+/**
+ * The new server receives the very same sockets and data file, and the committed length.
+ */
+void test_handoff_round_trip()
+{
+    int fd = mkstemp(handoff_path);
+    TEST_ASSERT_TRUE_MESSAGE(fd >= 0, "mkstemp failed");
+    close(fd);
+    int sock_fd = handoff_listen(handoff_path);
+    TEST_ASSERT_TRUE_MESSAGE(sock_fd >= 0, "handoff_listen failed");
+    char data_path[] = "/tmp/test_handoff_dataXXXXXX";
+    int data_fd = mkstemp(data_path);
+    TEST_ASSERT_TRUE_MESSAGE(data_fd >= 0, "mkstemp failed");
+    unlink(data_path);
+
+    struct handoff_state state = {
+        .sock_fd = sock_fd,
+        .data_fd = data_fd,
+        .committed = 1234,
+        .nlisteners = 2,
+        .listen_fds = {socket(AF_INET, SOCK_STREAM, 0), socket(AF_INET, SOCK_STREAM, 0)},
+    };
+    pthread_t receiver;
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&receiver, NULL, receive_state, NULL));
+    int conn_fd = handoff_accept(sock_fd);
+    TEST_ASSERT_TRUE_MESSAGE(conn_fd >= 0, "handoff_accept failed");
+    TEST_ASSERT_EQUAL_INT(0, handoff_send(conn_fd, &state));
+    pthread_join(receiver, NULL);
+
+    TEST_ASSERT_EQUAL_INT(1, receive_result);
+    TEST_ASSERT_EQUAL_INT(1234, received.committed);
+    TEST_ASSERT_EQUAL_INT(2, received.nlisteners);
+    TEST_ASSERT_TRUE(same_file(state.data_fd, received.data_fd));
+    TEST_ASSERT_TRUE(same_file(state.listen_fds[1], received.listen_fds[1]));
+    TEST_ASSERT_TRUE(same_file(state.sock_fd, received.sock_fd));
+
+    close(received.sock_fd);
+    close(received.data_fd);
+    close(received.listen_fds[0]);
+    close(received.listen_fds[1]);
+    close(state.data_fd);
+    close(state.listen_fds[0]);
+    close(state.listen_fds[1]);
+    close(sock_fd);
+    unlink(handoff_path);
+}
+
+/**
+ * A connection that never greets is refused, without blocking the hand over socket.
+ */
+void test_handoff_rejects_silent_peer()
+{
+    strcpy(handoff_path, "/tmp/test_handoffXXXXXX");
+    int fd = mkstemp(handoff_path);
+    TEST_ASSERT_TRUE_MESSAGE(fd >= 0, "mkstemp failed");
+    close(fd);
+    int sock_fd = handoff_listen(handoff_path);
+    TEST_ASSERT_TRUE(sock_fd >= 0);
+
+    int peer = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, handoff_path);
+    TEST_ASSERT_EQUAL_INT(0, connect(peer, (struct sockaddr *)&addr, sizeof(addr)));
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT(-1, handoff_accept(sock_fd));
+    TEST_ASSERT_EQUAL_INT(EPROTO, errno);
+
+    close(peer);
+    close(sock_fd);
+    unlink(handoff_path);
+}
+
+void test_handoff_drain_signalled()
+{
+    TEST_ASSERT_EQUAL_INT(0, handoff_init());
+    struct pollfd fds = {.fd = handoff_drain_fd(), .events = POLLIN};
+    TEST_ASSERT_EQUAL_INT(0, poll(&fds, 1, 0));
+    TEST_ASSERT_EQUAL_INT(0, handoff_draining());
+    handoff_begin_drain();
+    TEST_ASSERT_EQUAL_INT(1, handoff_draining());
+    TEST_ASSERT_EQUAL_INT(1, poll(&fds, 1, 0));
+}
@@ -0,0 +1,202 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "../../server/line-assembler.h"
+
+/**
+ * Copies @param len bytes of @param data into @param la, at most @param chunk bytes
+ * per reserve/commit pair, the way a recv() loop would.
+ */
+static void feed(struct line_assembler *la, const char *data, size_t len, size_t chunk)
+{
+    while (len > 0)
+    {
+        size_t space;
+        char *ptr = line_assembler_reserve(la, 1, &space);
+        TEST_ASSERT_NOT_NULL_MESSAGE(ptr, "reserve failed");
+        size_t count = len < chunk ? len : chunk;
+        count = count < space ? count : space;
+        memcpy(ptr, data, count);
+        line_assembler_commit(la, count);
+        data += count;
+        len -= count;
+    }
+}
+
+void test_line_assembler_byte_at_a_time()
+{
+    struct line_assembler la;
+    size_t len;
+    line_assembler_init(&la);
+
+    feed(&la, "hello", 5, 1);
+    TEST_ASSERT_NULL_MESSAGE(line_assembler_next(&la, &len), "packet returned before its newline");
+    feed(&la, " world\n", 7, 1);
+    const char *packet = line_assembler_next(&la, &len);
+    TEST_ASSERT_NOT_NULL(packet);
+    TEST_ASSERT_EQUAL_UINT(12, len);
+    TEST_ASSERT_EQUAL_MEMORY("hello world\n", packet, len);
+    TEST_ASSERT_NULL(line_assembler_next(&la, &len));
+    TEST_ASSERT_EQUAL_UINT(0, line_assembler_pending(&la));
+
+    line_assembler_free(&la);
+}
+
+void test_line_assembler_pipelined_packets_and_carry_over()
+{
+    struct line_assembler la;
+    size_t len;
+    line_assembler_init(&la);
+
+    const char *stream = "one\ntwo\nthree\nfo";
+    feed(&la, stream, strlen(stream), 4096);
+
+    const char *packet = line_assembler_next(&la, &len);
+    TEST_ASSERT_EQUAL_UINT(4, len);
+    TEST_ASSERT_EQUAL_MEMORY("one\n", packet, len);
+    packet = line_assembler_next(&la, &len);
+    TEST_ASSERT_EQUAL_UINT(4, len);
+    TEST_ASSERT_EQUAL_MEMORY("two\n", packet, len);
+    packet = line_assembler_next(&la, &len);
+    TEST_ASSERT_EQUAL_UINT(6, len);
+    TEST_ASSERT_EQUAL_MEMORY("three\n", packet, len);
+    TEST_ASSERT_NULL(line_assembler_next(&la, &len));
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(2, line_assembler_pending(&la), "partial packet was not carried over");
+
+    feed(&la, "ur\n", 3, 4096);
+    packet = line_assembler_next(&la, &len);
+    TEST_ASSERT_EQUAL_UINT(5, len);
+    TEST_ASSERT_EQUAL_MEMORY("four\n", packet, len);
+
+    line_assembler_free(&la);
+}
+
+void test_line_assembler_empty_packet()
+{
+    struct line_assembler la;
+    size_t len;
+    line_assembler_init(&la);
+
+    feed(&la, "\n\n", 2, 4096);
+    TEST_ASSERT_NOT_NULL(line_assembler_next(&la, &len));
+    TEST_ASSERT_EQUAL_UINT(1, len);
+    TEST_ASSERT_NOT_NULL(line_assembler_next(&la, &len));
+    TEST_ASSERT_EQUAL_UINT(1, len);
+    TEST_ASSERT_NULL(line_assembler_next(&la, &len));
+
+    line_assembler_free(&la);
+}
+
+void test_line_assembler_large_packet_grows_geometrically()
+{
+    struct line_assembler la;
+    size_t len;
+    size_t packet_size = 10 * 1024 * 1024;
+    char *data = malloc(packet_size);
+    TEST_ASSERT_NOT_NULL(data);
+    memset(data, 'x', packet_size - 1);
+    data[packet_size - 1] = '\n';
+    line_assembler_init(&la);
+
+    feed(&la, data, packet_size, 4096);
+    TEST_ASSERT_TRUE_MESSAGE(la.size < 2 * packet_size, "buffer grew more than twice the packet size");
+    const char *packet = line_assembler_next(&la, &len);
+    TEST_ASSERT_NOT_NULL(packet);
+    TEST_ASSERT_EQUAL_UINT(packet_size, len);
+    TEST_ASSERT_EQUAL_MEMORY(data, packet, len);
+
+    // the next receive trims the oversized buffer back
+    feed(&la, "a\n", 2, 4096);
+    TEST_ASSERT_EQUAL_UINT(LINE_ASSEMBLER_MIN_SIZE, la.size);
+    packet = line_assembler_next(&la, &len);
+    TEST_ASSERT_EQUAL_MEMORY("a\n", packet, len);
+
+    line_assembler_free(&la);
+    free(data);
+}
+
+void test_line_assembler_reuses_consumed_space()
+{
+    struct line_assembler la;
+    size_t len;
+    line_assembler_init(&la);
+
+    // many small packets each leaving a partial one behind never need a bigger buffer
+    for (int i = 0; i < 10000; i++)
+    {
+        feed(&la, "ab", 2, 4096);
+        feed(&la, "\ncd", 3, 4096);
+        TEST_ASSERT_NOT_NULL(line_assembler_next(&la, &len));
+        TEST_ASSERT_EQUAL_UINT(3, len);
+        feed(&la, "\n", 1, 4096);
+        TEST_ASSERT_NOT_NULL(line_assembler_next(&la, &len));
+        TEST_ASSERT_EQUAL_UINT(3, len);
+    }
+    TEST_ASSERT_EQUAL_UINT(LINE_ASSEMBLER_MIN_SIZE, la.size);
+
+    line_assembler_free(&la);
+}
+
+void test_line_assembler_more_packets_than_one_scan()
+{
+    struct line_assembler la;
+    size_t len;
+    char stream[3 * LINE_ASSEMBLER_MAX_EOL * 2 + 1];
+    line_assembler_init(&la);
+
+    for (int i = 0; i < 3 * LINE_ASSEMBLER_MAX_EOL; i++)
+    {
+        stream[2 * i] = 'a' + (i % 26);
+        stream[2 * i + 1] = '\n';
+    }
+    stream[sizeof(stream) - 1] = 'z';
+    feed(&la, stream, sizeof(stream), sizeof(stream));
+
+    for (int i = 0; i < 3 * LINE_ASSEMBLER_MAX_EOL; i++)
+    {
+        const char *packet = line_assembler_next(&la, &len);
+        TEST_ASSERT_NOT_NULL_MESSAGE(packet, "pipelined packet missing");
+        TEST_ASSERT_EQUAL_UINT(2, len);
+        TEST_ASSERT_EQUAL_MEMORY(&stream[2 * i], packet, len);
+    }
+    TEST_ASSERT_NULL(line_assembler_next(&la, &len));
+    TEST_ASSERT_EQUAL_UINT(1, line_assembler_pending(&la));
+
+    line_assembler_free(&la);
+}
+
+/**
+ * Assemblers sharing a budget can't grow their buffers beyond it together, and get the
+ * memory back once the buffers are freed.
+ */
+void test_line_assembler_budget_shared()
+{
+    struct line_budget budget = {.used = 0, .limit = 5 * LINE_ASSEMBLER_MIN_SIZE / 2};
+    struct line_assembler a, b;
+    size_t space;
+    line_assembler_init(&a);
+    line_assembler_init(&b);
+    a.budget = &budget;
+    b.budget = &budget;
+
+    TEST_ASSERT_NOT_NULL(line_assembler_reserve(&a, 1, &space));
+    TEST_ASSERT_NOT_NULL(line_assembler_reserve(&b, 1, &space));
+    TEST_ASSERT_EQUAL_UINT(2 * LINE_ASSEMBLER_MIN_SIZE, budget.used);
+
+    // doubling a would take three minimum sized buffers together, half a buffer too many
+    line_assembler_commit(&a, space);
+    errno = 0;
+    TEST_ASSERT_NULL_MESSAGE(line_assembler_reserve(&a, 1, &space), "grew beyond the budget");
+    TEST_ASSERT_EQUAL_INT(ENOBUFS, errno);
+    TEST_ASSERT_EQUAL_UINT(2 * LINE_ASSEMBLER_MIN_SIZE, budget.used);
+
+    line_assembler_free(&b);
+    TEST_ASSERT_TRUE_MESSAGE(b.budget == &budget, "budget lost on free");
+    TEST_ASSERT_NOT_NULL_MESSAGE(line_assembler_reserve(&a, 1, &space), "budget not given back");
+    TEST_ASSERT_EQUAL_UINT(2 * LINE_ASSEMBLER_MIN_SIZE, budget.used);
+
+    line_assembler_free(&a);
+    TEST_ASSERT_EQUAL_UINT(0, budget.used);
+}
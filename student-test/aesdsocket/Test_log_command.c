@@ -0,0 +1,250 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../../server/append-log.h"
+#include "../../server/log-command.h"
+
+static char log_path[] = "/tmp/test_log_commandXXXXXX";
+
+/**
+ * Opens an empty log and appends the packets "0\n", "11\n", "222\n" and so on up to
+ * @param records of them, record i holding i % 10 + 2 bytes.
+ */
+static void open_log(unsigned long records)
+{
+    int fd = mkstemp(log_path);
+    TEST_ASSERT_TRUE_MESSAGE(fd >= 0, "mkstemp failed");
+    close(fd);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, append_log_open(log_path), "append_log_open failed");
+    for (unsigned long i = 0; i < records; i++)
+    {
+        char record[16];
+        size_t len = i % 10 + 1;
+        memset(record, '0' + i % 10, len);
+        record[len++] = '\n';
+        TEST_ASSERT_TRUE(append_log_append(record, len) != -1);
+    }
+}
+
+static void close_log(void)
+{
+    append_log_close(1);
+    strcpy(log_path, "/tmp/test_log_commandXXXXXX");
+}
+
+/**
+ * @return the result of log_command_range() on the NUL terminated @param command
+ */
+static int range(const char *command, off_t *start, off_t *end)
+{
+    return log_command_range(command, strlen(command), start, end);
+}
+
+void test_log_command_seek_and_read_range()
+{
+    off_t start, end;
+    open_log(4);
+    // the log is "0\n11\n222\n3333\n"
+    TEST_ASSERT_EQUAL_INT(1, range("AESDCHAR_IOCSEEKTO:1,1\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(3, start);
+    TEST_ASSERT_EQUAL_INT(14, end);
+    TEST_ASSERT_EQUAL_INT(1, range("AESDCHAR_IOCSEEKTO:0,0\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(0, start);
+
+    TEST_ASSERT_EQUAL_INT(1, range("AESDCHAR_IOCREADRANGE:1,2\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(2, start);
+    TEST_ASSERT_EQUAL_INT(9, end);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, range("AESDCHAR_IOCREADRANGE:3,100\n", &start, &end), "range not clamped");
+    TEST_ASSERT_EQUAL_INT(9, start);
+    TEST_ASSERT_EQUAL_INT(14, end);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, range("AESDCHAR_IOCREADRANGE:4,1\n", &start, &end), "range at the end");
+    TEST_ASSERT_EQUAL_INT(start, end);
+
+    TEST_ASSERT_EQUAL_INT(-1, range("AESDCHAR_IOCSEEKTO:1,3\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+    TEST_ASSERT_EQUAL_INT(-1, range("AESDCHAR_IOCSEEKTO:4,0\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(-1, range("AESDCHAR_IOCREADRANGE:5,1\n", &start, &end));
+    close_log();
+}
+
+/**
+ * Anything short of a well formed command is a packet to append.
+ */
+void test_log_command_malformed_is_data()
+{
+    off_t start, end;
+    open_log(1);
+    const char *packets[] = {
+        "hello\n",
+        "AESDCHAR_IOCSEEKTO:\n",
+        "AESDCHAR_IOCSEEKTO:0\n",
+        "AESDCHAR_IOCSEEKTO:0,\n",
+        "AESDCHAR_IOCSEEKTO:-1,0\n",
+        "AESDCHAR_IOCSEEKTO:0,0 \n",
+        "AESDCHAR_IOCSEEKTO:99999999999999999999999,0\n",
+        "AESDCHAR_IOCREADRANGE:0;1\n",
+    };
+    for (size_t i = 0; i < sizeof(packets) / sizeof(packets[0]); i++)
+    {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, range(packets[i], &start, &end), packets[i]);
+    }
+    close_log();
+}
+
+/**
+ * Records past the first index chunk must be found as well.
+ */
+void test_log_command_index_spans_chunks()
+{
+    off_t start, end;
+    const unsigned long records = 10000;
+    open_log(records);
+    TEST_ASSERT_EQUAL_INT(records, append_log_records());
+
+    // every 10 records take 1 + 2 + ... + 10 + 10 newlines = 65 bytes
+    for (unsigned long i = 0; i < records; i += 997)
+    {
+        TEST_ASSERT_EQUAL_INT(0, append_log_record(i, &start, &end));
+        TEST_ASSERT_EQUAL_INT(i / 10 * 65 + (i % 10) * (i % 10 + 1) / 2 + i % 10, start);
+        TEST_ASSERT_EQUAL_INT(i % 10 + 2, end - start);
+    }
+    TEST_ASSERT_EQUAL_INT(0, append_log_record(records - 1, &start, &end));
+    TEST_ASSERT_EQUAL_INT(append_log_committed(), end);
+    TEST_ASSERT_EQUAL_INT(-1, append_log_record(records, &start, &end));
+    close_log();
+}
+
+/**
+ * A subscription starts at any offset up to the committed length, and from then on
+ * every append signals the watch fd.
+ */
+void test_log_command_subscribe()
+{
+    off_t start, end;
+    uint64_t count;
+    open_log(2);
+    TEST_ASSERT_EQUAL_INT(LOG_COMMAND_SUBSCRIBE_TO, range("AESDCHAR_SUBSCRIBE:2\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(2, start);
+    TEST_ASSERT_EQUAL_INT(5, end);
+    TEST_ASSERT_EQUAL_INT(LOG_COMMAND_SUBSCRIBE_TO, range("AESDCHAR_SUBSCRIBE:5\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(-1, range("AESDCHAR_SUBSCRIBE:6\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(LOG_COMMAND_NONE, range("AESDCHAR_SUBSCRIBE:1,2\n", &start, &end));
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, read(append_log_watch_fd(), &count, sizeof(count)), "signalled without watchers");
+    append_log_watch();
+    TEST_ASSERT_TRUE(append_log_append("x\n", 2) != -1);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(count), read(append_log_watch_fd(), &count, sizeof(count)), "append not signalled");
+    append_log_unwatch();
+    close_log();
+}
+
+void test_log_command_delta()
+{
+    off_t start, end;
+    open_log(2);
+    TEST_ASSERT_EQUAL_INT(LOG_COMMAND_DELTA_FROM, range("AESDCHAR_DELTA:0\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(0, start);
+    TEST_ASSERT_EQUAL_INT(5, end);
+    TEST_ASSERT_EQUAL_INT(LOG_COMMAND_DELTA_FROM, range("AESDCHAR_DELTA:3\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(3, start);
+    TEST_ASSERT_EQUAL_INT(-1, range("AESDCHAR_DELTA:6\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(LOG_COMMAND_NONE, range("AESDCHAR_DELTA:\n", &start, &end));
+    close_log();
+}
+
+/**
+ * A sealed log refuses appends, and a log taken over from its file descriptor finds
+ * the same records as before and keeps appending after them.
+ */
+void test_log_command_adopt_and_seal()
+{
+    off_t start, end;
+    open_log(12);
+    off_t committed = append_log_committed();
+    append_log_seal();
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT(-1, append_log_append("x\n", 2));
+    TEST_ASSERT_EQUAL_INT(EROFS, errno);
+
+    int fd = dup(append_log_fd());
+    TEST_ASSERT_TRUE(fd >= 0);
+    append_log_close(0);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, append_log_adopt(fd, log_path, committed), "append_log_adopt failed");
+    TEST_ASSERT_EQUAL_INT(committed, append_log_committed());
+    TEST_ASSERT_EQUAL_INT(12, append_log_records());
+    TEST_ASSERT_EQUAL_INT(0, append_log_record(11, &start, &end));
+    TEST_ASSERT_EQUAL_INT(committed - 3, start);
+    TEST_ASSERT_EQUAL_INT(committed, end);
+
+    TEST_ASSERT_EQUAL_INT(committed + 2, append_log_append("x\n", 2));
+    TEST_ASSERT_EQUAL_INT(1, range("AESDCHAR_IOCSEEKTO:12,0\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(committed, start);
+    close_log();
+}
+
+/**
+ * A recovered log keeps the complete records an earlier run left, cutting off a torn
+ * last one, and appends after them.
+ */
+void test_log_command_recover()
+{
+    off_t start, end, torn;
+    int fd = mkstemp(log_path);
+    TEST_ASSERT_TRUE_MESSAGE(fd >= 0, "mkstemp failed");
+    TEST_ASSERT_EQUAL_INT(12, write(fd, "0\n11\n222\n333", 12));
+    close(fd);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, append_log_recover(log_path, &torn), "append_log_recover failed");
+    TEST_ASSERT_EQUAL_INT(3, torn);
+    TEST_ASSERT_EQUAL_INT(9, append_log_committed());
+    TEST_ASSERT_EQUAL_INT(3, append_log_records());
+    TEST_ASSERT_EQUAL_INT(0, append_log_record(2, &start, &end));
+    TEST_ASSERT_EQUAL_INT(5, start);
+    TEST_ASSERT_EQUAL_INT(9, end);
+    TEST_ASSERT_EQUAL_INT(14, append_log_append("3333\n", 5));
+    append_log_close(0);
+
+    TEST_ASSERT_EQUAL_INT(0, append_log_recover(log_path, &torn));
+    TEST_ASSERT_EQUAL_INT(0, torn);
+    TEST_ASSERT_EQUAL_INT(4, append_log_records());
+    TEST_ASSERT_EQUAL_INT(1, range("AESDCHAR_IOCSEEKTO:3,0\n", &start, &end));
+    TEST_ASSERT_EQUAL_INT(9, start);
+    close_log();
+}
+
+/**
+ * A mapped log grows one chunk at a time as appends cross its end, serves the same
+ * bytes from the mapping, and is cut back to the committed length when sealed.
+ */
+void test_log_command_mapped()
+{
+    off_t start, end;
+    struct stat st;
+    size_t chunk = sysconf(_SC_PAGESIZE);
+    open_log(4);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, append_log_map(chunk), "append_log_map failed");
+    TEST_ASSERT_EQUAL_MEMORY("0\n11\n222\n3333\n", append_log_mapped(0), 14);
+
+    char record[1000];
+    memset(record, 'x', sizeof(record) - 1);
+    record[sizeof(record) - 1] = '\n';
+    for (int i = 0; i < 10; i++)
+    {
+        TEST_ASSERT_EQUAL_INT(14 + (i + 1) * sizeof(record), append_log_append(record, sizeof(record)));
+    }
+    TEST_ASSERT_EQUAL_INT(0, append_log_record(13, &start, &end));
+    TEST_ASSERT_EQUAL_MEMORY(record, append_log_mapped(start), sizeof(record));
+    TEST_ASSERT_EQUAL_INT(0, stat(log_path, &st));
+    TEST_ASSERT_TRUE_MESSAGE(st.st_size >= end, "mapped past the end of the file");
+
+    append_log_seal();
+    TEST_ASSERT_EQUAL_INT(0, stat(log_path, &st));
+    TEST_ASSERT_EQUAL_INT(end, st.st_size);
+    close_log();
+}
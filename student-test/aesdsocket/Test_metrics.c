@@ -0,0 +1,77 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../../server/metrics.h"
+
+static char text[32768];
+
+/**
+ * @return the value of the metric line starting with @param name in the current metrics
+ */
+static unsigned long long read_metric(const char *name)
+{
+    metrics_format(text, sizeof(text));
+    size_t len = strlen(name);
+    for (char *line = text; line != NULL && *line != '\0'; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL)
+    {
+        if (strncmp(line, name, len) == 0 && line[len] == ' ')
+        {
+            return strtoull(&line[len + 1], NULL, 10);
+        }
+    }
+    TEST_FAIL_MESSAGE("metric not found");
+    return 0;
+}
+
+static void *count_packets(void *arg)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        metrics_add(METRIC_PACKETS, 1);
+    }
+    return NULL;
+}
+
+/**
+ * Counts from threads that have exited must still be included, however many threads
+ * came and went.
+ */
+void test_metrics_sum_exited_threads()
+{
+    unsigned long long before = read_metric("packets_total");
+    for (int round = 0; round < 3; round++)
+    {
+        pthread_t threads[4];
+        for (int t = 0; t < 4; t++)
+        {
+            TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[t], NULL, count_packets, NULL));
+        }
+        for (int t = 0; t < 4; t++)
+        {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(12000, read_metric("packets_total") - before, "counts lost across threads");
+}
+
+void test_metrics_histogram_buckets()
+{
+    // buckets are only listed up to the highest one in use
+    metrics_observe(HIST_LOCK_HOLD, 100);
+    unsigned long long le3 = read_metric("logfile_lock_hold_ns_bucket{le=\"3\"}");
+    unsigned long long le7 = read_metric("logfile_lock_hold_ns_bucket{le=\"7\"}");
+    unsigned long long count = read_metric("logfile_lock_hold_ns_count");
+    unsigned long long sum = read_metric("logfile_lock_hold_ns_sum");
+
+    // 3 is the largest value of the le="3" bucket, 4 the smallest of le="7"
+    metrics_observe(HIST_LOCK_HOLD, 3);
+    metrics_observe(HIST_LOCK_HOLD, 4);
+    metrics_observe(HIST_LOCK_HOLD, 7);
+
+    TEST_ASSERT_EQUAL_INT(le3 + 1, read_metric("logfile_lock_hold_ns_bucket{le=\"3\"}"));
+    TEST_ASSERT_EQUAL_INT(le7 + 3, read_metric("logfile_lock_hold_ns_bucket{le=\"7\"}"));
+    TEST_ASSERT_EQUAL_INT(count + 3, read_metric("logfile_lock_hold_ns_count"));
+    TEST_ASSERT_EQUAL_INT(sum + 14, read_metric("logfile_lock_hold_ns_sum"));
+}
@@ -0,0 +1,78 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/newline-scan.h"
+
+static const char *kernel_names[] = {"scalar", "sse2", "avx2"};
+
+/**
+ * Compares every kernel available on this CPU against a byte by byte search
+ * for all buffer lengths up to 200 bytes, starting at every alignment within a vector.
+ */
+void test_newline_scan_kernels_match_reference()
+{
+    char buf[256];
+    size_t expected[256];
+    size_t positions[256];
+
+    srand(5713);
+    for (size_t i = 0; i < sizeof(buf); i++)
+    {
+        buf[i] = (rand() % 7 == 0) ? '\n' : 'a' + (rand() % 26);
+    }
+
+    for (size_t k = 0; k < sizeof(kernel_names) / sizeof(kernel_names[0]); k++)
+    {
+        if (newline_scan_select(kernel_names[k]) != 0)
+        {
+            continue;
+        }
+        for (size_t offset = 0; offset < 32; offset++)
+        {
+            for (size_t len = 0; len <= 200; len++)
+            {
+                size_t count = 0;
+                for (size_t i = 0; i < len; i++)
+                {
+                    if (buf[offset + i] == '\n')
+                    {
+                        expected[count++] = i;
+                    }
+                }
+                size_t found = newline_scan(&buf[offset], len, positions, sizeof(positions) / sizeof(positions[0]));
+                TEST_ASSERT_EQUAL_UINT_MESSAGE(count, found, kernel_names[k]);
+                TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, positions, count * sizeof(size_t), kernel_names[k]);
+                TEST_ASSERT_EQUAL_UINT_MESSAGE(count, newline_count(&buf[offset], len), kernel_names[k]);
+
+                // a short position list stops the scan at the max'th newline
+                if (count > 2)
+                {
+                    found = newline_scan(&buf[offset], len, positions, 2);
+                    TEST_ASSERT_EQUAL_UINT_MESSAGE(2, found, kernel_names[k]);
+                    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, positions, 2 * sizeof(size_t), kernel_names[k]);
+                }
+            }
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(0, newline_scan_select("scalar"));
+    TEST_ASSERT_EQUAL_INT(-1, newline_scan_select("unknown"));
+}
+
+void test_newline_count_large_buffer()
+{
+    size_t len = 1024 * 1024 + 17;
+    char *buf = malloc(len);
+    TEST_ASSERT_NOT_NULL(buf);
+    memset(buf, '\n', len);
+
+    // every byte a newline overflows a byte lane counter unless it is folded in time
+    for (size_t k = 0; k < sizeof(kernel_names) / sizeof(kernel_names[0]); k++)
+    {
+        if (newline_scan_select(kernel_names[k]) == 0)
+        {
+            TEST_ASSERT_EQUAL_UINT_MESSAGE(len, newline_count(buf, len), kernel_names[k]);
+        }
+    }
+    free(buf);
+}
@@ -0,0 +1,100 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../../server/splice-ingest.h"
+
+/**
+ * Reads the whole spill file of @param si into @param buf.
+ */
+static size_t read_spill(struct splice_ingest *si, char *buf, size_t size)
+{
+    ssize_t len = pread(si->spill_fd, buf, size, 0);
+    TEST_ASSERT_TRUE_MESSAGE(len >= 0, "pread of spill file failed");
+    return len;
+}
+
+/**
+ * Splices a packet which started in userspace, checking that reception stops at the
+ * end of packet and leaves the next packet in the socket.
+ */
+void test_splice_ingest_stops_at_end_of_packet()
+{
+    struct splice_ingest si;
+    int sv[2];
+    char buf[64];
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv), "socketpair failed");
+    splice_ingest_init(&si);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, splice_ingest_begin(&si, "/tmp", "abc", 3), "begin failed");
+
+    TEST_ASSERT_EQUAL_INT(3, write(sv[1], "def", 3));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, splice_ingest_recv(&si, sv[0]), "packet complete without a newline");
+    TEST_ASSERT_EQUAL_INT(9, write(sv[1], "ghi\nnext\n", 9));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, splice_ingest_recv(&si, sv[0]), "end of packet not found");
+
+    TEST_ASSERT_EQUAL_INT(10, si.len);
+    TEST_ASSERT_EQUAL_INT(10, read_spill(&si, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE("abcdefghi\n", buf, 10, "wrong spill file contents");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(5, recv(sv[0], buf, sizeof(buf), MSG_DONTWAIT), "next packet was consumed");
+    TEST_ASSERT_EQUAL_MEMORY("next\n", buf, 5);
+
+    // a reset spill file is reused for the next packet
+    TEST_ASSERT_EQUAL_INT(0, splice_ingest_reset(&si));
+    TEST_ASSERT_EQUAL_INT(0, splice_ingest_begin(&si, "/tmp", NULL, 0));
+    TEST_ASSERT_EQUAL_INT(3, write(sv[1], "xy\n", 3));
+    TEST_ASSERT_EQUAL_INT(1, splice_ingest_recv(&si, sv[0]));
+    TEST_ASSERT_EQUAL_INT(3, read_spill(&si, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_MEMORY("xy\n", buf, 3);
+
+    splice_ingest_free(&si);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+void test_splice_ingest_peer_close_mid_packet()
+{
+    struct splice_ingest si;
+    int sv[2];
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv), "socketpair failed");
+    splice_ingest_init(&si);
+    TEST_ASSERT_EQUAL_INT(0, splice_ingest_begin(&si, "/tmp", "abc", 3));
+    TEST_ASSERT_EQUAL_INT(3, write(sv[1], "def", 3));
+    close(sv[1]);
+
+    TEST_ASSERT_EQUAL_INT(0, splice_ingest_recv(&si, sv[0]));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, splice_ingest_recv(&si, sv[0]), "EOF before the newline must fail");
+    TEST_ASSERT_EQUAL_INT(ECONNRESET, errno);
+
+    splice_ingest_free(&si);
+    close(sv[0]);
+}
+
+/**
+ * Buffers received elsewhere are written up to the end of packet, the rest being left
+ * to the caller.
+ */
+void test_splice_ingest_append_stops_at_end_of_packet()
+{
+    struct splice_ingest si;
+    char buf[64];
+    size_t consumed;
+
+    splice_ingest_init(&si);
+    TEST_ASSERT_EQUAL_INT(0, splice_ingest_begin(&si, "/tmp", "ab", 2));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, splice_ingest_append(&si, "cd", 2, &consumed), "packet complete without a newline");
+    TEST_ASSERT_EQUAL_UINT(2, consumed);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, splice_ingest_append(&si, "e\nnext\n", 7, &consumed), "end of packet not found");
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(2, consumed, "next packet was consumed");
+
+    TEST_ASSERT_EQUAL_INT(6, si.len);
+    TEST_ASSERT_EQUAL_INT(6, read_spill(&si, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_MEMORY("abcde\n", buf, 6);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, si.pipe_fd[0], "pipe created without splicing");
+
+    splice_ingest_free(&si);
+}
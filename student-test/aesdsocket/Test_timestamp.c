@@ -0,0 +1,57 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../../server/timestamp.h"
+
+/**
+ * Formats @param t the way the original timer handler did, for comparison.
+ */
+static size_t reference_format(time_t t, char *buf, size_t size)
+{
+    struct tm tms;
+    localtime_r(&t, &tms);
+    size_t len = strlen("timestamp:");
+    memcpy(buf, "timestamp:", len);
+    len += strftime(&buf[len], size - len - 1, "%a, %d %b %Y %T %z", &tms);
+    buf[len++] = '\n';
+    return len;
+}
+
+void test_timestamp_format_matches_strftime()
+{
+    struct timestamp_cache cache = {.len = 0};
+    char expected[TIMESTAMP_MAX_LEN];
+    time_t times[] = {0, 1700000000, 1700000000, 1700000001, 1600000000};
+
+    for (size_t i = 0; i < sizeof(times) / sizeof(times[0]); i++)
+    {
+        size_t len;
+        const char *record = timestamp_format(&cache, times[i], &len);
+        size_t expected_len = reference_format(times[i], expected, sizeof(expected));
+        TEST_ASSERT_EQUAL_INT_MESSAGE(expected_len, len, "wrong record length");
+        TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, record, len, "wrong record");
+    }
+}
+
+/**
+ * Calls within the same second must return the cached record unchanged.
+ */
+void test_timestamp_format_cached_per_second()
+{
+    struct timestamp_cache cache = {.len = 0};
+    size_t len;
+
+    const char *first = timestamp_format(&cache, 1700000000, &len);
+    TEST_ASSERT_EQUAL_INT(1700000000, cache.second);
+    // scribble on the cache, a cache hit must not reformat
+    cache.record[10] = '#';
+    const char *second = timestamp_format(&cache, 1700000000, &len);
+    TEST_ASSERT_TRUE_MESSAGE(first == second, "record moved");
+    TEST_ASSERT_EQUAL_INT_MESSAGE('#', second[10], "record reformatted within the same second");
+
+    timestamp_format(&cache, 1700000001, &len);
+    TEST_ASSERT_EQUAL_INT(1700000001, cache.second);
+    TEST_ASSERT_TRUE_MESSAGE(cache.record[10] != '#', "record not refreshed on a new second");
+}